@@ -0,0 +1,509 @@
+// Micro-benchmarks of the fatmod operations
+// Build and run with: make bench
+// Usage: ./fatmod_bench [-d <directory>] [-s <sizes>] [-n <file counts>] [-i <iterations>] [-o <fatmod options>]
+// ./fatmod_bench -d /dev/shm -s 512,4096,1048576 -n 10,100 -i 20 -o --mmap
+//
+// fatmod.c is compiled with its main renamed to fatmod_main. Every operation runs fatmod_main in a forked child,
+// so each run starts with cold caches like a real invocation but without the cost of exec.
+// The I/O calls of fatmod are wrapped by the linker(--wrap) to count the syscalls, syncs and bytes of each run.
+// The results are printed to the standard output as JSON, one object per operation and size
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+
+#define SUCCESS 0
+#define FAILURE -1
+
+#define BENCH_SECTOR_SIZE 512 // bytes
+#define BENCH_SECTORS_PER_CLUSTER 8 // 4 KB clusters
+#define BENCH_N_FAT_TABLES 2
+#define BENCH_MIN_IMAGE_SIZE 536870912 // bytes, FAT32 needs at least 65525 clusters
+#define BENCH_LARGE_FILE_SIZE 16777216 // bytes, files of at least this size are run with fewer iterations
+#define BENCH_LARGE_FILE_ITERATIONS 5
+#define MAX_BENCH_VALUES 16
+#define MAX_BENCH_ARGUMENTS 16
+
+// The counters of a single run, shared with the forked child
+struct run_counters {
+    long syscalls;
+    long syncs;
+    long bytes_read;
+    long bytes_written;
+    long long latency_ns;
+};
+
+// The result of the runs of an operation
+struct bench_result {
+    const char* operation;
+    long long size;
+    long long transfer_size; // bytes of the file moved by a single run
+    int n_files;
+    int n_runs;
+    long long* latencies_ns;
+    long long total_latency_ns;
+    long syscalls;
+    long syncs;
+    long bytes_read;
+    long bytes_written;
+};
+
+int fatmod_main(int argc, char* argv[]);
+int format_disk_image(char* diskname, long long image_size, int new_cluster_size, int n_fat_tables);
+
+// Format an empty FAT32 volume of the given size into the image file
+static int format_image(const char* path, long long image_size);
+// Run fatmod with the arguments in a forked child and add its counters to the result
+static int run_fatmod(struct bench_result* result, const char* command, ...);
+static void init_result(struct bench_result* result, const char* operation, long long size, long long transfer_size, int n_files, int n_runs);
+static void print_result(struct bench_result* result);
+static int parse_values(char* str, long long* values, int max_values);
+static int compare_latencies(const void* a, const void* b);
+static long long get_time_ns(void);
+
+// Benchmarks of the file operations at a file size, and of the listing at a file count
+static int bench_file_size(long long size, int n_iterations);
+static int bench_file_count(int n_files, int n_iterations);
+
+static struct run_counters* counters;
+static int is_counting;
+static char image_path[PATH_MAX];
+static char* fatmod_options[MAX_BENCH_ARGUMENTS];
+static int n_fatmod_options;
+static int is_first_result = 1;
+
+int main(int argc, char* argv[]) {
+    char* directory = "/dev/shm";
+    char default_sizes[] = "512,4096,65536,1048576,16777216,104857600";
+    char default_counts[] = "10,100,1000";
+    char* sizes_str = default_sizes;
+    char* counts_str = default_counts;
+    int n_iterations = 20;
+
+    int option;
+    while ((option = getopt(argc, argv, "d:s:n:i:o:")) != -1) {
+        if (option == 'd') {
+            directory = optarg;
+        } else if (option == 's') {
+            sizes_str = optarg;
+        } else if (option == 'n') {
+            counts_str = optarg;
+        } else if (option == 'i') {
+            n_iterations = atoi(optarg);
+        } else if (option == 'o' && n_fatmod_options < MAX_BENCH_ARGUMENTS / 2) {
+            fatmod_options[n_fatmod_options++] = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-d <directory>] [-s <sizes>] [-n <file counts>] [-i <iterations>] [-o <fatmod options>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    long long sizes[MAX_BENCH_VALUES];
+    long long counts[MAX_BENCH_VALUES];
+    int n_sizes = parse_values(sizes_str, sizes, MAX_BENCH_VALUES);
+    int n_counts = parse_values(counts_str, counts, MAX_BENCH_VALUES);
+    if (n_sizes == FAILURE || n_counts == FAILURE || n_iterations <= 0) {
+        fprintf(stderr, "Invalid benchmark parameters!\n");
+        return 1;
+    }
+
+    counters = mmap(NULL, sizeof(struct run_counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counters == MAP_FAILED) {
+        fprintf(stderr, "Could not map the counters!\n");
+        return 1;
+    }
+    snprintf(image_path, sizeof(image_path), "%s/fatmod_bench_%d.img", directory, (int) getpid());
+
+    printf("{\n  \"benchmark\": \"fatmod\",\n  \"image\": \"%s\",\n  \"options\": \"", image_path);
+    for (int i = 0; i < n_fatmod_options; i++) {
+        printf("%s%s", i > 0 ? " " : "", fatmod_options[i]);
+    }
+    printf("\",\n  \"results\": [");
+
+    int result = SUCCESS;
+    for (int i = 0; i < n_sizes && result == SUCCESS; i++) {
+        int n_runs = sizes[i] >= BENCH_LARGE_FILE_SIZE && n_iterations > BENCH_LARGE_FILE_ITERATIONS ? BENCH_LARGE_FILE_ITERATIONS : n_iterations;
+        result = bench_file_size(sizes[i], n_runs);
+    }
+    for (int i = 0; i < n_counts && result == SUCCESS; i++) {
+        result = bench_file_count(counts[i], n_iterations);
+    }
+    printf("\n  ]\n}\n");
+
+    unlink(image_path);
+    return result == SUCCESS ? 0 : 1;
+}
+
+// Create, write, read and delete a file of the given size on a fresh image in each iteration
+static int bench_file_size(long long size, int n_iterations) {
+    long long image_size = 2 * size + BENCH_MIN_IMAGE_SIZE;
+    if (format_image(image_path, image_size) == FAILURE) {
+        return FAILURE;
+    }
+
+    struct bench_result create_result;
+    struct bench_result write_result;
+    struct bench_result read_result;
+    struct bench_result delete_result;
+    init_result(&create_result, "create", size, 0, 1, n_iterations);
+    init_result(&write_result, "write", size, size, 1, n_iterations);
+    init_result(&read_result, "read", size, size, 1, n_iterations);
+    init_result(&delete_result, "delete", size, 0, 1, n_iterations);
+
+    char size_str[32];
+    snprintf(size_str, sizeof(size_str), "%lld", size);
+    int result = SUCCESS;
+    for (int i = 0; i < n_iterations && result == SUCCESS; i++) {
+        result = run_fatmod(&create_result, "-c", "BENCH.BIN", NULL);
+        if (result == SUCCESS) {
+            result = run_fatmod(&write_result, "-w", "BENCH.BIN", "0", size_str, "65", NULL);
+        }
+        if (result == SUCCESS) {
+            result = run_fatmod(&read_result, "-r", "-b", "BENCH.BIN", NULL);
+        }
+        if (result == SUCCESS) {
+            result = run_fatmod(&delete_result, "-d", "BENCH.BIN", NULL);
+        }
+    }
+
+    if (result == SUCCESS) {
+        print_result(&create_result);
+        print_result(&write_result);
+        print_result(&read_result);
+        print_result(&delete_result);
+    }
+    free(create_result.latencies_ns);
+    free(write_result.latencies_ns);
+    free(read_result.latencies_ns);
+    free(delete_result.latencies_ns);
+    return result;
+}
+
+// List the root directory with the given number of small files
+// The files are created with a single batch run of fatmod, which is not measured
+static int bench_file_count(int n_files, int n_iterations) {
+    if (format_image(image_path, BENCH_MIN_IMAGE_SIZE) == FAILURE) {
+        return FAILURE;
+    }
+
+    char batch_path[PATH_MAX + 8];
+    snprintf(batch_path, sizeof(batch_path), "%s.batch", image_path);
+    FILE* batch_file = fopen(batch_path, "w");
+    if (batch_file == NULL) {
+        fprintf(stderr, "Could not create the batch file!\n");
+        return FAILURE;
+    }
+    for (int i = 0; i < n_files; i++) {
+        fprintf(batch_file, "-c B%d.TXT\n-w B%d.TXT 0 2000 65\n", i, i);
+    }
+    fclose(batch_file);
+
+    struct bench_result setup_result;
+    struct bench_result list_result;
+    init_result(&setup_result, "setup", 0, 0, n_files, 1);
+    init_result(&list_result, "list", 0, 0, n_files, n_iterations);
+    int result = run_fatmod(&setup_result, "-B", batch_path, NULL);
+    unlink(batch_path);
+    for (int i = 0; i < n_iterations && result == SUCCESS; i++) {
+        result = run_fatmod(&list_result, "-l", NULL);
+    }
+
+    if (result == SUCCESS) {
+        print_result(&list_result);
+    }
+    free(setup_result.latencies_ns);
+    free(list_result.latencies_ns);
+    return result;
+}
+
+// Run fatmod with the options, the image and the NULL terminated command arguments in a forked child
+// The output of fatmod is discarded, the child measures its own latency so that fork is not included
+static int run_fatmod(struct bench_result* result, const char* command, ...) {
+    char* argv[MAX_BENCH_ARGUMENTS * 2];
+    int argc = 0;
+    argv[argc++] = "fatmod";
+    for (int i = 0; i < n_fatmod_options; i++) {
+        argv[argc++] = fatmod_options[i];
+    }
+    argv[argc++] = image_path;
+    argv[argc++] = (char*) command;
+    va_list arguments;
+    va_start(arguments, command);
+    char* argument;
+    while ((argument = va_arg(arguments, char*)) != NULL && argc < MAX_BENCH_ARGUMENTS * 2 - 1) {
+        argv[argc++] = argument;
+    }
+    va_end(arguments);
+    argv[argc] = NULL;
+
+    memset(counters, 0, sizeof(struct run_counters));
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Could not fork!\n");
+        return FAILURE;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+
+        is_counting = 1;
+        long long start = get_time_ns();
+        int status = fatmod_main(argc, argv);
+        fflush(stdout);
+        counters->latency_ns = get_time_ns() - start;
+        _exit(status);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "fatmod %s failed!\n", command);
+        return FAILURE;
+    }
+
+    result->latencies_ns[result->n_runs++] = counters->latency_ns;
+    result->total_latency_ns += counters->latency_ns;
+    result->syscalls += counters->syscalls;
+    result->syncs += counters->syncs;
+    result->bytes_read += counters->bytes_read;
+    result->bytes_written += counters->bytes_written;
+    return SUCCESS;
+}
+
+static void init_result(struct bench_result* result, const char* operation, long long size, long long transfer_size, int n_files, int n_runs) {
+    memset(result, 0, sizeof(struct bench_result));
+    result->operation = operation;
+    result->size = size;
+    result->transfer_size = transfer_size;
+    result->n_files = n_files;
+    result->latencies_ns = calloc(n_runs, sizeof(long long));
+}
+
+// Print the result as a JSON object, the counters are the averages of a single run
+static void print_result(struct bench_result* result) {
+    int n = result->n_runs;
+    if (n == 0) {
+        return;
+    }
+    qsort(result->latencies_ns, n, sizeof(long long), compare_latencies);
+    long long p50 = result->latencies_ns[(n - 1) / 2];
+    long long p99 = result->latencies_ns[(n * 99 + 99) / 100 - 1];
+    double seconds = result->total_latency_ns / 1e9;
+    double ops_per_second = seconds > 0 ? n / seconds : 0;
+    double megabytes_per_second = seconds > 0 ? (double) result->transfer_size * n / seconds / 1048576 : 0;
+
+    printf("%s\n    {\"operation\": \"%s\", \"size\": %lld, \"files\": %d, \"iterations\": %d, ", is_first_result ? "" : ",",
+           result->operation, result->size, result->n_files, n);
+    printf("\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, ", result->total_latency_ns / 1e3 / n, p50 / 1e3, p99 / 1e3);
+    printf("\"ops_per_s\": %.1f, \"throughput_mb_s\": %.1f, ", ops_per_second, megabytes_per_second);
+    printf("\"syscalls\": %.1f, \"syncs\": %.1f, \"bytes_read\": %.0f, \"bytes_written\": %.0f}",
+           (double) result->syscalls / n, (double) result->syncs / n, (double) result->bytes_read / n, (double) result->bytes_written / n);
+    is_first_result = 0;
+}
+
+// Format an empty FAT32 volume with 4 KB clusters and two FAT tables with the formatter of fatmod(-mkfs)
+// The image is a sparse file, only the reserved sectors and the first sector of each FAT table are written
+static int format_image(const char* path, long long image_size) {
+    // The counters are only changed by the runs of fatmod, so the formatting is not counted
+    if (format_disk_image((char*) path, image_size, BENCH_SECTORS_PER_CLUSTER * BENCH_SECTOR_SIZE, BENCH_N_FAT_TABLES) == FAILURE) {
+        fprintf(stderr, "Could not format the image %s!\n", path);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+// Parse the comma separated positive values
+// Return the number of values or FAILURE
+static int parse_values(char* str, long long* values, int max_values) {
+    int n_values = 0;
+    char* save;
+    for (char* token = strtok_r(str, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        if (n_values == max_values) {
+            return FAILURE;
+        }
+        values[n_values] = atoll(token);
+        if (values[n_values] <= 0) {
+            return FAILURE;
+        }
+        n_values++;
+    }
+    return n_values;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return x < y ? -1 : x > y;
+}
+
+static long long get_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The wrappers of the I/O calls of fatmod, the list of the wrapped calls is in the Makefile
+// They count only in the forked child while fatmod runs
+#define COUNT_CALL() if (is_counting) counters->syscalls++
+#define COUNT_SYNC() if (is_counting) counters->syncs++
+#define COUNT_READ(n) if (is_counting && (n) > 0) counters->bytes_read += (n)
+#define COUNT_WRITTEN(n) if (is_counting && (n) > 0) counters->bytes_written += (n)
+
+ssize_t __real_pread(int fd, void* buffer, size_t length, off_t offset);
+ssize_t __real_pwrite(int fd, const void* buffer, size_t length, off_t offset);
+ssize_t __real_preadv2(int fd, const struct iovec* iov, int n_iov, off_t offset, int flags);
+ssize_t __real_pwritev(int fd, const struct iovec* iov, int n_iov, off_t offset);
+ssize_t __real_read(int fd, void* buffer, size_t length);
+ssize_t __real_write(int fd, const void* buffer, size_t length);
+int __real_open(const char* path, int flags, ...);
+int __real_close(int fd);
+int __real_fstat(int fd, struct stat* st);
+int __real_fdatasync(int fd);
+int __real_msync(void* address, size_t length, int flags);
+ssize_t __real_copy_file_range(int fd_in, off_t* offset_in, int fd_out, off_t* offset_out, size_t length, unsigned int flags);
+ssize_t __real_sendfile(int out_fd, int in_fd, off_t* offset, size_t count);
+void* __real_mmap(void* address, size_t length, int protection, int flags, int fd, off_t offset);
+int __real_madvise(void* address, size_t length, int advice);
+int __real_posix_fadvise(int fd, off_t offset, off_t length, int advice);
+int __real_fallocate(int fd, int mode, off_t offset, off_t length);
+long __real_syscall(long number, ...);
+
+ssize_t __wrap_pread(int fd, void* buffer, size_t length, off_t offset) {
+    COUNT_CALL();
+    ssize_t result = __real_pread(fd, buffer, length, offset);
+    COUNT_READ(result);
+    return result;
+}
+
+ssize_t __wrap_pwrite(int fd, const void* buffer, size_t length, off_t offset) {
+    COUNT_CALL();
+    ssize_t result = __real_pwrite(fd, buffer, length, offset);
+    COUNT_WRITTEN(result);
+    return result;
+}
+
+ssize_t __wrap_preadv2(int fd, const struct iovec* iov, int n_iov, off_t offset, int flags) {
+    COUNT_CALL();
+    ssize_t result = __real_preadv2(fd, iov, n_iov, offset, flags);
+    COUNT_READ(result);
+    return result;
+}
+
+ssize_t __wrap_pwritev(int fd, const struct iovec* iov, int n_iov, off_t offset) {
+    COUNT_CALL();
+    ssize_t result = __real_pwritev(fd, iov, n_iov, offset);
+    COUNT_WRITTEN(result);
+    return result;
+}
+
+ssize_t __wrap_read(int fd, void* buffer, size_t length) {
+    COUNT_CALL();
+    ssize_t result = __real_read(fd, buffer, length);
+    COUNT_READ(result);
+    return result;
+}
+
+ssize_t __wrap_write(int fd, const void* buffer, size_t length) {
+    COUNT_CALL();
+    ssize_t result = __real_write(fd, buffer, length);
+    COUNT_WRITTEN(result);
+    return result;
+}
+
+int __wrap_open(const char* path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list arguments;
+        va_start(arguments, flags);
+        mode = va_arg(arguments, mode_t);
+        va_end(arguments);
+    }
+    COUNT_CALL();
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd) {
+    COUNT_CALL();
+    return __real_close(fd);
+}
+
+int __wrap_fstat(int fd, struct stat* st) {
+    COUNT_CALL();
+    return __real_fstat(fd, st);
+}
+
+int __wrap_fdatasync(int fd) {
+    COUNT_CALL();
+    COUNT_SYNC();
+    return __real_fdatasync(fd);
+}
+
+int __wrap_msync(void* address, size_t length, int flags) {
+    COUNT_CALL();
+    COUNT_SYNC();
+    return __real_msync(address, length, flags);
+}
+
+ssize_t __wrap_copy_file_range(int fd_in, off_t* offset_in, int fd_out, off_t* offset_out, size_t length, unsigned int flags) {
+    COUNT_CALL();
+    ssize_t result = __real_copy_file_range(fd_in, offset_in, fd_out, offset_out, length, flags);
+    COUNT_WRITTEN(result);
+    return result;
+}
+
+ssize_t __wrap_sendfile(int out_fd, int in_fd, off_t* offset, size_t count) {
+    COUNT_CALL();
+    ssize_t result = __real_sendfile(out_fd, in_fd, offset, count);
+    COUNT_READ(result);
+    return result;
+}
+
+void* __wrap_mmap(void* address, size_t length, int protection, int flags, int fd, off_t offset) {
+    COUNT_CALL();
+    return __real_mmap(address, length, protection, flags, fd, offset);
+}
+
+int __wrap_madvise(void* address, size_t length, int advice) {
+    COUNT_CALL();
+    return __real_madvise(address, length, advice);
+}
+
+int __wrap_posix_fadvise(int fd, off_t offset, off_t length, int advice) {
+    COUNT_CALL();
+    return __real_posix_fadvise(fd, offset, length, advice);
+}
+
+int __wrap_fallocate(int fd, int mode, off_t offset, off_t length) {
+    COUNT_CALL();
+    return __real_fallocate(fd, mode, offset, length);
+}
+
+// The io_uring calls of fatmod are raw syscalls with at most 6 arguments
+// The syncs submitted to the io_uring queue are not seen here, so they are not counted as syncs
+long __wrap_syscall(long number, ...) {
+    va_list arguments;
+    va_start(arguments, number);
+    long a = va_arg(arguments, long);
+    long b = va_arg(arguments, long);
+    long c = va_arg(arguments, long);
+    long d = va_arg(arguments, long);
+    long e = va_arg(arguments, long);
+    long f = va_arg(arguments, long);
+    va_end(arguments);
+    COUNT_CALL();
+    return __real_syscall(number, a, b, c, d, e, f);
+}
@@ -11,6 +11,8 @@
 // The program will be named fatmod. Through various options, it will interact with a file system image, enabling reading and writing of files.
 
 
+#define _GNU_SOURCE // copy_file_range
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -22,7 +24,26 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
 #include <linux/msdos_fs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <fnmatch.h>
 
 // ___Definitions___
 
@@ -34,60 +55,632 @@
 #define FAT_TABLE_FREE_CLUSTER_VALUE 0x00000000
 #define FAT_TABLE_RESERVED_CLUSTER_VALUE 0x0FFFFFF0
 #define FAT_TABLE_LAST_CLUSTER_VALUE 0x0FFFFFFF
+#define FAT_TABLE_ENTRY_MASK 0x0FFFFFFF // high 4 bits of a FAT32 entry are reserved
+#define FS_INFO_UNKNOWN_VALUE 0xFFFFFFFF // free count and next free fields are unknown
 #define MAX_NUMBER_OF_CLUSTERS_FAT_TABLE 0x10000000 // 2^28, fat entry high 4 bits are reserved
 
+// Durability modes of the writes, given with the --sync option
+#define SYNC_MODE_ALWAYS 0 // the disk image is opened with O_SYNC and synced after every write
+#define SYNC_MODE_OPERATION 1 // the writes of an operation are ordered and synced once at the end
+#define SYNC_MODE_NONE 2 // the disk image is never synced, for scratch images
+
 // Options of the root directory function
 #define FIND_GIVEN_ENTRY 0
 #define LIST_DIRECTORIES 1
 #define FIND_FREE_ENTRY 2
 
-#define SECTORSIZE 512   // bytes
-#define CLUSTERSIZE  1024  // bytes
+// Slot values of the hashed name index of the root directory
+#define NAME_INDEX_EMPTY_SLOT -1
+#define NAME_INDEX_DELETED_SLOT -2
+
+#define MIN_SECTOR_SIZE 512 // bytes, the boot sector is read with this size before the sector size is known
+#define MAX_SECTOR_SIZE 4096 // bytes
+#define MAX_CLUSTER_SIZE 65536 // bytes
 #define FILENAME_SIZE 8 // bytes
 #define FILE_EXTENSION_SIZE 3 // bytes
 #define DOT_SIZE 1 // bytes
 #define FAT_TABLE_ENTRY_SIZE 4 // bytes
 #define TOTAL_FILENAME_SIZE FILE_EXTENSION_SIZE + FILENAME_SIZE // bytes    
 #define FILE_DIRECTORY_ENTRY_SIZE 32 // bytes
-
-#define N_RESERVED_SECTORS 32 // it is assumed that the reserved sectors are 32
-#define N_ROOT_DIRECTORY_CLUSTERS 1 // it is assumed that the root directory is stored in one cluster
-#define N_FAT_TABLES 1 // it is assumed that there is only one FAT table
-#define ASSUMED_CLUSTER_SIZE 2 // it is assumed that the cluster size is 2 sectors   
-#define ASSUMED_SEC_PER_CLUS CLUSTERSIZE/SECTORSIZE // it is assumed that the sectors per cluster is 2
-#define ASSUMED_ROOT_DIRECTORY_CLUSTER 2 // it is assumed that the root directory is stored in the second cluster
+#define FILL_BUFFER_SIZE 1048576 // bytes, the buffer that full clusters are written from
+#define MAX_WRITE_VECTORS 1024 // vectors per pwritev call, the Linux limit
+#define EXTENT_MAP_CACHE_SIZE 64 // number of file extent maps kept in memory
+#define MAX_BATCH_ARGUMENTS 16 // arguments of a single command in batch mode
+#define OUTPUT_BUFFER_SIZE 65536 // bytes, the formatted output is written in blocks of this size
+#define READ_BUFFER_SIZE 65536 // bytes, contiguous clusters of a file are read in blocks of this size
+#define HEX_DUMP_LINE_SIZE 16 // bytes printed in each line of the hexadecimal dump
+#define MAX_HEX_DUMP_LINE_LENGTH (9 + 3 * HEX_DUMP_LINE_SIZE + 2) // offset, bytes and the new lines of the line and of the end
+#define IMPORT_BUFFER_SIZE 1048576 // bytes, data that can not be copied by the kernel is imported in blocks of this size
+#define IMPORT_BUFFER_ALIGNMENT 4096 // bytes
+#define MAX_DIRTY_RANGES 64 // changed ranges of the mapped disk image that are tracked separately for msync
+#define MAX_CHECK_THREADS 16 // worker threads that scan the FAT table in the check mode
+#define MAX_WRITE_REQUESTS 256 // writes submitted to the storage backend in one batch
+#define FAT_FLUSH_MAX_GAP_SECTORS 8 // clean FAT table sectors between dirty ones that are written with them
+#define DEFAULT_READ_AHEAD_WINDOW 524288 // bytes of the file chain that are advised ahead of the reads
+#define MAX_DEFRAG_MOVES 256 // files that are moved between two flushes of the disk image
+#define DEFRAG_BUFFER_SIZE 1048576 // bytes, clusters are copied in blocks of this size
+#define IO_RING_QUEUE_DEPTH 64 // submission queue entries of the io_uring engine
+#define IO_RING_N_BUFFERS 16 // registered read buffers of READ_BUFFER_SIZE bytes, the reads ahead of the consumer
+#define MIN_CHECK_RANGE_SIZE 262144 // FAT table entries, smaller FAT tables are scanned by fewer threads
+#define MAX_PIPELINE_THREADS 16 // reader threads of the read pipeline, each reads and formats whole chunks
+#define PIPELINE_CHUNK_SIZE 131072 // bytes of the file in a chunk of the read pipeline, a multiple of HEX_DUMP_LINE_SIZE
+#define PIPELINE_SLOTS_PER_THREAD 2 // chunk buffers of the pipeline ring for each reader thread
+#define MIN_PIPELINE_FILE_SIZE 1048576 // bytes, smaller files are read and formatted by the main thread
+#define N_LATENCY_BUCKETS 24 // latency histogram buckets of the statistics, bucket i counts latencies below 2^i microseconds
+#define INDEX_FILE_SUFFIX ".fatidx" // the sidecar index of the disk image is named by appending this to its name
+#define INDEX_MAGIC "FATIDX1" // 8 bytes with the terminating zero
+#define INDEX_VERSION 1
+#define INDEX_SECTION_ALIGNMENT 8 // bytes, the sections of the index start at multiples of this
+#define SHARED_FAT_MAGIC "FATSHM1" // 8 bytes with the terminating zero
+#define SHARED_FAT_HEADER_SIZE 64 // bytes, the FAT table of the shared segment starts after the header
+#define SHARED_FAT_ATTACH_LOCK_BYTE 0 // byte of the shared segment that is locked while a process attaches or detaches
+#define SHARED_FAT_USERS_LOCK_BYTE 1 // byte of the shared segment that every attached process holds a shared lock on
+#define MAX_CLAIM_ATTEMPTS 16 // searches for a contiguous run when other processes claim the found runs first
+
+#define IMAGE_BLOCK_SIZE 1048576 // bytes, snapshots are copied and disk images are compared in blocks of this size
+#define UNCOMPARABLE_EXTENT_FLAGS (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED \
+    | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL) // extents without a block of their own
+
+#define JOURNAL_MAGIC "FATJNL1" // 8 bytes with the terminating zero
+#define JOURNAL_TRANSACTION_MAGIC "FATTXN1" // 8 bytes with the terminating zero
+#define JOURNAL_FIRST_SECTOR 12 // the journal starts after the boot sectors, the FSInfo sector and their backups
+#define JOURNAL_MIN_SECTORS 4 // reserved sectors the journal needs, the header sector and at least 3 sectors of transactions
+#define JOURNAL_RANGE_FAT_TABLE 1 // flag of a range of the FAT table, its offset is in the FAT table and it is written to every copy
+
+// Operations of the server protocol with --serve
+#define SERVE_CREATE 1
+#define SERVE_WRITE 2
+#define SERVE_READ 3
+#define SERVE_DELETE 4
+#define SERVE_LIST 5
+#define SERVE_IMPORT 6
+#define SERVE_EXPORT 7
+#define SERVE_MAX_CLIENTS 256 // connections of the server, more connections are refused
+#define SERVE_MAX_EVENTS 64 // events taken from epoll at once
+#define SERVE_MAX_REQUEST_SIZE 67108864 // bytes of the payload of a request, an import is sent in a single request
+
+// Volumes formatted with -mkfs
+#define FORMAT_RESERVED_SECTORS 32 // reserved sectors of a formatted volume, the journal uses the ones after the boot sectors
+#define FORMAT_BACKUP_BOOT_SECTOR 6
+#define FORMAT_DEFAULT_CLUSTER_SIZE 1024 // bytes
+#define FORMAT_DEFAULT_FAT_TABLES 2
+#define FORMAT_MAX_FAT_TABLES 4
+#define FAT32_MIN_CLUSTERS 65525 // the FAT type is found from the cluster count, a volume with fewer clusters is FAT16 or FAT12
+
+#define MAX_ROOT_DIRECTORY_ENTRIES 65536 // FAT limit on the number of entries in a directory
+#define MIN_ROOT_DIRECTORY_INDEX_SIZE 64 // slots of the hashed name index, always a power of 2
+#define FAT_MIRRORING_DISABLED_FLAG 0x80 // flag of the FAT32 extended flags, only the active FAT table is used then
+#define FAT_ACTIVE_TABLE_MASK 0x0F // active FAT table number in the FAT32 extended flags
+
+// Statistics with --stats, compiled out with -DFATMOD_NO_STATS
+// The counters are only updated when --stats is given, otherwise each counting point is a single branch
+#ifndef FATMOD_NO_STATS
+#define STATS_COUNT(counter, n_bytes) if (is_stats_requested) count_operation(counter, n_bytes, -1)
+#define STATS_ADD(variable, n) if (is_stats_requested) variable += (n)
+#define STATS_TIMER_START(timer) long long timer = is_stats_requested ? get_monotonic_time_ns() : 0
+#define STATS_TIMER_END(counter, timer, n_bytes) if (is_stats_requested) count_operation(counter, n_bytes, get_monotonic_time_ns() - timer)
+#else
+#define STATS_COUNT(counter, n_bytes) ((void) 0)
+#define STATS_ADD(variable, n) ((void) 0)
+#define STATS_TIMER_START(timer) ((void) 0)
+#define STATS_TIMER_END(counter, timer, n_bytes) ((void) 0)
+#endif
+
+// ___Type Definitions___
+
+// A run of contiguous clusters in the cluster chain of a file
+struct cluster_extent {
+    unsigned int first_cluster; // cluster number of the first cluster of the run
+    unsigned int length; // number of clusters in the run
+    unsigned int file_cluster; // index of the first cluster of the run in the file
+};
+
+// The cluster chain of a file as a sorted list of extents
+struct extent_map {
+    unsigned int first_cluster; // first cluster of the file, 0 if the map is not used
+    unsigned int n_clusters; // number of clusters in the chain
+    int n_extents;
+    int capacity;
+    struct cluster_extent* extents;
+};
+
+// A write of a buffer to an offset of the disk image, submitted in batches to the storage backend
+struct write_request {
+    off_t offset;
+    const void* buffer;
+    size_t length;
+};
+
+// Storage backend of the disk image, every access to the disk image goes through one of these
+// The fd backend uses pread and pwrite on the file descriptor, the mmap backend maps the whole disk image
+struct storage_backend {
+    const char* name;
+    ssize_t (*read_at)(int fd, void* buffer, size_t length, off_t offset);
+    ssize_t (*write_at)(int fd, const void* buffer, size_t length, off_t offset);
+    ssize_t (*writev_at)(int fd, const struct iovec* iov, int iov_count, off_t offset);
+    int (*sync)(int fd); // sync the written data of the disk image
+    int (*zero_range)(int fd, off_t offset, off_t length); // zero the range without writing it, fails with EOPNOTSUPP if it can not
+    int (*write_batch)(int fd, const struct write_request* requests, int n_requests, int is_synced); // submit the writes together
+    // Read the file along its extents in blocks and pass each block to the consumer in file order
+    int (*read_file_blocks)(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context);
+};
+
+// Walks the blocks of a file along its extents, a block does not cross an extent or the end of the file
+struct file_block_cursor {
+    struct extent_map* map;
+    int file_size;
+    int max_block_length;
+    int extent_index;
+    int file_offset; // file offset of the next block
+};
+
+// Read-ahead stage of a file read, a second cursor runs ahead of the reads along the cluster chain
+// and advises the kernel to read the next window of the file, disk adjacent blocks are advised together
+struct read_ahead {
+    struct file_block_cursor cursor;
+    int advised_file_offset; // the file is advised up to this offset
+};
+
+// The io_uring instance of the io_uring engine with its mapped rings and its read buffer pool
+struct io_ring {
+    int ring_fd;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_ring_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_ring_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    unsigned int sq_entries;
+    unsigned int n_unsubmitted;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned char* buffers; // IO_RING_N_BUFFERS buffers of READ_BUFFER_SIZE bytes
+    int is_buffers_registered; // the fixed buffer reads are used if the buffers could be registered
+};
+
+// A range of the FAT table that is scanned by a worker thread of the check mode, with its results
+struct fat_scan_range {
+    unsigned int first_cluster;
+    unsigned int last_cluster; // inclusive
+    unsigned long long* referenced_clusters; // shared bitmap of the clusters that some FAT table entry links to
+    unsigned long long* owned_clusters; // shared bitmap of the clusters in the chains of the directory entries
+    int n_free;
+    int n_end_of_chain;
+    int n_bad;
+    int n_invalid_links; // entries that link to a cluster that can not be allocated
+    int n_multiply_linked; // clusters that more than one FAT table entry links to
+    int n_orphaned; // used clusters that are not in the chain of any directory entry
+    int n_orphaned_chains; // orphaned clusters that no entry links to
+    pthread_t thread;
+};
+
+// A planned move of a fragmented file to a contiguous run of clusters
+struct defrag_move {
+    int directory_entry_index;
+    unsigned int old_first_cluster;
+    unsigned int new_first_cluster;
+};
+
+// Counted operations of the statistics, the names are in stats_operation_names
+enum stats_operation {
+    STATS_READ_SECTOR,
+    STATS_READ_CLUSTER,
+    STATS_WRITE_CLUSTER,
+    STATS_GET_FAT_TABLE_ENTRY,
+    STATS_WRITE_FAT_TABLE_ENTRY,
+    STATS_WRITE_FILE_DIRECTORY_ENTRY,
+    STATS_STORAGE_READ,
+    STATS_STORAGE_WRITE,
+    STATS_STORAGE_WRITEV,
+    STATS_STORAGE_SYNC,
+    STATS_STORAGE_ZERO_RANGE,
+    STATS_STORAGE_WRITE_BATCH,
+    STATS_STORAGE_READ_FILE_BLOCKS,
+    N_STATS_OPERATIONS
+};
+
+// Calls, bytes and latencies of a counted operation, only the timed operations have latencies
+struct operation_stats {
+    long long calls;
+    long long bytes;
+    long long timed_calls;
+    long long total_latency_ns;
+    long long max_latency_ns;
+    long long latency_buckets[N_LATENCY_BUCKETS];
+};
+
+// A buffer of the ring of the read pipeline, it holds one chunk of the file and its formatted form
+// The sequence is the number of the chunk that may be read into the slot, or that number + 1 once it is formatted
+struct pipeline_slot {
+    int sequence;
+    int output_length;
+    int is_failed;
+    unsigned char* bytes;
+    char* output;
+};
+
+// The state of the read pipeline that is shared by the reader threads and the writer
+struct read_pipeline {
+    int fd;
+    struct extent_map* map;
+    int file_size;
+    int readable_size; // bytes of the file covered by the cluster chain
+    int is_binary;
+    int n_chunks;
+    int next_chunk; // next chunk to be claimed by a reader thread
+    int n_slots;
+    struct pipeline_slot* slots;
+};
+
+// Header of the sidecar index, the sections follow it at the given offsets
+// The index is valid while the disk image has the same size, inode, mtime and ctime, and the FAT table has the same checksum
+struct index_header {
+    char magic[8]; // INDEX_MAGIC
+    unsigned int version;
+    unsigned int cluster_size; // in bytes
+    unsigned int max_cluster_number;
+    unsigned int fat_size; // in sectors
+    long long image_size; // in bytes
+    long long image_inode;
+    long long image_mtime_ns;
+    long long image_ctime_ns;
+    unsigned long long fat_checksum;
+    int free_cluster_count;
+    int n_bitmap_words;
+    int n_root_directory_clusters;
+    int n_files;
+    unsigned int n_extents;
+    unsigned int reserved;
+    long long bitmap_offset; // in bytes, the free cluster bitmap
+    long long root_directory_offset; // in bytes, the cluster numbers of the root directory in chain order
+    long long files_offset; // in bytes, the file records sorted by their first clusters
+    long long extents_offset; // in bytes, the extents of the files, the extents of a file are consecutive
+};
+
+// The cluster chain of a file in the sidecar index, found by its first cluster
+struct index_file_record {
+    unsigned int first_cluster;
+    unsigned int n_clusters;
+    unsigned int n_extents;
+    unsigned int first_extent; // index of the first extent of the file in the extents section
+};
+
+// A run of contiguous clusters of a file in the sidecar index
+struct index_extent {
+    unsigned int first_cluster;
+    unsigned int length;
+};
+
+// Header of the shared memory segment of the FAT table with --shared-fat
+// The FAT table and the free cluster bitmap of the volume follow it at the given offsets
+struct shared_fat_header {
+    char magic[8]; // SHARED_FAT_MAGIC, set once the segment is loaded
+    unsigned int max_cluster_number;
+    unsigned int fat_size; // in sectors
+    unsigned int sector_size; // in bytes
+    int free_cluster_count; // changed with atomic operations
+    long long fat_offset; // in bytes from the start of the segment
+    long long bitmap_offset; // in bytes from the start of the segment
+};
+
+// Header sector of the journal in the reserved sectors, the transactions of its sequence follow it
+// The sequence is incremented at every checkpoint, so the transactions that are written in place become invalid
+struct journal_header {
+    char magic[8]; // JOURNAL_MAGIC
+    unsigned int sequence;
+    unsigned int checksum; // of the magic and the sequence
+};
+
+// Transaction of the journal, the metadata writes of a flush. The ranges follow it and it is padded to whole sectors
+// A transaction is valid if it has the sequence of the header and its checksum matches, a torn transaction is ignored
+struct journal_transaction {
+    char magic[8]; // JOURNAL_TRANSACTION_MAGIC
+    unsigned int sequence;
+    unsigned int length; // bytes of the ranges after the header
+    unsigned int checksum; // of the header with a zero checksum and the ranges
+    unsigned int reserved;
+};
+
+// A metadata write of a transaction, its bytes follow it
+struct journal_range {
+    unsigned long long offset; // in bytes, from the start of the disk image or of the FAT table
+    unsigned int length;
+    unsigned int flags; // JOURNAL_RANGE_FAT_TABLE
+};
+
+// Request of the server protocol, followed by payload_length bytes: the file name and then the data of an import
+// The numbers are in the byte order of the host, the server and its clients run on the same machine
+struct serve_request {
+    unsigned int payload_length;
+    unsigned char operation; // SERVE_CREATE, SERVE_WRITE, ...
+    unsigned char name_length; // bytes of the file name at the start of the payload, 0 for SERVE_LIST
+    unsigned char data; // byte written by SERVE_WRITE
+    unsigned char reserved;
+    unsigned int offset; // file offset of SERVE_WRITE and SERVE_READ
+    unsigned int length; // bytes written by SERVE_WRITE and read by SERVE_READ
+};
+
+// Response of the server protocol, followed by payload_length bytes: the listing or the bytes of the file
+struct serve_response {
+    unsigned int payload_length;
+    int status; // SUCCESS or FAILURE
+};
+
+// A client connection of the server with its unparsed input and the responses that wait for the group commit
+// or for the socket. While responses wait for the socket the client is not read, so a slow reader only delays itself
+struct serve_client {
+    int socket;
+    int is_closed; // no more requests are read, the connection is closed once the queued responses are sent
+    int is_output_waiting; // the socket was full, epoll waits for it to be writable instead of readable
+    unsigned char* input;
+    int input_length;
+    int input_capacity;
+    unsigned char* output;
+    int output_length;
+    int output_capacity;
+    int output_sent; // bytes of the output that were sent
+};
+
+// A changed byte range of the mapped disk image
+struct dirty_range {
+    off_t start;
+    off_t end; // exclusive
+};
 
 // ___Function Prototypes___
 
+// Open the disk image and read the geometry of the volume from the boot sector
+int open_disk_image(char* diskname, int flags);
+// Execute a single command given in the command line form, argv[2] is the option
+int execute_command(int fd, int argc, char* argv[]);
+// Format the disk image as an empty FAT32 volume, the image is created if it does not exist
+int format_disk_image(char* diskname, long long image_size, int new_cluster_size, int n_fat_tables);
+long long parse_image_size(char* str);
+// Clone the disk image to a new image, with a reflink where the file system supports it
+int snapshot_disk_image(int fd, char* snapshot_name);
+int copy_data_segments(int fd, int snapshot_fd, off_t size);
+// Compare the disk image with another image of the same geometry, the FAT tables first and then the clusters
+int diff_disk_images(int fd, char* other_name);
+struct fiemap* get_file_extents(int fd);
+int find_file_extent(struct fiemap* extents, off_t offset);
+int is_range_same_on_disk(struct fiemap* extents, struct fiemap* other_extents, off_t offset, off_t length, int is_same_file_system);
+// Execute the commands in the batch file, one command per line, against the open disk image
+int run_batch_file(int fd, char* diskname, char* batch_file_name);
+// Write back the cached changes and sync the disk image
+int flush_disk_image(int fd);
+// Sync the disk image if every write must be synced
+void sync_disk_image(int fd);
+// Journal of the metadata writes in the reserved sectors
+int open_journal(int fd, int is_writer);
+int read_journal(int fd);
+int is_journal_applied(int fd);
+int find_journal_end(unsigned int sequence);
+int apply_journal_transactions(int fd, unsigned char* transactions, int length);
+int write_journal_header(int fd, unsigned int sequence);
+int add_journal_range(off_t offset, const void* bytes, size_t length, unsigned int flags);
+int commit_journal_transaction(int fd);
+int checkpoint_journal(int fd);
+unsigned int get_journal_checksum(const unsigned char* bytes, size_t length);
+// Remove the options starting with -- from the arguments and apply them
+int parse_global_options(int argc, char* argv[]);
+// Unmap and close the disk image
+void close_disk_image(int fd);
+
+// Storage backends
+ssize_t fd_read_at(int fd, void* buffer, size_t length, off_t offset);
+ssize_t fd_write_at(int fd, const void* buffer, size_t length, off_t offset);
+ssize_t fd_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset);
+int fd_sync(int fd);
+int fd_zero_range(int fd, off_t offset, off_t length);
+int write_requests_one_by_one(int fd, const struct write_request* requests, int n_requests, int is_synced);
+int fd_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context);
+int mmap_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context);
+int get_next_file_block(struct file_block_cursor* cursor, off_t* disk_offset, int* file_offset, int* length);
+void init_read_ahead(struct read_ahead* read_ahead, struct extent_map* map, int file_size);
+void advance_read_ahead(int fd, struct read_ahead* read_ahead, int file_offset);
+void advise_disk_range(int fd, off_t start, off_t end);
+int read_block_counting_hits(int fd, unsigned char* buffer, int length, off_t offset);
+void print_read_ahead_statistics();
+int mmap_zero_range(int fd, off_t offset, off_t length);
+int zero_disk_range(int fd, off_t offset, off_t length);
+
+// Statistics
+void count_operation(enum stats_operation operation, long long n_bytes, long long latency_ns);
+long long get_monotonic_time_ns();
+void print_statistics();
+ssize_t stats_read_at(int fd, void* buffer, size_t length, off_t offset);
+ssize_t stats_write_at(int fd, const void* buffer, size_t length, off_t offset);
+ssize_t stats_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset);
+int stats_sync(int fd);
+int stats_zero_range(int fd, off_t offset, off_t length);
+int stats_write_batch(int fd, const struct write_request* requests, int n_requests, int is_synced);
+int stats_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context);
+
+// io_uring engine
+int setup_io_ring(int fd);
+void close_io_ring();
+struct io_uring_sqe* get_io_ring_sqe();
+int submit_io_ring(unsigned int wait_nr);
+int wait_io_ring_completion(unsigned long long* user_data, int* result);
+int run_io_ring_request(int opcode, int fd, const void* address, unsigned int length, off_t offset);
+ssize_t uring_read_at(int fd, void* buffer, size_t length, off_t offset);
+ssize_t uring_write_at(int fd, const void* buffer, size_t length, off_t offset);
+ssize_t uring_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset);
+int uring_sync(int fd);
+int uring_write_batch(int fd, const struct write_request* requests, int n_requests, int is_synced);
+int uring_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context);
+int map_disk_image(int fd);
+ssize_t mmap_read_at(int fd, void* buffer, size_t length, off_t offset);
+ssize_t mmap_write_at(int fd, const void* buffer, size_t length, off_t offset);
+ssize_t mmap_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset);
+int mmap_sync(int fd);
+void mark_image_range_dirty(off_t start, off_t end);
+int make_fat_table_cache_private();
+
 // Read the root directory from the disk image which is stored in the second cluster
 int read_root_directory(int fd, int is_list_directories);
+// Load every cluster of the root directory and build its name index
+int load_root_directory(int fd);
+int extend_root_directory(int fd);
+int get_free_root_directory_entry(int fd);
+void update_root_directory_index(int directory_entry_index, unsigned char* old_entry_raw, unsigned char* new_entry_raw);
+int is_indexed_file_entry(struct msdos_dir_entry* entry);
+void get_file_name_of_entry(struct msdos_dir_entry* entry, char* file_name);
+void pack_file_name(const char* file_name, unsigned char* packed_name);
+unsigned int hash_packed_file_name(const unsigned char* packed_name);
+int find_name_index_slot(const unsigned char* packed_name);
+int insert_into_name_index(int directory_entry_index);
+void remove_from_name_index(int directory_entry_index);
+int resize_name_index(int capacity);
 // Read the file in binary or ASCII
 void read_file(int fd, int is_binary);
+// Export the raw contents of the file to the standard output or to a host file
+int export_file(int fd, char* host_file_name);
+// Import the contents of a host file or the standard input into the file, the file is created if needed
+int import_file(int fd, char* host_file_name);
+int import_from_host_fd(int fd, int host_fd);
 // Create a file named with given input in the root directory
 int create_file_entry(int fd);
+// Check the consistency of the FAT table and the chains of the directory entries without changing the disk image
+int check_disk_image(int fd);
+void* scan_fat_table_range(void* argument);
+void* count_orphaned_clusters(void* argument);
+int run_fat_scan_workers(struct fat_scan_range* ranges, int n_ranges, void* (*worker)(void*));
+int check_cluster_chain(int fd, unsigned int first_cluster, int file_size, const char* name, unsigned long long* owned_clusters);
+// Move the chains of the fragmented files to contiguous runs of clusters
+int defragment_files(int fd, int is_single_file);
+int copy_chain_to_run(int fd, struct extent_map* map, unsigned int new_first_cluster);
+int commit_defrag_moves(int fd, struct defrag_move* moves, int n_moves);
+void print_fragmentation(int fd, const char* title, int directory_entry_index);
+unsigned int allocate_cluster_run(int fd, int count);
 // Delete the file named with given input in the root directory, and free the blocks allocated for it in the FAT
 int delete_file(int fd);
+int delete_files(int fd, char** names, int n_names);
+int delete_file_at(int fd, int directory_entry_index);
+int check_file_name_pattern(char* str);
 // Write the bytes to the file
 int write_bytes_to_file(int fd, int start_offset, int length, int data);
+int resize_file(int fd, int new_size, int is_zeroed);
 // print the help message about the usage of the program
 void print_help_message();
 
 int read_sector(int fd, unsigned char* buffer, unsigned int snum);
 int read_cluster(int fd, unsigned char* buffer, unsigned int cluster_number);
+off_t get_cluster_offset(unsigned int cluster_number);
 
 int write_sector(int fd, unsigned char* buffer, unsigned int snum);
 int write_cluster(int fd, unsigned char* buffer, unsigned int cluster_number);
 int write_fat_table_entry(int fd, unsigned int cluster_number, unsigned int value);
+int fill_cluster_chain(int fd, struct extent_map* map, unsigned int first_file_cluster, int cluster_offset, int length, int data, int existing_length);
+int write_iovecs(int fd, struct iovec* iov, int iov_count, off_t offset);
+int free_cluster_chain(int fd, unsigned int first_cluster);
+int import_to_clusters(int fd, int host_fd, unsigned int* clusters, int n_clusters, int length, unsigned char* buffer);
+int read_full(int fd, unsigned char* buffer, int length);
 int write_file_directory_entry(int fd, int directory_entry_index);
+int flush_root_directory(int fd);
 
 int get_next_FAT_table_entry(int fd, unsigned int cluster_number);
 
+struct extent_map* get_extent_map(int fd, unsigned int first_cluster);
+int build_extent_map(int fd, struct extent_map* map, unsigned int first_cluster);
+int append_to_extent_map(struct extent_map* map, unsigned int* clusters, int count);
+int find_extent_index(struct extent_map* map, unsigned int file_cluster);
+unsigned int get_extent_map_cluster(struct extent_map* map, unsigned int file_cluster);
+void invalidate_extent_map(unsigned int first_cluster);
+int load_fat_table_cache(int fd);
+int flush_fat_table_cache(int fd);
+off_t get_fat_table_copy_offset(int copy);
+int check_fat_table_copies(int fd);
+
+int build_free_cluster_bitmap(int fd);
+int allocate_clusters(int fd, int count, unsigned int* clusters);
+unsigned int find_free_cluster_run(unsigned int start, unsigned int end, int count);
+void mark_cluster_free(unsigned int cluster_number);
+int claim_clusters(unsigned int first_cluster, int count);
+int release_cluster(unsigned int cluster_number);
+void add_to_free_cluster_count(int n);
+void refresh_free_cluster_count();
+int read_fs_info_sector(int fd);
+int write_fs_info_sector(int fd);
+int count_free_fat_table_entries(unsigned int first, unsigned int last);
+unsigned int get_free_fat_table_entries_mask(unsigned int first);
+
+// Buffered output of the file contents
+void dump_file_bytes(unsigned char* buffer, int length, int file_offset, int file_size, int is_binary);
+int get_formattable_length(int space, int is_binary);
+int format_file_bytes(unsigned char* buffer, int length, int file_offset, int file_size, int is_binary, char* output);
+void format_hex_dump_line(unsigned char* bytes, char* line);
+void output_bytes(const char* bytes, int length);
+int flush_output();
+
 int char_overflow_check(int value);
 int bytes_to_int(char* bytes, int length);
 int unsigned_bytes_to_int(unsigned char* bytes, int length);
 void int_to_bytes(int val, char* bytes);
 void int_to_unsigned_bytes(int val, unsigned char* bytes);
 
+// Visit the contiguous byte ranges of a file on the disk image
+int walk_file_extents(int fd, struct extent_map* map, int file_size, int (*visit)(int fd, off_t disk_offset, int file_offset, int length, void* context), void* context);
+int dump_file_block(unsigned char* bytes, int file_offset, int length, void* context);
+
+// Read pipeline of the large files, reader threads read and format chunks that the main thread writes in order
+int get_n_read_pipeline_threads(int file_size);
+int run_read_pipeline(int fd, struct extent_map* map, int file_size, int is_binary, int n_threads);
+void* read_pipeline_worker(void* argument);
+int read_file_range(int fd, struct extent_map* map, int file_offset, int length, unsigned char* buffer);
+void wait_for_sequence(int* sequence, int value);
+void publish_sequence(int* sequence, int value);
+int copy_file_range_to_fd(int fd, off_t disk_offset, int file_offset, int length, void* context);
+
+// Sidecar index of the disk image with the free cluster bitmap, the root directory chain and the extents of the files
+int load_index(int fd, char* diskname);
+int save_index(int fd);
+int is_index_usable();
+void drop_index();
+void check_index_fat_checksum();
+unsigned long long get_fat_table_checksum();
+struct index_file_record* find_index_file_record(unsigned int first_cluster);
+int load_extent_map_from_index(struct extent_map* map, unsigned int first_cluster);
+int is_index_section_valid(long long offset, long long n_elements, size_t element_size, off_t index_size);
+int compare_index_file_records(const void* a, const void* b);
+int write_index_section(int index_fd, const void* bytes, size_t length, off_t offset);
+
+// Advisory locks of the FAT tables and the root directory between the processes of the disk image
+int lock_disk_image(int fd, char* option);
+int is_reader_option(char* option);
+int lock_disk_range(int fd, short type, off_t start, off_t length);
+int lock_fat_tables(int fd, short type);
+int lock_root_directory_clusters(int fd, short type, int first_cluster_index, int end_cluster_index);
+int lock_directory_entry(int fd, int directory_entry_index);
+
+// FAT table and free cluster bitmap in shared memory, the processes claim free clusters with atomic operations
+int attach_shared_fat(int fd);
+void detach_shared_fat();
+void release_pending_free_clusters();
+
+// Server mode, the disk image stays open with its caches and the requests of the clients are executed in rounds
+int run_server(int fd, char* socket_path);
+void stop_server(int signal_number);
+void accept_serve_clients(int listen_socket, int epoll_fd);
+int read_serve_client(struct serve_client* client);
+int get_serve_request_size(struct serve_client* client);
+void execute_serve_requests(int fd, struct serve_client* client);
+int execute_serve_request(int fd, struct serve_client* client, struct serve_request* request, unsigned char* payload);
+int queue_serve_file_range(int fd, struct serve_client* client, struct serve_request* request);
+int queue_serve_files(struct serve_client* client, int fd);
+int queue_serve_response(struct serve_client* client, int status, const void* payload, int length);
+unsigned char* reserve_serve_output(struct serve_client* client, long long length);
+void commit_serve_requests(int fd, int epoll_fd);
+void send_serve_output(struct serve_client* client, int epoll_fd);
+void close_serve_client(int epoll_fd, int client_index);
+
+int set_input_file_name(char* name);
 int check_set_file_name(char* str);
 int get_length_of_file_name(char* str);
 
@@ -95,32 +688,206 @@ int get_length_of_file_name(char* str);
 
 // ___Global Variables___
 
-int sector_size;
+// Geometry of the volume, read from the boot sector
+// The sector and cluster sizes are powers of 2, so the cluster offsets are calculated with shifts
+int sector_size = MIN_SECTOR_SIZE; // in bytes
 int reserved_sectors;
 int total_sectors;
 
 int root_directory_cluster_number; // in clusters
-int root_directory_cluster_offset; // in sectors
+off_t root_directory_cluster_offset; // in bytes, the offset of the data region that starts with cluster 2
 int root_directory_max_content_size; // in directory entries
 
 int sectors_per_cluster;
+int cluster_size; // in bytes
+int cluster_size_shift; // log2 of the cluster size
 int usable_clusters_size;
+unsigned int max_cluster_number; // the last cluster number that can be allocated
+
+// Durability mode, the default syncs once at the end of each operation(or batch)
+int sync_mode = SYNC_MODE_OPERATION;
+int is_batch_mode;
+// Set when file data is written but not synced yet, data is synced before the metadata refers to it
+int is_data_pending;
+
+// Storage backends of the disk image, the fd backend is the default
+// --mmap selects the mmap backend and --io-uring selects the io_uring backend
+// The io_uring backend zeroes ranges with fallocate like the fd backend
+struct storage_backend fd_backend = { "fd", fd_read_at, fd_write_at, fd_writev_at, fd_sync, fd_zero_range,
+    write_requests_one_by_one, fd_read_file_blocks };
+struct storage_backend mmap_backend = { "mmap", mmap_read_at, mmap_write_at, mmap_writev_at, mmap_sync, mmap_zero_range,
+    write_requests_one_by_one, mmap_read_file_blocks };
+struct storage_backend uring_backend = { "io_uring", uring_read_at, uring_write_at, uring_writev_at, uring_sync, fd_zero_range,
+    uring_write_batch, uring_read_file_blocks };
+struct storage_backend* storage = &fd_backend;
+struct storage_backend* requested_storage = &fd_backend;
+
+// Read-ahead window in bytes, set with --read-ahead=<KB>, 0 disables the read-ahead
+int read_ahead_window = DEFAULT_READ_AHEAD_WINDOW;
+// Statistics of the read-ahead, printed with --read-ahead-stats
+// A hit is a block that is already in the page cache when it is read, a miss is a block that must wait for the disk
+int is_read_ahead_stats_requested;
+long long read_ahead_hits;
+long long read_ahead_misses;
+long long read_ahead_advised_bytes;
+long long read_ahead_advice_calls;
+int is_nowait_read_supported = 1;
+// Cleared when the storage backend can not zero ranges, the zero fills are written then
+int is_zero_range_supported = 1;
+// Set when a range of the mapped disk image is zeroed through the file, so the mapping is not enough to sync it
+int is_image_range_zeroed;
+
+// Reader threads of the read pipeline, set with --read-threads=<n>, 0 uses one thread for each processor
+// and 1 reads every file in the main thread
+int read_pipeline_threads = 0;
+
+// Statistics of the operations, printed as JSON to the standard error with --stats
+// The storage backend is wrapped by the stats backend, which counts and times the calls of the measured backend
+int is_stats_requested;
+struct operation_stats operation_stats[N_STATS_OPERATIONS];
+const char* stats_operation_names[N_STATS_OPERATIONS] = { "read_sector", "read_cluster", "write_cluster",
+    "get_next_FAT_table_entry", "write_fat_table_entry", "write_file_directory_entry", "storage_read",
+    "storage_write", "storage_writev", "storage_sync", "storage_zero_range", "storage_write_batch", "storage_read_file_blocks" };
+long long stats_syncs;
+long long stats_fat_entries_scanned;
+long long stats_clusters_allocated;
+long long stats_clusters_freed;
+struct storage_backend* measured_storage;
+struct storage_backend stats_backend = { "stats", stats_read_at, stats_write_at, stats_writev_at, stats_sync, stats_zero_range,
+    stats_write_batch, stats_read_file_blocks };
+
+// io_uring instance of the io_uring backend
+struct io_ring io_ring = { .ring_fd = -1 };
+
+// Mapping of the whole disk image for the mmap backend
+unsigned char* image_map;
+off_t image_map_size;
+// Changed ranges of the mapping that are synced with msync
+struct dirty_range image_dirty_ranges[MAX_DIRTY_RANGES];
+int n_image_dirty_ranges;
 
 int fat_size; // in sectors 
 int usable_fat_table_size;
 int number_of_fat_tables;
-int fat_table_offset; // in sectors
-
-unsigned char boot_sector_raw[SECTORSIZE];
-// Used for reading the root directory, which is stored in the second cluster
-unsigned char root_directory[CLUSTERSIZE];
+int n_mirrored_fat_tables; // FAT tables that are kept in sync, 1 if the mirroring is disabled
+int fat_table_offset; // in bytes, the offset of the first(or the active) FAT table
+
+unsigned char boot_sector_raw[MAX_SECTOR_SIZE];
+// Used for reading the root directory, which starts in the second cluster and follows its cluster chain
+// Every cluster is read once and kept in sync with the directory entry writes
+unsigned char* root_directory;
+unsigned int* root_directory_clusters; // cluster numbers of the root directory in chain order
+int root_directory_n_clusters;
+int is_root_directory_loaded;
+// Range of the changed entries of the cached root directory, written back when the disk image is flushed
+int root_directory_first_dirty_entry = -1;
+int root_directory_last_dirty_entry = -1;
+unsigned char* root_directory_dirty_clusters; // one flag per cluster of the root directory
+
+// Hashed index from the packed 11 byte names of the files to their entries, with linear probing
+// The packed name of every indexed entry is kept in root_directory_names
+int* name_index;
+int name_index_capacity;
+int name_index_used_slots; // including the deleted slots
+unsigned char* root_directory_names;
+// Free entries of the root directory, deleted entries are reused first
+// The entries starting from root_directory_end_entry were never used and end the directory
+int* free_directory_entries;
+int n_free_directory_entries;
+int root_directory_end_entry;
 unsigned char file_directory_entry_raw[FILE_DIRECTORY_ENTRY_SIZE];
-// Used for reading the FAT table entry
-unsigned char fat_table_entry[FAT_TABLE_ENTRY_SIZE];
 // Used for reading the root directory, file name + dot + extension
 char total_file_name[TOTAL_FILENAME_SIZE + DOT_SIZE];
 // Given input file name
-char input_file_name[TOTAL_FILENAME_SIZE];
+char input_file_name[TOTAL_FILENAME_SIZE + 1];
+
+// FAT table cache, the first FAT table is read once and every lookup and update is served from memory
+// Updated sectors are marked dirty and only those sectors are written back to the disk image
+unsigned char* fat_table_cache;
+int is_fat_table_cache_mapped; // set if the cache points into the mapping of the mmap backend
+unsigned char* fat_table_cache_dirty_sectors; // one flag per sector of the FAT table
+int fat_table_cache_first_dirty_sector = -1;
+int fat_table_cache_last_dirty_sector = -1;
+
+// Free cluster bitmap, a set bit means the cluster is free
+// It is built from the FAT table cache once and kept in sync with the allocations and frees
+unsigned long long* free_cluster_bitmap;
+int free_cluster_count;
+// Next-fit allocation hint, the search for free clusters starts from this cluster
+unsigned int next_free_cluster_hint;
+
+// Extent maps of the files, indexed by the first cluster of the file
+struct extent_map extent_map_cache[EXTENT_MAP_CACHE_SIZE];
+
+// Advisory fcntl locks between the processes of the disk image, readers share a region and writers hold it exclusively
+// The FAT tables are locked before the root directory. A command on a single file only keeps the lock of its directory
+// entry, the commands that add or remove entries keep the lock of every cluster of the root directory until the end
+short root_directory_lock_type = F_UNLCK; // taken when the root directory is loaded, F_UNLCK if it is not locked
+short directory_entry_lock_type = F_UNLCK; // replaces the root directory lock once the file is found
+int locked_directory_entry = -1;
+int is_lock_warning_printed;
+
+// Shared FAT table with --shared-fat, the FAT table and the free cluster bitmap are kept in a shared memory segment
+// so the writers of different files can run at the same time. Free clusters are claimed with compare and swap on
+// the bitmap words, and the freed clusters are only released to the other processes after the flush
+int is_shared_fat_requested;
+char shared_fat_name[64];
+int shared_fat_fd = -1;
+struct shared_fat_header* shared_fat; // NULL if the FAT table is private
+size_t shared_fat_size;
+unsigned int* pending_free_clusters;
+int n_pending_free_clusters;
+int pending_free_clusters_capacity;
+
+// Journal of the metadata writes with --journal, in the reserved sectors after the boot sectors
+// The FAT table, FSInfo and root directory writes of a flush are collected to a transaction that is appended to the
+// journal and synced once. They are written in place at the checkpoint, when the journal is full or the disk image is
+// closed, and the transactions that were not written in place are replayed by the next writer that opens the disk image
+int is_journal_requested;
+int is_journal_enabled;
+off_t journal_offset; // in bytes, the header sector of the journal
+int journal_size; // in bytes, the header sector and the space of the transactions
+unsigned char* journal; // the header sector and the transactions of the current sequence, like on the disk image
+int journal_length; // bytes of the transactions after the header sector
+unsigned int journal_sequence;
+int is_journal_header_synced; // the header of the current sequence is on the disk, the transactions may be appended
+int is_journal_transaction_open; // set while the metadata writes of a flush are collected instead of written in place
+unsigned char* journal_transaction; // the transaction that is collected, its header and its ranges
+int journal_transaction_length;
+int journal_transaction_capacity;
+
+// Server mode with --serve <socket>, the requests of the clients that are ready together form a round
+// The changes of a round are written back and synced once, the group commit, before any of them is answered
+char* serve_socket_path;
+volatile sig_atomic_t is_server_stopped;
+struct serve_client* serve_clients[SERVE_MAX_CLIENTS];
+int n_serve_clients;
+int is_commit_pending; // set when a request of the round may have changed the disk image
+
+// Sidecar index with --index, it is mapped privately once and its free cluster bitmap is used and updated in place
+// The root directory chain and the extent maps are taken from the index until the FAT table or the root
+// directory is changed, the index is rewritten at the end if it was missing, stale or changed
+int is_index_requested;
+char index_path[PATH_MAX];
+unsigned char* index_map;
+size_t index_map_size;
+struct index_header* index_header; // NULL if there is no valid index
+int is_index_dirty; // set when the FAT table or the root directory is changed
+int is_index_fat_changed; // set when the FAT table is changed, the chains of the unchanged entries stay the same
+unsigned char* index_changed_entries; // one flag per root directory entry that is written
+
+// FSInfo sector, it holds the free cluster count and the next free cluster hint of the volume
+unsigned char fs_info_sector_raw[MAX_SECTOR_SIZE];
+struct fat_boot_fsinfo* fs_info_sector; // NULL if the FSInfo sector is not valid
+int fs_info_sector_dirty; // set when the FAT table is changed, the FSInfo sector is written at the end
+
+// Output buffer of the file dumps, it is written to the output file descriptor with a single write when full
+char output_buffer[OUTPUT_BUFFER_SIZE];
+int output_buffer_length;
+int output_fd = STDOUT_FILENO;
+
+// Hexadecimal digits used by the dump formatter
+const char hex_digits[16] = "0123456789ABCDEF";
 
 struct fat_boot_sector* boot_sector;
 struct msdos_dir_entry* file_directory_entry;
@@ -138,11 +905,25 @@ struct msdos_dir_entry* file_directory_entry;
 ./ fatmod disk1 -w fileB.bin 0 3000 50
 ./ fatmod disk1 -r -b fileB.bin
 ./ fatmod disk1 -r -a fileC.txt  // assuming there is a non-empty ascii file fileC.txt
+./ fatmod disk1 -t fileA.txt 1048576 [-z]
 ./ fatmod disk1 -d fileA.txt
+./ fatmod disk1 -d fileA.txt fileB.txt 'test*.txt'
+./ fatmod disk1 -check
+./ fatmod disk1 -defrag [fileA.txt]
+./ fatmod disk1 -B commands.txt  // each line is a command such as: -w fileB.bin 0 3000 50
 */
 int main(int argc, char* argv[]) {
+    // Apply and remove the -- options such as --sync=none
+    argc = parse_global_options(argc, argv);
+    if (argc == FAILURE) {
+        printf("%s", INVALID_ARGUMENTS);
+        return 0;
+    }
+
     // Check if the user has entered the correct number of arguments
-    if (argc == 2) {
+    if (argc == 2 && serve_socket_path != NULL) {
+        // The server takes its commands from the socket
+    } else if (argc == 2) {
         if (strcmp(argv[1], "-h") == 0) {
             print_help_message();
             return 0;
@@ -156,13 +937,200 @@ int main(int argc, char* argv[]) {
     }
 
 
-    // Read the disk image name then open it
-    char diskname[128];
-    strcpy(diskname, argv[1]);
-    int fd = open(diskname, O_SYNC | O_RDWR);
+    // In batch mode the commands are read from the given file, or from the standard input if it is -
+    // The server keeps the locks of a batch while it runs
+    char* option = serve_socket_path != NULL ? "-B" : argv[2];
+    is_batch_mode = strcmp(option, "-B") == 0;
+    if (is_batch_mode && serve_socket_path == NULL && argc < 4) {
+        printf("%s", INVALID_ARGUMENTS);
+        return 0;
+    }
+
+    // The formatter writes a new volume, so it runs before the disk image is opened
+    if (serve_socket_path == NULL && strcmp(option, "-mkfs") == 0) {
+        if (argc < 4 || argc > 6) {
+            printf("%s", INVALID_ARGUMENTS);
+            return 0;
+        }
+        long long image_size = parse_image_size(argv[3]);
+        int new_cluster_size = argc > 4 ? atoi(argv[4]) : FORMAT_DEFAULT_CLUSTER_SIZE;
+        int n_fat_tables = argc > 5 ? atoi(argv[5]) : FORMAT_DEFAULT_FAT_TABLES;
+        if (image_size == FAILURE) {
+            printf("Size is invalid!\n");
+            return 1;
+        }
+        if (format_disk_image(argv[1], image_size, new_cluster_size, n_fat_tables) == FAILURE) {
+            printf("Could not format disk image!\n");
+            return 1;
+        }
+        printf("Disk image formatted successfully!\n");
+        return 0;
+    }
+
+    // Open the disk image, every write is synchronous only in the always sync mode
+    int fd = open_disk_image(argv[1], sync_mode == SYNC_MODE_ALWAYS ? O_SYNC | O_RDWR : O_RDWR);
+    if (fd == FAILURE) {
+        exit(1);
+    }
+
+    // The processes of the disk image with --shared-fat allocate from the same FAT table
+    // They do not use the journal, but the committed transactions are written back before the FAT table is shared
+    if (is_journal_requested && is_shared_fat_requested) {
+        printf("WARNING: The journal is not used with the shared FAT table!\n");
+        is_journal_requested = 0;
+    }
+    if (is_shared_fat_requested && (lock_fat_tables(fd, F_RDLCK) == FAILURE || open_journal(fd, 0) == FAILURE)) {
+        close_disk_image(fd);
+        exit(1);
+    }
+    if (is_shared_fat_requested && attach_shared_fat(fd) == FAILURE) {
+        printf("WARNING: Could not attach the shared FAT table, the FAT table is loaded privately!\n");
+    }
+    if (is_index_requested && shared_fat != NULL) {
+        printf("WARNING: The index is not used with the shared FAT table!\n");
+        is_index_requested = 0;
+    }
+    if (is_journal_requested && sync_mode != SYNC_MODE_OPERATION) {
+        printf("WARNING: The journal is only used in the op sync mode!\n");
+        is_journal_requested = 0;
+    }
+
+    // The locks are held until the disk image is closed, after the changes of the command are written back
+    if (lock_disk_image(fd, option) == FAILURE) {
+        close_disk_image(fd);
+        exit(1);
+    }
+
+    // The committed transactions of the earlier writers are written in place before the disk image is read
+    if (!is_shared_fat_requested && open_journal(fd, !is_reader_option(option)) == FAILURE) {
+        close_disk_image(fd);
+        exit(1);
+    }
+
+    // A missing or stale index is rebuilt at the end
+    if (is_index_requested) {
+        load_index(fd, argv[1]);
+    }
+
+    int result;
+    if (serve_socket_path != NULL) {
+        result = run_server(fd, serve_socket_path);
+    } else if (is_batch_mode) {
+        result = run_batch_file(fd, argv[1], argv[3]);
+    } else {
+        result = execute_command(fd, argc, argv);
+    }
+
+    // Write back the changes of the commands, the committed transactions stay in the journal for the next process
+    flush_disk_image(fd);
+    if (is_index_requested) {
+        save_index(fd);
+    }
+    detach_shared_fat();
+
+    close_disk_image(fd);
+    if (is_read_ahead_stats_requested) {
+        print_read_ahead_statistics();
+    }
+    if (is_stats_requested) {
+        print_statistics();
+    }
+
+    // Exit with a failure status if the command failed, for example if the check found errors
+    return result == FAILURE ? 1 : 0;
+}
+
+// Apply the options starting with -- and remove them from the arguments
+// --sync=always: open the disk image with O_SYNC and sync after every write
+// --sync=op: sync once at the end of each operation, all of the commands of a batch are one operation(default)
+// --sync=none: never sync the disk image
+// --mmap: access the disk image through a mapping of the whole image instead of pread and pwrite
+// --io-uring: access the disk image through io_uring, the reads of a file are queued ahead along its extents
+// --read-ahead=<KB>: size of the read-ahead window along the cluster chain, 0 disables it
+// --read-ahead-stats: print the hits and misses of the read-ahead to the standard error at the end
+// --read-threads=<n>: threads that read and format the chunks of a large file for -r, 0 uses every processor(default)
+// --stats: print the calls, bytes, syncs and latencies of the I/O operations as JSON to the standard error at the end
+// --index: use the sidecar index <disk image>.fatidx instead of the FAT table while it is valid, and keep it up to date
+// --shared-fat: share the FAT table and the free cluster bitmap with the other processes of the disk image that use it
+// --serve <socket>, --serve=<socket>: serve the requests of the clients of the Unix socket until SIGINT or SIGTERM
+// --journal: commit the metadata writes of each operation to a journal in the reserved sectors with a single sync
+// Return the new number of arguments, FAILURE if an option is invalid
+int parse_global_options(int argc, char* argv[]) {
+    int new_argc = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            argv[new_argc++] = argv[i];
+        } else if (strcmp(argv[i], "--sync=always") == 0) {
+            sync_mode = SYNC_MODE_ALWAYS;
+        } else if (strcmp(argv[i], "--sync=op") == 0) {
+            sync_mode = SYNC_MODE_OPERATION;
+        } else if (strcmp(argv[i], "--sync=none") == 0) {
+            sync_mode = SYNC_MODE_NONE;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            requested_storage = &mmap_backend;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            requested_storage = &uring_backend;
+        } else if (strncmp(argv[i], "--read-ahead=", 13) == 0) {
+            char* end;
+            long window = strtol(argv[i] + 13, &end, 10);
+            if (end == argv[i] + 13 || *end != '\0' || window < 0 || window > INT_MAX / 1024) {
+                return FAILURE;
+            }
+            read_ahead_window = window * 1024;
+        } else if (strncmp(argv[i], "--read-threads=", 15) == 0) {
+            char* end;
+            long n_threads = strtol(argv[i] + 15, &end, 10);
+            if (end == argv[i] + 15 || *end != '\0' || n_threads < 0 || n_threads > MAX_PIPELINE_THREADS) {
+                return FAILURE;
+            }
+            read_pipeline_threads = n_threads;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            is_index_requested = 1;
+        } else if (strcmp(argv[i], "--shared-fat") == 0) {
+            is_shared_fat_requested = 1;
+        } else if (strcmp(argv[i], "--journal") == 0) {
+            is_journal_requested = 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_socket_path = argv[++i];
+        } else if (strncmp(argv[i], "--serve=", 8) == 0 && argv[i][8] != '\0') {
+            serve_socket_path = argv[i] + 8;
+        } else if (strcmp(argv[i], "--read-ahead-stats") == 0) {
+            is_read_ahead_stats_requested = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+#ifndef FATMOD_NO_STATS
+            is_stats_requested = 1;
+#else
+            printf("WARNING: Statistics are not compiled in!\n");
+#endif
+        } else {
+            return FAILURE;
+        }
+    }
+    argv[new_argc] = NULL;
+    return new_argc;
+}
+
+// Open the disk image and read the boot sector, FSInfo sector and the geometry of the volume
+// Return the file descriptor of the disk image, FAILURE if it can not be opened
+int open_disk_image(char* diskname, int flags) {
+    int fd = open(diskname, flags);
     if (fd < 0) {
         printf("Could not open disk image!\n");
-        exit(1);
+        return FAILURE;
+    }
+
+    // Map the disk image if the mmap backend is requested, the fd backend is used if it can not be mapped
+    if (requested_storage == &mmap_backend && map_disk_image(fd) == FAILURE) {
+        printf("WARNING: Could not map disk image, using the fd backend!\n");
+    }
+    // Set up the io_uring instance if the io_uring backend is requested, the fd backend is used if the kernel does not support it
+    if (requested_storage == &uring_backend && setup_io_ring(fd) == FAILURE) {
+        printf("WARNING: Could not set up io_uring, using the fd backend!\n");
+    }
+    // The calls of the selected backend are counted through the stats backend
+    if (is_stats_requested) {
+        measured_storage = storage;
+        storage = &stats_backend;
     }
 
 
@@ -171,76 +1139,646 @@ int main(int argc, char* argv[]) {
     if (n < 0) {
         printf("Could not read boot sector!\n");
         close(fd);
-        exit(1);
+        return FAILURE;
     }
 
     // Cast the boot sector to a struct 
     boot_sector = (struct fat_boot_sector*) boot_sector_raw;
     reserved_sectors = boot_sector->reserved;
-    if (reserved_sectors != N_RESERVED_SECTORS) {
-        printf("WARNING: Reserved sectors is not %d!\n", N_RESERVED_SECTORS);
-    }
     sectors_per_cluster = boot_sector->sec_per_clus;
-    if (sectors_per_cluster != ASSUMED_SEC_PER_CLUS) {
-        printf("WARNING: Sectors per cluster is not %d!\n", ASSUMED_SEC_PER_CLUS);
-    }
     root_directory_cluster_number = boot_sector->fat32.root_cluster;
-    if (root_directory_cluster_number != ASSUMED_ROOT_DIRECTORY_CLUSTER) {
-        printf("WARNING: Root directory cluster number is not %d!\n", ASSUMED_ROOT_DIRECTORY_CLUSTER);
-    }
     number_of_fat_tables = boot_sector->fats;
-    if (number_of_fat_tables != N_FAT_TABLES) {
-        printf("WARNING: Number of FAT tables is not %d!\n", N_FAT_TABLES);
+    total_sectors = boot_sector->total_sect != 0 ? boot_sector->total_sect : unsigned_bytes_to_int(boot_sector->sectors, 2);
+    fat_size = boot_sector->fat32.length;
+
+    // The sector size and the sectors per cluster must be powers of 2
+    int boot_sector_size = unsigned_bytes_to_int(boot_sector->sector_size, 2);
+    if (boot_sector_size < MIN_SECTOR_SIZE || boot_sector_size > MAX_SECTOR_SIZE || (boot_sector_size & (boot_sector_size - 1)) != 0) {
+        printf("Sector size %d is not supported!\n", boot_sector_size);
+        close(fd);
+        return FAILURE;
     }
-    sector_size = unsigned_bytes_to_int(boot_sector->sector_size, 2);
-    if (sector_size != SECTORSIZE) {
-        printf("WARNING: Sector size is not %d! It is %d.\n", SECTORSIZE, sector_size);
+    if (sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) != 0
+        || boot_sector_size * sectors_per_cluster > MAX_CLUSTER_SIZE) {
+        printf("Sectors per cluster %d is not supported!\n", sectors_per_cluster);
+        close(fd);
+        return FAILURE;
+    }
+    if (reserved_sectors == 0 || number_of_fat_tables == 0 || fat_size == 0) {
+        printf("Boot sector is invalid!\n");
+        close(fd);
+        return FAILURE;
     }
-    if (boot_sector->sec_per_clus != ASSUMED_SEC_PER_CLUS) {
-        printf("WARNING: Sectors per cluster is not %d!\n", ASSUMED_SEC_PER_CLUS);
+    sector_size = boot_sector_size;
+    cluster_size = sector_size * sectors_per_cluster;
+    cluster_size_shift = __builtin_ctz(cluster_size);
+
+    root_directory_cluster_offset = (off_t) (reserved_sectors + fat_size * number_of_fat_tables) * sector_size;
+    // Every FAT table is updated unless the mirroring is disabled, then only the active FAT table is used
+    int active_fat_table = 0;
+    n_mirrored_fat_tables = number_of_fat_tables;
+    if (boot_sector->fat32.flags & FAT_MIRRORING_DISABLED_FLAG) {
+        active_fat_table = boot_sector->fat32.flags & FAT_ACTIVE_TABLE_MASK;
+        if (active_fat_table >= number_of_fat_tables) {
+            printf("WARNING: Active FAT table %d does not exist, using the first FAT table!\n", active_fat_table);
+            active_fat_table = 0;
+        }
+        n_mirrored_fat_tables = 1;
     }
-    total_sectors = boot_sector->total_sect;
-    fat_size = boot_sector->fat32.length;
-    root_directory_cluster_offset = (reserved_sectors + fat_size * number_of_fat_tables) * SECTORSIZE;
-    fat_table_offset = reserved_sectors * SECTORSIZE;
-    root_directory_max_content_size = (N_ROOT_DIRECTORY_CLUSTERS * CLUSTERSIZE) / FILE_DIRECTORY_ENTRY_SIZE;
+    fat_table_offset = (reserved_sectors + active_fat_table * fat_size) * sector_size;
 
     // Calculate usable clusters size and usable fat table size
     usable_clusters_size = (total_sectors - reserved_sectors - fat_size * number_of_fat_tables) / sectors_per_cluster;
     if (usable_clusters_size > MAX_NUMBER_OF_CLUSTERS_FAT_TABLE) {
         usable_clusters_size = MAX_NUMBER_OF_CLUSTERS_FAT_TABLE;
     }
-    usable_fat_table_size = fat_size * SECTORSIZE / FAT_TABLE_ENTRY_SIZE - 2 * FAT_TABLE_ENTRY_SIZE;
+    usable_fat_table_size = fat_size * sector_size / FAT_TABLE_ENTRY_SIZE - 2 * FAT_TABLE_ENTRY_SIZE;
     if (usable_fat_table_size <= usable_clusters_size) {
         usable_clusters_size = usable_fat_table_size;
     } else {
         usable_fat_table_size = usable_clusters_size;
     }
+    max_cluster_number = usable_clusters_size + 1;
+    if (max_cluster_number >= fat_size * sector_size / FAT_TABLE_ENTRY_SIZE) {
+        max_cluster_number = fat_size * sector_size / FAT_TABLE_ENTRY_SIZE - 1;
+    }
+
+    if (root_directory_cluster_number < 2 || root_directory_cluster_number > max_cluster_number) {
+        printf("Root directory cluster number %d is invalid!\n", root_directory_cluster_number);
+        close(fd);
+        return FAILURE;
+    }
+
+    // Read the FSInfo sector to get the next free cluster hint
+    read_fs_info_sector(fd);
+
+    return fd;
+}
+
+// Format the disk image as an empty FAT32 volume of the given size with the given cluster size and number of FAT tables
+// The image is truncated to a sparse file of zeros, then the reserved sectors and the first sector of every FAT table
+// are written, so formatting takes a few writes whatever the size of the volume. The root directory is cluster 2,
+// it is empty since it is in the zeros. A disk image that is not a regular file has its FAT tables and root directory zeroed
+// If the volume would have fewer clusters than FAT32 needs, the cluster size is halved until it has enough
+int format_disk_image(char* diskname, long long image_size, int new_cluster_size, int n_fat_tables) {
+    if (new_cluster_size < MIN_SECTOR_SIZE || new_cluster_size > MAX_CLUSTER_SIZE || (new_cluster_size & (new_cluster_size - 1)) != 0) {
+        printf("Cluster size %d is not supported!\n", new_cluster_size);
+        return FAILURE;
+    }
+    if (n_fat_tables < 1 || n_fat_tables > FORMAT_MAX_FAT_TABLES) {
+        printf("Number of FAT tables %d is not supported!\n", n_fat_tables);
+        return FAILURE;
+    }
+
+    // The FAT tables grow with the clusters they describe, so their size is found by iterating until it fits
+    long long new_total_sectors = image_size / MIN_SECTOR_SIZE;
+    int requested_cluster_size = new_cluster_size;
+    int new_sectors_per_cluster;
+    long long new_fat_size;
+    long long n_clusters;
+    for (;;) {
+        new_sectors_per_cluster = new_cluster_size / MIN_SECTOR_SIZE;
+        new_fat_size = 1;
+        for (;;) {
+            n_clusters = (new_total_sectors - FORMAT_RESERVED_SECTORS - n_fat_tables * new_fat_size) / new_sectors_per_cluster;
+            long long needed = ((n_clusters + 2) * FAT_TABLE_ENTRY_SIZE + MIN_SECTOR_SIZE - 1) / MIN_SECTOR_SIZE;
+            if (n_clusters < FAT32_MIN_CLUSTERS || needed <= new_fat_size) {
+                break;
+            }
+            new_fat_size = needed;
+        }
+        if (n_clusters >= FAT32_MIN_CLUSTERS || new_cluster_size == MIN_SECTOR_SIZE) {
+            break;
+        }
+        new_cluster_size /= 2;
+    }
+    if (n_clusters < FAT32_MIN_CLUSTERS) {
+        printf("Disk image is too small, FAT32 needs at least %d clusters!\n", FAT32_MIN_CLUSTERS);
+        return FAILURE;
+    }
+    if (new_cluster_size != requested_cluster_size) {
+        printf("WARNING: The cluster size is reduced to %d bytes, FAT32 needs at least %d clusters!\n", new_cluster_size, FAT32_MIN_CLUSTERS);
+    }
+    if (new_total_sectors > UINT_MAX || n_clusters + 1 >= FAT_TABLE_RESERVED_CLUSTER_VALUE) {
+        printf("Disk image is too large for the cluster size!\n");
+        return FAILURE;
+    }
+
+    // The boot sector, the FSInfo sector and their backups are built in the reserved sectors
+    unsigned char reserved_area[FORMAT_RESERVED_SECTORS * MIN_SECTOR_SIZE] = { 0 };
+    struct fat_boot_sector* new_boot_sector = (struct fat_boot_sector*) reserved_area;
+    memcpy(new_boot_sector->ignored, "\xEB\x58\x90", 3);
+    memcpy(new_boot_sector->system_id, "MSWIN4.1", 8);
+    new_boot_sector->sector_size[0] = MIN_SECTOR_SIZE & 0xFF;
+    new_boot_sector->sector_size[1] = MIN_SECTOR_SIZE >> 8;
+    new_boot_sector->sec_per_clus = new_sectors_per_cluster;
+    new_boot_sector->reserved = FORMAT_RESERVED_SECTORS;
+    new_boot_sector->fats = n_fat_tables;
+    new_boot_sector->media = 0xF8;
+    new_boot_sector->secs_track = 32;
+    new_boot_sector->heads = 64;
+    new_boot_sector->total_sect = new_total_sectors;
+    new_boot_sector->fat32.length = new_fat_size;
+    new_boot_sector->fat32.root_cluster = 2;
+    new_boot_sector->fat32.info_sector = 1;
+    new_boot_sector->fat32.backup_boot = FORMAT_BACKUP_BOOT_SECTOR;
+    new_boot_sector->fat32.drive_number = 0x80;
+    new_boot_sector->fat32.signature = 0x29;
+    unsigned int volume_id = time(NULL);
+    memcpy(new_boot_sector->fat32.vol_id, &volume_id, sizeof(volume_id));
+    memcpy(new_boot_sector->fat32.vol_label, "NO NAME    ", MSDOS_NAME);
+    memcpy(new_boot_sector->fat32.fs_type, "FAT32   ", 8);
+    reserved_area[510] = 0x55;
+    reserved_area[511] = 0xAA;
+
+    // The root directory takes the first cluster, the next allocation starts after it
+    struct fat_boot_fsinfo* new_fs_info_sector = (struct fat_boot_fsinfo*) (reserved_area + MIN_SECTOR_SIZE);
+    new_fs_info_sector->signature1 = FAT_FSINFO_SIG1;
+    new_fs_info_sector->signature2 = FAT_FSINFO_SIG2;
+    new_fs_info_sector->free_clusters = n_clusters - 1;
+    new_fs_info_sector->next_cluster = 3;
+    reserved_area[2 * MIN_SECTOR_SIZE - 2] = 0x55;
+    reserved_area[2 * MIN_SECTOR_SIZE - 1] = 0xAA;
+    memcpy(reserved_area + FORMAT_BACKUP_BOOT_SECTOR * MIN_SECTOR_SIZE, reserved_area, 2 * MIN_SECTOR_SIZE);
+
+    // The first entries hold the media type, the end of chain value and the one cluster chain of the root directory
+    unsigned int fat_table_start[MIN_SECTOR_SIZE / FAT_TABLE_ENTRY_SIZE] = { 0x0FFFFF00 | 0xF8, FAT_TABLE_LAST_CLUSTER_VALUE, FAT_TABLE_LAST_CLUSTER_VALUE };
+
+    int fd = open(diskname, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Could not open disk image!\n");
+        return FAILURE;
+    }
+    // The other processes of the old volume are waited for, the whole image is rewritten
+    if (lock_disk_range(fd, F_WRLCK, 0, 0) == FAILURE) {
+        close(fd);
+        return FAILURE;
+    }
+
+    struct stat image_stat;
+    off_t metadata_offset = (off_t) FORMAT_RESERVED_SECTORS * MIN_SECTOR_SIZE;
+    off_t metadata_length = (off_t) n_fat_tables * new_fat_size * MIN_SECTOR_SIZE + new_cluster_size;
+    int result = fstat(fd, &image_stat) == 0 ? SUCCESS : FAILURE;
+    if (result == SUCCESS && S_ISREG(image_stat.st_mode)) {
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, new_total_sectors * MIN_SECTOR_SIZE) != 0) {
+            result = FAILURE;
+        }
+    } else if (result == SUCCESS) {
+        result = zero_disk_range(fd, metadata_offset, metadata_length);
+    }
+
+    if (result == SUCCESS && storage->write_at(fd, reserved_area, sizeof(reserved_area), 0) != sizeof(reserved_area)) {
+        result = FAILURE;
+    }
+    for (int copy = 0; copy < n_fat_tables && result == SUCCESS; copy++) {
+        off_t offset = metadata_offset + (off_t) copy * new_fat_size * MIN_SECTOR_SIZE;
+        if (storage->write_at(fd, fat_table_start, sizeof(fat_table_start), offset) != sizeof(fat_table_start)) {
+            result = FAILURE;
+        }
+    }
+    if (result == SUCCESS && sync_mode != SYNC_MODE_NONE && storage->sync(fd) != 0) {
+        result = FAILURE;
+    }
+    close(fd);
+
+    if (result == FAILURE) {
+        printf("Could not write disk image!\n");
+    }
+    return result;
+}
+
+// Parse the size of a disk image in bytes with an optional K, M or G suffix
+// Return FAILURE if it is not a positive size
+long long parse_image_size(char* str) {
+    char* end;
+    long long size = strtoll(str, &end, 10);
+    if (end == str || size <= 0) {
+        return FAILURE;
+    }
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+        end++;
+    }
+    if (*end != '\0' || size > (LLONG_MAX >> shift)) {
+        return FAILURE;
+    }
+    return size << shift;
+}
+
+// Clone the disk image to the new image. The file system shares the blocks of a reflink clone until either image
+// changes them, without one the data segments are copied and the holes between them stay holes
+// The whole root directory is locked shared like for the readers, so no operation is half written in the snapshot
+int snapshot_disk_image(int fd, char* snapshot_name) {
+    if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
+        return FAILURE;
+    }
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) != 0) {
+        printf("Could not read disk image!\n");
+        return FAILURE;
+    }
+    off_t image_size = S_ISREG(image_stat.st_mode) ? image_stat.st_size : lseek(fd, 0, SEEK_END);
+
+    int snapshot_fd = open(snapshot_name, O_WRONLY | O_CREAT | O_EXCL, image_stat.st_mode & 0777);
+    if (snapshot_fd < 0) {
+        printf(errno == EEXIST ? "Snapshot already exists!\n" : "Could not create snapshot!\n");
+        return FAILURE;
+    }
+
+    char* method = "a reflink clone";
+    int result = SUCCESS;
+    if (ioctl(snapshot_fd, FICLONE, fd) != 0) {
+        method = "a sparse copy";
+        result = copy_data_segments(fd, snapshot_fd, image_size);
+    }
+    if (result == SUCCESS && sync_mode != SYNC_MODE_NONE && fdatasync(snapshot_fd) != 0) {
+        result = FAILURE;
+    }
+    close(snapshot_fd);
+
+    if (result == FAILURE) {
+        printf("Could not copy disk image!\n");
+        unlink(snapshot_name);
+        return FAILURE;
+    }
+    printf("Snapshot created successfully with %s!\n", method);
+    return SUCCESS;
+}
+
+// Copy the data segments of the disk image to the same offsets of the snapshot, the holes are skipped
+// copy_file_range copies in the kernel and shares the blocks of the segments where the file system can,
+// the segments are read and written in blocks if it is not supported between the two files
+int copy_data_segments(int fd, int snapshot_fd, off_t size) {
+    if (ftruncate(snapshot_fd, size) != 0) {
+        return FAILURE;
+    }
+
+    unsigned char* copy_buffer = NULL;
+    int is_copy_file_range_supported = 1;
+    int result = SUCCESS;
+    off_t offset = 0;
+    while (offset < size && result == SUCCESS) {
+        // Without SEEK_DATA the whole image is one data segment
+        off_t data_start = lseek(fd, offset, SEEK_DATA);
+        if (data_start < 0 && errno == ENXIO) {
+            break;
+        }
+        if (data_start < 0) {
+            data_start = offset;
+        }
+        off_t data_end = lseek(fd, data_start, SEEK_HOLE);
+        if (data_end < 0 || data_end > size) {
+            data_end = size;
+        }
+
+        while (data_start < data_end) {
+            ssize_t copied = -1;
+            if (is_copy_file_range_supported) {
+                loff_t input_offset = data_start;
+                loff_t output_offset = data_start;
+                size_t length = data_end - data_start < INT_MAX ? data_end - data_start : INT_MAX;
+                copied = copy_file_range(fd, &input_offset, snapshot_fd, &output_offset, length, 0);
+                if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    is_copy_file_range_supported = 0;
+                }
+            }
+            if (!is_copy_file_range_supported) {
+                if (copy_buffer == NULL && (copy_buffer = malloc(IMAGE_BLOCK_SIZE)) == NULL) {
+                    result = FAILURE;
+                    break;
+                }
+                size_t length = data_end - data_start < IMAGE_BLOCK_SIZE ? data_end - data_start : IMAGE_BLOCK_SIZE;
+                copied = pread(fd, copy_buffer, length, data_start);
+                if (copied > 0 && pwrite(snapshot_fd, copy_buffer, copied, data_start) != copied) {
+                    copied = -1;
+                }
+            }
+            if (copied <= 0) {
+                result = FAILURE;
+                break;
+            }
+            data_start += copied;
+        }
+        offset = data_end;
+    }
+
+    free(copy_buffer);
+    return result;
+}
+
+// Compare the disk image with the other image, which must have the same geometry
+// The FAT tables are compared first, sector by sector, and the clusters of the entries that differ are different
+// Then the data of the clusters that are used in both images with the same entry is compared, except the ranges that
+// are holes in both images or that the file system shares between them, so a snapshot only reads its changed blocks
+// Return SUCCESS if the disk images are the same, FAILURE if they differ or can not be compared
+int diff_disk_images(int fd, char* other_name) {
+    if (fat_table_cache == NULL && load_fat_table_cache(fd) == FAILURE) {
+        return FAILURE;
+    }
+    if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    int other_fd = open(other_name, O_RDONLY);
+    if (other_fd < 0) {
+        printf("Could not open the other disk image!\n");
+        return FAILURE;
+    }
+    // The writers of the other disk image are waited for
+    if (lock_disk_range(other_fd, F_RDLCK, 0, 0) == FAILURE) {
+        close(other_fd);
+        return FAILURE;
+    }
+
+    unsigned char other_boot_sector_raw[MIN_SECTOR_SIZE];
+    struct fat_boot_sector* other_boot_sector = (struct fat_boot_sector*) other_boot_sector_raw;
+    if (pread(other_fd, other_boot_sector_raw, MIN_SECTOR_SIZE, 0) != MIN_SECTOR_SIZE
+        || memcmp(other_boot_sector->sector_size, boot_sector->sector_size, 2) != 0
+        || other_boot_sector->sec_per_clus != boot_sector->sec_per_clus || other_boot_sector->reserved != boot_sector->reserved
+        || other_boot_sector->fats != boot_sector->fats || memcmp(other_boot_sector->sectors, boot_sector->sectors, 2) != 0
+        || other_boot_sector->total_sect != boot_sector->total_sect || other_boot_sector->fat32.length != boot_sector->fat32.length
+        || other_boot_sector->fat32.root_cluster != boot_sector->fat32.root_cluster) {
+        printf("Disk images have different geometries!\n");
+        close(other_fd);
+        return FAILURE;
+    }
+
+    // The active FAT table of the other disk image is read with a single read
+    int other_active_fat_table = 0;
+    if ((other_boot_sector->fat32.flags & FAT_MIRRORING_DISABLED_FLAG)
+        && (other_boot_sector->fat32.flags & FAT_ACTIVE_TABLE_MASK) < number_of_fat_tables) {
+        other_active_fat_table = other_boot_sector->fat32.flags & FAT_ACTIVE_TABLE_MASK;
+    }
+    size_t fat_table_length = (size_t) fat_size * sector_size;
+    unsigned int* other_fat_table = malloc(fat_table_length);
+    unsigned long long* differing_clusters = calloc(max_cluster_number / 64 + 1, sizeof(unsigned long long));
+    unsigned char* buffer = malloc(IMAGE_BLOCK_SIZE);
+    unsigned char* other_buffer = malloc(IMAGE_BLOCK_SIZE);
+    int result = SUCCESS;
+    if (other_fat_table == NULL || differing_clusters == NULL || buffer == NULL || other_buffer == NULL) {
+        printf("Could not allocate memory for the comparison!\n");
+        result = FAILURE;
+    } else if (pread(other_fd, other_fat_table, fat_table_length,
+                     (off_t) (reserved_sectors + other_active_fat_table * fat_size) * sector_size) != (ssize_t) fat_table_length) {
+        printf("Could not read the FAT table of the other disk image!\n");
+        result = FAILURE;
+    }
+
+    // Compare the FAT tables sector by sector, the entries of the sectors that differ are compared one by one
+    unsigned int* fat_table = (unsigned int*) fat_table_cache;
+    int entries_per_sector = sector_size / FAT_TABLE_ENTRY_SIZE;
+    int n_differing_sectors = 0;
+    for (int sector = 0; sector < fat_size && result == SUCCESS; sector++) {
+        unsigned int first = sector * entries_per_sector;
+        if (memcmp(fat_table + first, other_fat_table + first, sector_size) == 0) {
+            continue;
+        }
+        n_differing_sectors++;
+        for (unsigned int cluster = first < 2 ? 2 : first; cluster < first + entries_per_sector && cluster <= max_cluster_number; cluster++) {
+            if ((fat_table[cluster] ^ other_fat_table[cluster]) & FAT_TABLE_ENTRY_MASK) {
+                differing_clusters[cluster / 64] |= 1ULL << (cluster % 64);
+            }
+        }
+    }
+
+    // Compare the data of the runs of clusters that are used in both images with the same entry
+    // The physical addresses of the extents can only be compared if both images are on the same file system
+    struct stat image_stat;
+    struct stat other_image_stat;
+    int is_same_file_system = fstat(fd, &image_stat) == 0 && fstat(other_fd, &other_image_stat) == 0
+        && image_stat.st_dev == other_image_stat.st_dev;
+    struct fiemap* extents = result == SUCCESS ? get_file_extents(fd) : NULL;
+    struct fiemap* other_extents = result == SUCCESS ? get_file_extents(other_fd) : NULL;
+    long long n_compared_clusters = 0;
+    long long n_skipped_clusters = 0;
+    unsigned int cluster = 2;
+    while (cluster <= max_cluster_number && result == SUCCESS) {
+        unsigned int entry = fat_table[cluster] & FAT_TABLE_ENTRY_MASK;
+        if (entry == FAT_TABLE_FREE_CLUSTER_VALUE || entry != (other_fat_table[cluster] & FAT_TABLE_ENTRY_MASK)) {
+            cluster++;
+            continue;
+        }
+        unsigned int run_end = cluster + 1;
+        while (run_end <= max_cluster_number && run_end - cluster < IMAGE_BLOCK_SIZE / cluster_size
+               && (fat_table[run_end] & FAT_TABLE_ENTRY_MASK) != FAT_TABLE_FREE_CLUSTER_VALUE
+               && ((fat_table[run_end] ^ other_fat_table[run_end]) & FAT_TABLE_ENTRY_MASK) == 0) {
+            run_end++;
+        }
+
+        off_t offset = get_cluster_offset(cluster);
+        off_t length = (off_t) (run_end - cluster) * cluster_size;
+        if (is_range_same_on_disk(extents, other_extents, offset, length, is_same_file_system)) {
+            n_skipped_clusters += run_end - cluster;
+        } else if (storage->read_at(fd, buffer, length, offset) != length || pread(other_fd, other_buffer, length, offset) != length) {
+            printf("Could not read the clusters of the disk images!\n");
+            result = FAILURE;
+        } else {
+            for (unsigned int i = 0; i < run_end - cluster; i++) {
+                if (memcmp(buffer + (size_t) i * cluster_size, other_buffer + (size_t) i * cluster_size, cluster_size) != 0) {
+                    differing_clusters[(cluster + i) / 64] |= 1ULL << ((cluster + i) % 64);
+                }
+            }
+            n_compared_clusters += run_end - cluster;
+        }
+        cluster = run_end;
+    }
+    free(extents);
+    free(other_extents);
+
+    long long n_differing_clusters = 0;
+    for (unsigned int i = 0; i <= max_cluster_number / 64 && result == SUCCESS; i++) {
+        n_differing_clusters += __builtin_popcountll(differing_clusters[i]);
+    }
+
+    // Read the root directory of the other disk image along its chain in the other FAT table
+    unsigned char* other_root_directory = NULL;
+    int n_other_entries = 0;
+    unsigned int other_cluster = root_directory_cluster_number;
+    int max_other_clusters = MAX_ROOT_DIRECTORY_ENTRIES * FILE_DIRECTORY_ENTRY_SIZE / cluster_size;
+    while (result == SUCCESS && other_cluster >= 2 && other_cluster <= max_cluster_number
+           && n_other_entries * FILE_DIRECTORY_ENTRY_SIZE / cluster_size < max_other_clusters) {
+        unsigned char* entries = realloc(other_root_directory, (size_t) (n_other_entries * FILE_DIRECTORY_ENTRY_SIZE + cluster_size));
+        if (entries == NULL) {
+            result = FAILURE;
+            break;
+        }
+        other_root_directory = entries;
+        if (pread(other_fd, other_root_directory + n_other_entries * FILE_DIRECTORY_ENTRY_SIZE, cluster_size,
+                  get_cluster_offset(other_cluster)) != cluster_size) {
+            printf("Could not read the root directory of the other disk image!\n");
+            result = FAILURE;
+            break;
+        }
+        n_other_entries += cluster_size / FILE_DIRECTORY_ENTRY_SIZE;
+        other_cluster = other_fat_table[other_cluster] & FAT_TABLE_ENTRY_MASK;
+    }
+
+    // A file differs if its entry differs or one of the clusters of its chain differs
+    // The chains are the same if the first clusters and the FAT entries of the chain are the same
+    int n_differing_files = 0;
+    unsigned char* is_entry_matched = result == SUCCESS ? calloc(root_directory_end_entry + 1, 1) : NULL;
+    char file_name[TOTAL_FILENAME_SIZE + DOT_SIZE + 1] = { 0 };
+    for (int i = 0; i < n_other_entries && is_entry_matched != NULL; i++) {
+        struct msdos_dir_entry* other_entry = (struct msdos_dir_entry*) (other_root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+        if (other_entry->name[0] == 0x00) {
+            break;
+        }
+        if (!is_indexed_file_entry(other_entry)) {
+            continue;
+        }
+        get_file_name_of_entry(other_entry, file_name);
+        int slot = find_name_index_slot(other_entry->name);
+        if (slot == FAILURE) {
+            printf("File %s is only in the other disk image\n", file_name);
+            n_differing_files++;
+            continue;
+        }
+        int directory_entry_index = name_index[slot];
+        is_entry_matched[directory_entry_index] = 1;
+        struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE);
+        int is_different = entry->size != other_entry->size || entry->start != other_entry->start || entry->starthi != other_entry->starthi;
+        struct extent_map* map = is_different ? NULL : get_extent_map(fd, entry->starthi << 16 | entry->start);
+        for (int j = 0; map != NULL && j < map->n_extents && !is_different; j++) {
+            for (unsigned int k = 0; k < map->extents[j].length && !is_different; k++) {
+                unsigned int chain_cluster = map->extents[j].first_cluster + k;
+                is_different = (differing_clusters[chain_cluster / 64] >> (chain_cluster % 64)) & 1;
+            }
+        }
+        if (is_different) {
+            printf("File %s differs\n", file_name);
+            n_differing_files++;
+        }
+    }
+    for (int i = 0; i < root_directory_end_entry && is_entry_matched != NULL; i++) {
+        struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+        if (is_indexed_file_entry(entry) && !is_entry_matched[i]) {
+            get_file_name_of_entry(entry, file_name);
+            printf("File %s is only in this disk image\n", file_name);
+            n_differing_files++;
+        }
+    }
+
+    if (result == SUCCESS) {
+        printf("FAT table sectors that differ: %d of %d\n", n_differing_sectors, fat_size);
+        printf("Clusters that differ: %lld, compared: %lld, shared or holes in both images: %lld\n",
+               n_differing_clusters, n_compared_clusters, n_skipped_clusters);
+        if (n_differing_sectors == 0 && n_differing_clusters == 0 && n_differing_files == 0) {
+            printf("Disk images are the same!\n");
+        } else {
+            result = FAILURE;
+        }
+    }
+
+    free(is_entry_matched);
+    free(other_root_directory);
+    free(other_fat_table);
+    free(differing_clusters);
+    free(buffer);
+    free(other_buffer);
+    close(other_fd);
+    return result;
+}
+
+// Get the extents of the file from the file system, its dirty pages are written back first so the extents are final
+// Return NULL if the file system can not map the file or the extents changed between the two calls
+struct fiemap* get_file_extents(int fd) {
+    struct fiemap header;
+    memset(&header, 0, sizeof(header));
+    header.fm_length = FIEMAP_MAX_OFFSET;
+    header.fm_flags = FIEMAP_FLAG_SYNC;
+    if (ioctl(fd, FS_IOC_FIEMAP, &header) != 0) {
+        return NULL;
+    }
+
+    // One more extent is asked for, so a map that grew in between is noticed
+    unsigned int n_extents = header.fm_mapped_extents + 1;
+    struct fiemap* extents = calloc(1, sizeof(struct fiemap) + n_extents * sizeof(struct fiemap_extent));
+    if (extents == NULL) {
+        return NULL;
+    }
+    extents->fm_length = FIEMAP_MAX_OFFSET;
+    extents->fm_flags = FIEMAP_FLAG_SYNC;
+    extents->fm_extent_count = n_extents;
+    if (ioctl(fd, FS_IOC_FIEMAP, extents) != 0 || extents->fm_mapped_extents == n_extents
+        || (extents->fm_mapped_extents > 0 && !(extents->fm_extents[extents->fm_mapped_extents - 1].fe_flags & FIEMAP_EXTENT_LAST))) {
+        free(extents);
+        return NULL;
+    }
+    return extents;
+}
+
+// Return the index of the first extent that ends after the offset, the number of extents if there is none
+int find_file_extent(struct fiemap* extents, off_t offset) {
+    int low = 0;
+    int high = extents->fm_mapped_extents;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        struct fiemap_extent* extent = &extents->fm_extents[middle];
+        if ((off_t) (extent->fe_logical + extent->fe_length) <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Return 1 if the range of the two files is the same without reading it: it is a hole in both files,
+// or both files are on the same file system and map it to the same blocks, which they share since a reflink clone
+int is_range_same_on_disk(struct fiemap* extents, struct fiemap* other_extents, off_t offset, off_t length, int is_same_file_system) {
+    if (extents == NULL || other_extents == NULL) {
+        return 0;
+    }
+    int index = find_file_extent(extents, offset);
+    int other_index = find_file_extent(other_extents, offset);
+    struct fiemap_extent* extent = index < extents->fm_mapped_extents ? &extents->fm_extents[index] : NULL;
+    struct fiemap_extent* other_extent = other_index < other_extents->fm_mapped_extents ? &other_extents->fm_extents[other_index] : NULL;
+
+    int is_hole = extent == NULL || (off_t) extent->fe_logical >= offset + length;
+    int is_other_hole = other_extent == NULL || (off_t) other_extent->fe_logical >= offset + length;
+    if (is_hole || is_other_hole) {
+        return is_hole && is_other_hole;
+    }
+    return is_same_file_system && (off_t) extent->fe_logical <= offset && (off_t) (extent->fe_logical + extent->fe_length) >= offset + length
+        && (off_t) other_extent->fe_logical <= offset && (off_t) (other_extent->fe_logical + other_extent->fe_length) >= offset + length
+        && !(extent->fe_flags & UNCOMPARABLE_EXTENT_FLAGS) && !(other_extent->fe_flags & UNCOMPARABLE_EXTENT_FLAGS)
+        && extent->fe_physical - extent->fe_logical == other_extent->fe_physical - other_extent->fe_logical;
+}
 
+// Execute a single command, the arguments are in the command line form where argv[2] is the option
+// Return SUCCESS if the command is executed, FAILURE otherwise
+int execute_command(int fd, int argc, char* argv[]) {
     // Read the second argument 
     // if it is -l, list the contents of the root directory
     if (strcmp(argv[2], "-l") == 0) {
         int result = read_root_directory(fd, LIST_DIRECTORIES);
         if (result == FAILURE) {
             printf("Could not read root directory!\n");
+            return FAILURE;
         }
     }
 
     // if it is -r, read the file in binary or ASCII
     else if (strcmp(argv[2], "-r") == 0) {
         // Check if the user has entered the correct number of arguments
-        if (argc < 4) {
+        if (argc < 5) {
             printf("%s", INVALID_ARGUMENTS);
-            return 0;
+            return FAILURE;
         }
 
         // Read the file name and extension and check if the file name is valid
         // Set the file name to the global variable
-        strcpy(input_file_name, argv[4]);
-        int result = check_set_file_name(input_file_name);
+        int result = set_input_file_name(argv[4]);
         if (result == FAILURE) {
             printf("File name is invalid!\n");
-            return 0;
+            return FAILURE;
         }
 
         // Read the file in binary or ASCII
@@ -252,7 +1790,7 @@ int main(int argc, char* argv[]) {
             read_file(fd, 0);
         } else {
             printf("%s", INVALID_ARGUMENTS);
-            return 0;
+            return FAILURE;
         }
     }
 
@@ -263,23 +1801,22 @@ int main(int argc, char* argv[]) {
         // Check if the user has entered the correct number of arguments
         if (argc < 4) {
             printf("%s", INVALID_ARGUMENTS);
-            return 0;
+            return FAILURE;
         }
 
         // Read the file name and extension and check if the file name is valid 
         // Set the file name to the global variable
-        strcpy(input_file_name, argv[3]);
-        int result = check_set_file_name(input_file_name);
+        int result = set_input_file_name(argv[3]);
         if (result == FAILURE) {
             printf("File name is invalid!\n");
-            return 0;
+            return FAILURE;
         }
 
         // Create a file named with given input in the root directory
         result = create_file_entry(fd);
         if (result == FAILURE) {
             printf("Could not create file entry!\n");
-            return 0;
+            return FAILURE;
         }
 
         printf("File created successfully!\n");
@@ -296,16 +1833,15 @@ int main(int argc, char* argv[]) {
         // Check if the user has entered the correct number of arguments
         if (argc < 7) {
             printf("%s", INVALID_ARGUMENTS);
-            return 0;
+            return FAILURE;
         }
 
         // Read the file name and extension and check if the file name is valid
         // Set the file name to the global variable
-        strcpy(input_file_name, argv[3]);
-        int result = check_set_file_name(input_file_name);
+        int result = set_input_file_name(argv[3]);
         if (result == FAILURE) {
             printf("File name is invalid!\n");
-            return 0;
+            return FAILURE;
         }
 
         // Read the start offset, length, and the string
@@ -317,421 +1853,4760 @@ int main(int argc, char* argv[]) {
         result = write_bytes_to_file(fd, start_offset, length, data);
         if (result == FAILURE) {
             printf("Could not write bytes to file!\n");
-            return 0;
+            return FAILURE;
         }
     }
 
-    // With the -d option, your program will delete the file named <FILENAME> from the root directory
-    // and free the blocks allocated for it in the FAT.
-    else if (strcmp(argv[2], "-d") == 0) {
+    // With the -t option, your program will change the size of the file named <FILENAME> to <SIZE>.
+    // A smaller file is cut at the cluster of the new end and the rest of its chain is freed.
+    // A larger file gets its new clusters at once, a contiguous run if possible, without writing them.
+    // With -z the new bytes are zeroed, otherwise they keep the old contents of the clusters
+    else if (strcmp(argv[2], "-t") == 0) {
         // Check if the user has entered the correct number of arguments
-        if (argc < 4) {
+        if (argc < 5 || (argc > 5 && strcmp(argv[5], "-z") != 0)) {
             printf("%s", INVALID_ARGUMENTS);
-            return 0;
+            return FAILURE;
         }
 
         // Read the file name and extension and check if the file name is valid
         // Set the file name to the global variable
-        strcpy(input_file_name, argv[3]);
-        int result = check_set_file_name(input_file_name);
+        int result = set_input_file_name(argv[3]);
         if (result == FAILURE) {
             printf("File name is invalid!\n");
-            return 0;
+            return FAILURE;
         }
 
-        // Delete the file
-        result = delete_file(fd);
+        // The size must be a whole number of bytes that a directory entry can hold
+        char* end;
+        errno = 0;
+        long long new_size = strtoll(argv[4], &end, 10);
+        if (end == argv[4] || *end != '\0' || errno == ERANGE || new_size < 0 || new_size > INT_MAX) {
+            printf("Size is invalid!\n");
+            return FAILURE;
+        }
+
+        result = resize_file(fd, new_size, argc > 5);
         if (result == FAILURE) {
-            printf("Could not delete file!\n");
-            return 0;
+            printf("Could not resize file!\n");
+            return FAILURE;
         }
-    } else {
-        printf("%s", INVALID_ARGUMENTS);
     }
 
-    close(fd);
-}
-
-// Write the bytes to the file starting at the given start offset and length with the given data
-// This operation can overwrite existing data in the file and add new data, potentially allocating new free clusters to the file.
-// Data is an unsigned integer between 0 and 255
-// The same data byte will be written in consecutive bytes
-// If the file is empty, the program will allocate a new cluster for the file and update the FAT table
-// If the file is not empty, the program will find the cluster that contains the start offset and write the data
-// If the length is larger than the remaining space in the cluster, the program will allocate a new cluster(s) and update the FAT table
-int write_bytes_to_file(int fd, int start_offset, int length, int data) {
-    // Find the entry with the given file name and extension
-    int directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
-    if (directory_entry_index == FAILURE) {
-        printf("File not found!\n");
-        return FAILURE;
-    }
+    // With the -x option, the raw bytes of the file are exported to the standard output,
+    // or to the host file given in the fourth argument
+    else if (strcmp(argv[2], "-x") == 0) {
+        // Check if the user has entered the correct number of arguments
+        if (argc < 4) {
+            printf("%s", INVALID_ARGUMENTS);
+            return FAILURE;
+        }
 
-    // Check if the start offset is valid   
-    if (start_offset < 0) {
-        printf("Start offset is invalid!\n Start offset: %d\n", start_offset);
-        return FAILURE;
-    }
+        // Read the file name and extension and check if the file name is valid
+        // Set the file name to the global variable
+        int result = set_input_file_name(argv[3]);
+        if (result == FAILURE) {
+            printf("File name is invalid!\n");
+            return FAILURE;
+        }
 
-    // Check if the start offset is not larger than the file size
-    if (start_offset > file_directory_entry->size) {
-        printf("Start offset is larger than the file size! Start offset: %d, File size: %d\n", start_offset, file_directory_entry->size);
-        return FAILURE;
+        // Export the file
+        result = export_file(fd, argc > 4 ? argv[4] : NULL);
+        if (result == FAILURE) {
+            fprintf(stderr, "Could not export file!\n");
+            return FAILURE;
+        }
     }
 
-    // Find the current cluster size of the file and the clusters needed for the new data
-    int file_cluster_size = file_directory_entry->size / CLUSTERSIZE + (file_directory_entry->size % CLUSTERSIZE != 0);
-    int clusters_needed = (start_offset + length) / CLUSTERSIZE + ((start_offset + length) % CLUSTERSIZE != 0) - file_cluster_size;
+    // With the -i option, the contents of the host file given in the fourth argument, or of the standard input
+    // if it is not given or -, are written to the file. The file is created if it does not exist and overwritten otherwise
+    else if (strcmp(argv[2], "-i") == 0) {
+        // Check if the user has entered the correct number of arguments
+        if (argc < 4) {
+            printf("%s", INVALID_ARGUMENTS);
+            return FAILURE;
+        }
 
-    // Get the first cluster of the file by combining the high and low bytes
-    unsigned int current_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
+        // Read the file name and extension and check if the file name is valid
+        // Set the file name to the global variable
+        int result = set_input_file_name(argv[3]);
+        if (result == FAILURE) {
+            printf("File name is invalid!\n");
+            return FAILURE;
+        }
 
-    // Allocate new clusters if needed
-    if (clusters_needed > 0) {
-        // Find the last cluster of the file
-        for (int i = 0; i < file_cluster_size - 1; i++) {
-            current_cluster = get_next_FAT_table_entry(fd, current_cluster);
+        // Import the file
+        result = import_file(fd, argc > 4 && strcmp(argv[4], "-") != 0 ? argv[4] : NULL);
+        if (result == FAILURE) {
+            printf("Could not import file!\n");
+            return FAILURE;
         }
+    }
 
-        // Allocate new clusters
-        for (int i = 0; i < clusters_needed; i++) {
-            // Find the first free cluster in the FAT table
-            int free_cluster = 0;
-            for (int j = root_directory_cluster_number + N_ROOT_DIRECTORY_CLUSTERS; j < usable_clusters_size; j++) {
-                int fat_table_entry_value = get_next_FAT_table_entry(fd, j);
-                if (fat_table_entry_value == FAT_TABLE_FREE_CLUSTER_VALUE) {
-                    free_cluster = j;
-                    break;
-                }
-            }
+    // With the -d option, your program will delete the file named <FILENAME> from the root directory
+    // and free the blocks allocated for it in the FAT.
+    else if (strcmp(argv[2], "-d") == 0) {
+        // Check if the user has entered the correct number of arguments
+        if (argc < 4) {
+            printf("%s", INVALID_ARGUMENTS);
+            return FAILURE;
+        }
 
-            // Check if there is a free cluster
-            if (free_cluster == 0) {
-                printf("No free clusters available!\n");
+        // Several files or file name patterns are deleted together
+        if (argc > 4 || strpbrk(argv[3], "*?[") != NULL) {
+            int result = delete_files(fd, argv + 3, argc - 3);
+            if (result == FAILURE) {
+                printf("Could not delete files!\n");
                 return FAILURE;
             }
+            return SUCCESS;
+        }
 
-            // Update the FAT table
-            if (current_cluster == 0) {
-                // Update the first cluster of the file
-                file_directory_entry->starthi = free_cluster >> 16;
-                file_directory_entry->start = free_cluster & 0xFFFF;
-            } else {
-                // Change the end value of the last cluster to the new cluster
-                write_fat_table_entry(fd, current_cluster, free_cluster);
-            }
-            // Change the new cluster to the end of file value
-            write_fat_table_entry(fd, free_cluster, FAT_TABLE_END_OF_FILE_VALUE);
-
-            // NOTE: This part is not necessary
-            /* // Refresh the current cluster by filling the new cluster with the zeros
-            unsigned char cluster_buffer[CLUSTERSIZE];
-            memset(cluster_buffer, 0, CLUSTERSIZE);
-            write_cluster(fd, cluster_buffer, free_cluster); */
+        // Read the file name and extension and check if the file name is valid
+        // Set the file name to the global variable
+        int result = set_input_file_name(argv[3]);
+        if (result == FAILURE) {
+            printf("File name is invalid!\n");
+            return FAILURE;
+        }
 
-            // Update the current cluster
-            current_cluster = free_cluster;
+        // Delete the file
+        result = delete_file(fd);
+        if (result == FAILURE) {
+            printf("Could not delete file!\n");
+            return FAILURE;
         }
     }
 
-    // Update the file directory entry in the root directory
+    // With the -check option, your program will check the FAT table and the chains of the files
+    // and report the cross-linked clusters, the orphaned chains, the size mismatches and the free cluster count
+    else if (strcmp(argv[2], "-check") == 0) {
+        return check_disk_image(fd);
+    }
 
-    // Increase the size of the file if the length + start offset is larger than the file size
-    if (start_offset + length > file_directory_entry->size) {
-        file_directory_entry->size = start_offset + length;
+    // With the -snapshot option, the disk image is cloned to the new image given in the third argument
+    // With the -diff option, the disk image is compared with the image given in the third argument
+    else if (strcmp(argv[2], "-snapshot") == 0 || strcmp(argv[2], "-diff") == 0) {
+        if (argc < 4) {
+            printf("%s", INVALID_ARGUMENTS);
+            return FAILURE;
+        }
+        if (strcmp(argv[2], "-snapshot") == 0) {
+            return snapshot_disk_image(fd, argv[3]);
+        }
+        return diff_disk_images(fd, argv[3]);
     }
 
-    // Update the time and date of the file directory entry
-    time_t current_time = time(NULL);
-    struct tm* time_info = localtime(&current_time);
-    file_directory_entry->time = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
-    file_directory_entry->date = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
-    file_directory_entry->adate = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+    // With the -defrag option, your program will move the chain of the file named <FILENAME>, or of every file
+    // if no file is given, to a contiguous run of clusters and report the fragmentation before and after
+    else if (strcmp(argv[2], "-defrag") == 0) {
+        if (argc > 3) {
+            if (set_input_file_name(argv[3]) == FAILURE) {
+                printf("File name is invalid!\n");
+                return FAILURE;
+            }
+        }
 
-    // Update the file directory entry in the root directory
-    int result = write_file_directory_entry(fd, directory_entry_index);
-    if (result == FAILURE) {
+        int result = defragment_files(fd, argc > 3);
+        if (result == FAILURE) {
+            printf("Could not defragment!\n");
+            return FAILURE;
+        }
+    } else {
+        printf("%s", INVALID_ARGUMENTS);
         return FAILURE;
     }
 
-    // Write the data to the file
+    return SUCCESS;
+}
 
-    // Find the cluster that contains the start offset
-    current_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
-    for (int i = 0; i < start_offset / CLUSTERSIZE; i++) {
-        current_cluster = get_next_FAT_table_entry(fd, current_cluster);
+// Execute the commands in the batch file against the open disk image
+// Each line holds the arguments of one command after the disk image name, for example: -w fileB.bin 0 3000 50
+// Empty lines and lines starting with # are skipped, the arguments can be surrounded by double quotes
+// The disk image, the FAT table cache and the root directory are shared by all of the commands
+int run_batch_file(int fd, char* diskname, char* batch_file_name) {
+    FILE* batch_file = strcmp(batch_file_name, "-") == 0 ? stdin : fopen(batch_file_name, "r");
+    if (batch_file == NULL) {
+        printf("Could not open batch file!\n");
+        return FAILURE;
     }
 
-    // Find the offset in the cluster
-    int cluster_offset = start_offset % CLUSTERSIZE;
-
-    // Write the data to the file
-    unsigned char cluster_buffer[CLUSTERSIZE];
-    // Read the cluster
-    read_cluster(fd, cluster_buffer, current_cluster);
-    for (int i = 0; i < length; i++) {
-        // Write the data to the cluster
-        cluster_buffer[cluster_offset] = data;
+    int result = SUCCESS;
+    char* line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, batch_file) != -1) {
+        // Split the line into the arguments, the first two are the program and the disk image names
+        char* batch_argv[MAX_BATCH_ARGUMENTS + 1];
+        int batch_argc = 2;
+        batch_argv[0] = "fatmod";
+        batch_argv[1] = diskname;
+        for (char* token = strtok(line, " \t\r\n"); token != NULL && batch_argc < MAX_BATCH_ARGUMENTS; token = strtok(NULL, " \t\r\n")) {
+            // Remove the double quotes around the argument
+            int token_length = strlen(token);
+            if (token_length >= 2 && token[0] == '"' && token[token_length - 1] == '"') {
+                token[token_length - 1] = '\0';
+                token++;
+            }
+            batch_argv[batch_argc++] = token;
+        }
+        batch_argv[batch_argc] = NULL;
 
-        // Update the cluster offset
-        cluster_offset++;
+        // Skip the empty lines and the comments
+        if (batch_argc == 2 || batch_argv[2][0] == '#') {
+            continue;
+        }
 
-        // Check if the cluster offset is equal to the cluster size
-        // If it is, write the cluster to the disk image and get the next cluster
-        if (cluster_offset == CLUSTERSIZE) {
-            // Write the cluster
-            write_cluster(fd, cluster_buffer, current_cluster);
+        // Batch files can not be nested
+        if (strcmp(batch_argv[2], "-B") == 0) {
+            printf("%s", INVALID_ARGUMENTS);
+            result = FAILURE;
+            continue;
+        }
 
-            cluster_offset = 0;
-            current_cluster = get_next_FAT_table_entry(fd, current_cluster);
+        if (execute_command(fd, batch_argc, batch_argv) == FAILURE) {
+            result = FAILURE;
+        }
 
-            // Read the cluster
-            read_cluster(fd, cluster_buffer, current_cluster);
+        // In the always sync mode every command is written back and synced on its own
+        if (sync_mode == SYNC_MODE_ALWAYS) {
+            flush_disk_image(fd);
         }
     }
 
-    // Write the last cluster to the disk image
-    write_cluster(fd, cluster_buffer, current_cluster);
-
-    printf("Bytes written to the file successfully!\n");
-    return SUCCESS;
+    free(line);
+    if (batch_file != stdin) {
+        fclose(batch_file);
+    }
+    return result;
 }
 
-// Delete the file named with given input in the root directory, and free the blocks allocated for it in the FAT
-int delete_file(int fd) {
-    // Find the entry with the given file name and extension
-    int directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
-    if (directory_entry_index == FAILURE) {
-        printf("File not found!\n");
+// Serve the requests of the clients of the Unix socket until SIGINT or SIGTERM
+// The ready clients of each epoll round are read and their complete requests are executed against the cached disk image,
+// then the changes of the round are written back with one flush and the queued responses are sent together
+// The responses that do not fit in a socket are sent when epoll reports it writable, the server never waits for a client
+int run_server(int fd, char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long!\n");
         return FAILURE;
     }
+    strcpy(address.sun_path, socket_path);
 
-    // Get the first cluster of the file by combining the high and low bytes
-    unsigned int current_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
-    unsigned int next_cluster = get_next_FAT_table_entry(fd, current_cluster);
-
-    // Free the blocks allocated for the file in the FAT in a loop
-    while (current_cluster < FAT_TABLE_END_OF_FILE_VALUE && current_cluster > 1) {
-        // Free the current cluster in the FAT table
-        write_fat_table_entry(fd, current_cluster, FAT_TABLE_FREE_CLUSTER_VALUE);
+    // A socket left by an earlier server is replaced
+    struct stat socket_stat;
+    if (stat(socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode)) {
+        unlink(socket_path);
+    }
+    int listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_socket < 0 || bind(listen_socket, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listen_socket, SOMAXCONN) != 0) {
+        printf("Could not listen on the socket!\n");
+        if (listen_socket >= 0) {
+            close(listen_socket);
+        }
+        return FAILURE;
+    }
 
-        // Get the next cluster
-        current_cluster = next_cluster;
-        next_cluster = get_next_FAT_table_entry(fd, current_cluster);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket, &event) != 0) {
+        printf("Could not start the server!\n");
+        close(listen_socket);
+        unlink(socket_path);
+        return FAILURE;
     }
 
-    // Delete the file directory entry by setting the first byte to 0xE5
-    file_directory_entry->name[0] = 0xE5;
-    // Calculate the offset
-    off_t offset = root_directory_cluster_offset
-        + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE;
-    // Update the file directory entry in the root directory
-    lseek(fd, offset, SEEK_SET);
+    // The signals stop the loop, the changes are written back by the caller
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Serving the disk image on %s\n", socket_path);
+    fflush(stdout);
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    while (!is_server_stopped) {
+        int n_events = epoll_wait(epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        if (n_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Could not wait for the clients!\n");
+            break;
+        }
 
-    // Write the beginning of the file directory entry to the root directory
-    int result = write(fd, file_directory_entry_raw, 2);
-    // Write the rest of the file directory entry to the root directory
-    fsync(fd);
+        for (int i = 0; i < n_events; i++) {
+            struct serve_client* client = events[i].data.ptr;
+            if (client == NULL) {
+                accept_serve_clients(listen_socket, epoll_fd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                send_serve_output(client, epoll_fd);
+            }
+            if (!client->is_output_waiting && !client->is_closed) {
+                if (read_serve_client(client) == FAILURE) {
+                    client->is_closed = 1;
+                }
+                execute_serve_requests(fd, client);
+            }
+        }
 
-    if (result < 0) {
-        return FAILURE;
+        // Group commit of the round, then the closed connections without waiting responses are removed
+        commit_serve_requests(fd, epoll_fd);
+        for (int i = n_serve_clients - 1; i >= 0; i--) {
+            if (serve_clients[i]->is_closed && !serve_clients[i]->is_output_waiting) {
+                close_serve_client(epoll_fd, i);
+            }
+        }
     }
 
-    printf("File deleted successfully!\n");
+    commit_serve_requests(fd, epoll_fd);
+    while (n_serve_clients > 0) {
+        close_serve_client(epoll_fd, n_serve_clients - 1);
+    }
+    close(epoll_fd);
+    close(listen_socket);
+    unlink(socket_path);
     return SUCCESS;
 }
 
-// Creates a file named with given input in the root directory. This file will have a
-// corresponding directory entry, an initial size of 0, and no blocks allocated for it initially.
-int create_file_entry(int fd) {
-    // Check if there exists a same file in the root directory
-    int result = read_root_directory(fd, FIND_GIVEN_ENTRY);
-    if (result != FAILURE) {
-        printf("File already exists!\n");
-        return FAILURE;
-    }
+// Stop the server loop at the next round
+void stop_server(int signal_number) {
+    is_server_stopped = 1;
+}
 
-    // Find the first free entry in the root directory
-    int free_root_directory_entry_index = read_root_directory(fd, FIND_FREE_ENTRY);
-    if (free_root_directory_entry_index == FAILURE) {
-        printf("Root directory is full!\n");
-        return FAILURE;
+// Accept the waiting connections, the connections beyond the client limit are closed at once
+void accept_serve_clients(int listen_socket, int epoll_fd) {
+    int client_socket;
+    while ((client_socket = accept4(listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct serve_client* client = n_serve_clients < SERVE_MAX_CLIENTS ? calloc(1, sizeof(struct serve_client)) : NULL;
+        if (client == NULL) {
+            close(client_socket);
+            continue;
+        }
+        client->socket = client_socket;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) != 0) {
+            close(client_socket);
+            free(client);
+            continue;
+        }
+        serve_clients[n_serve_clients++] = client;
     }
+}
 
-    // Create a new file directory entry for FAT32 file system
-    memset(file_directory_entry_raw, 0, FILE_DIRECTORY_ENTRY_SIZE);
+// Read what the client has sent to its input buffer until it holds at least one complete request
+// The rest stays in the socket and is read in the next round, after the requests that were read are executed
+// Return FAILURE at the end of the connection, the requests that were read are still answered
+int read_serve_client(struct serve_client* client) {
+    for (;;) {
+        int needed = get_serve_request_size(client);
+        if (client->input_length >= needed) {
+            return SUCCESS;
+        }
+
+        // Grow the input buffer to hold the first request, at most its header and the largest payload
+        if (needed > client->input_capacity) {
+            int capacity = client->input_capacity == 0 ? READ_BUFFER_SIZE : client->input_capacity;
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+            if (capacity > SERVE_MAX_REQUEST_SIZE + (int) sizeof(struct serve_request)) {
+                capacity = SERVE_MAX_REQUEST_SIZE + sizeof(struct serve_request);
+            }
+            unsigned char* input = realloc(client->input, capacity);
+            if (input == NULL) {
+                return FAILURE;
+            }
+            client->input = input;
+            client->input_capacity = capacity;
+        }
 
-    // First 8 bytes are for the file name, find the length of the file name until the dot
-    // copy the file name to the file directory entry
-    int is_dot_found = 0;
-    int input_file_name_index = 0;
-    for (int i = 0; i < FILENAME_SIZE; i++) {
-        if (input_file_name[input_file_name_index] == '.') {
-            is_dot_found = 1;
-            input_file_name_index++;
-        }
-        if (is_dot_found) {
-            file_directory_entry->name[i] = ' ';
+        ssize_t result = read(client->socket, client->input + client->input_length, client->input_capacity - client->input_length);
+        if (result > 0) {
+            client->input_length += result;
+        } else if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SUCCESS;
         } else {
-            file_directory_entry->name[i] = input_file_name[input_file_name_index++];
+            return FAILURE;
         }
     }
-    // Copy the file extension to the file directory entry
-    for (int i = FILENAME_SIZE; i < TOTAL_FILENAME_SIZE; i++) {
-        if (input_file_name[input_file_name_index] == '\0') {
+}
+
+// Return the bytes of the first request in the input buffer of the client, its header and its payload
+// A request that is too large needs only its header, it is answered with a failure
+int get_serve_request_size(struct serve_client* client) {
+    struct serve_request request;
+    if (client->input_length < (int) sizeof(request)) {
+        return sizeof(request);
+    }
+    memcpy(&request, client->input, sizeof(request));
+    if (request.payload_length > SERVE_MAX_REQUEST_SIZE) {
+        return sizeof(request);
+    }
+    return sizeof(request) + request.payload_length;
+}
+
+// Execute the complete requests in the input buffer of the client and keep the incomplete rest
+void execute_serve_requests(int fd, struct serve_client* client) {
+    int position = 0;
+    while (!client->is_closed && client->input_length - position >= (int) sizeof(struct serve_request)) {
+        struct serve_request request;
+        memcpy(&request, client->input + position, sizeof(request));
+        if (request.payload_length > SERVE_MAX_REQUEST_SIZE) {
+            // The stream can not be followed after a request that is too large
+            queue_serve_response(client, FAILURE, NULL, 0);
+            client->is_closed = 1;
+            break;
+        }
+        if (client->input_length - position - (int) sizeof(request) < (int) request.payload_length) {
             break;
         }
-        file_directory_entry->name[i] = input_file_name[input_file_name_index++];
+        execute_serve_request(fd, client, &request, client->input + position + sizeof(request));
+        position += sizeof(request) + request.payload_length;
     }
+    memmove(client->input, client->input + position, client->input_length - position);
+    client->input_length -= position;
+}
 
-    // Set the attribute of the file directory entry to 0x20 as it is a file and not a directory
-    // Directory entries are not supported in this program
-    file_directory_entry->attr = 0x20;
+// Execute a request with the functions of the command line options and answer it
+// The responses of the requests that may change the disk image wait for the group commit of the round
+int execute_serve_request(int fd, struct serve_client* client, struct serve_request* request, unsigned char* payload) {
+    // The file name is checked like the names of the command line
+    if (request->operation != SERVE_LIST) {
+        if (request->name_length == 0 || request->name_length > TOTAL_FILENAME_SIZE || request->name_length > request->payload_length) {
+            return queue_serve_response(client, FAILURE, NULL, 0);
+        }
+        memcpy(input_file_name, payload, request->name_length);
+        input_file_name[request->name_length] = '\0';
+        if (check_set_file_name(input_file_name) == FAILURE) {
+            return queue_serve_response(client, FAILURE, NULL, 0);
+        }
+    }
 
-    // Set the creation time, date, last access date
-    time_t current_time = time(NULL);
-    struct tm* time_info = localtime(&current_time);
-    // Set the creation time
-    file_directory_entry->ctime_cs = (time_info->tm_sec % 2) * 100;
-    file_directory_entry->ctime = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
-    // Set the creation date
-    file_directory_entry->cdate = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+    int result;
+    if (request->operation == SERVE_CREATE) {
+        result = create_file_entry(fd);
+    } else if (request->operation == SERVE_WRITE) {
+        if (request->offset > INT_MAX || request->length > INT_MAX) {
+            return queue_serve_response(client, FAILURE, NULL, 0);
+        }
+        result = write_bytes_to_file(fd, request->offset, request->length, request->data);
+    } else if (request->operation == SERVE_DELETE) {
+        result = delete_file(fd);
+    } else if (request->operation == SERVE_IMPORT) {
+        // The data is imported from a memory file like a regular host file, so its clusters are allocated at once
+        int host_fd = memfd_create("fatmod-import", MFD_CLOEXEC);
+        size_t data_length = request->payload_length - request->name_length;
+        if (host_fd < 0 || write(host_fd, payload + request->name_length, data_length) != (ssize_t) data_length || lseek(host_fd, 0, SEEK_SET) != 0) {
+            if (host_fd >= 0) {
+                close(host_fd);
+            }
+            return queue_serve_response(client, FAILURE, NULL, 0);
+        }
+        result = import_from_host_fd(fd, host_fd);
+        close(host_fd);
+    } else if (request->operation == SERVE_LIST) {
+        return queue_serve_files(client, fd);
+    } else if (request->operation == SERVE_READ || request->operation == SERVE_EXPORT) {
+        return queue_serve_file_range(fd, client, request);
+    } else {
+        return queue_serve_response(client, FAILURE, NULL, 0);
+    }
+
+    // A failed operation may have changed the disk image too
+    is_commit_pending = 1;
+    return queue_serve_response(client, result, NULL, 0);
+}
+
+// Answer a read with the bytes of the range of the file, or an export with every byte of the file
+// A range beyond the end of the file is cut at the end. The bytes are read along the extents into the output,
+// so the response holds the file as it is now, after the earlier responses of the same client
+int queue_serve_file_range(int fd, struct serve_client* client, struct serve_request* request) {
+    if (read_root_directory(fd, FIND_GIVEN_ENTRY) == FAILURE) {
+        return queue_serve_response(client, FAILURE, NULL, 0);
+    }
+    int file_size = file_directory_entry->size;
+    long long offset = request->operation == SERVE_EXPORT ? 0 : request->offset;
+    long long length = request->operation == SERVE_EXPORT ? file_size : request->length;
+    if (offset > file_size) {
+        return queue_serve_response(client, FAILURE, NULL, 0);
+    }
+    if (length > file_size - offset) {
+        length = file_size - offset;
+    }
+    struct extent_map* map = get_extent_map(fd, file_directory_entry->starthi << 16 | file_directory_entry->start);
+    if (map == NULL || (long long) map->n_clusters * cluster_size < offset + length) {
+        return queue_serve_response(client, FAILURE, NULL, 0);
+    }
+
+    unsigned char* output = reserve_serve_output(client, sizeof(struct serve_response) + length);
+    if (output == NULL) {
+        return FAILURE;
+    }
+    if (read_file_range(fd, map, offset, length, output + sizeof(struct serve_response)) == FAILURE) {
+        return queue_serve_response(client, FAILURE, NULL, 0);
+    }
+    struct serve_response response = { length, SUCCESS };
+    memcpy(output, &response, sizeof(response));
+    client->output_length += sizeof(response) + length;
+    return SUCCESS;
+}
+
+// Answer a listing with a line of the name and the size of each file, like -l
+int queue_serve_files(struct serve_client* client, int fd) {
+    if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
+        return queue_serve_response(client, FAILURE, NULL, 0);
+    }
+    char* listing = malloc((size_t) root_directory_end_entry * (TOTAL_FILENAME_SIZE + DOT_SIZE + 12) + 1);
+    if (listing == NULL) {
+        return queue_serve_response(client, FAILURE, NULL, 0);
+    }
+    // A full name with its dot fills the name buffer, so the buffer has one more byte for the terminator
+    char file_name[TOTAL_FILENAME_SIZE + DOT_SIZE + 1] = { 0 };
+    int length = 0;
+    for (int i = 0; i < root_directory_end_entry; i++) {
+        struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+        if (is_indexed_file_entry(entry)) {
+            get_file_name_of_entry(entry, file_name);
+            length += sprintf(listing + length, "%s %u\n", file_name, entry->size);
+        }
+    }
+    int result = queue_serve_response(client, SUCCESS, listing, length);
+    free(listing);
+    return result;
+}
+
+// Append the response to the output buffer of the client, it is sent after the group commit of the round
+int queue_serve_response(struct serve_client* client, int status, const void* payload, int length) {
+    unsigned char* output = reserve_serve_output(client, sizeof(struct serve_response) + length);
+    if (output == NULL) {
+        return FAILURE;
+    }
+    struct serve_response response = { length, status };
+    memcpy(output, &response, sizeof(response));
+    if (length > 0) {
+        memcpy(output + sizeof(response), payload, length);
+    }
+    client->output_length += sizeof(response) + length;
+    return status;
+}
+
+// Make room for length more bytes at the end of the output buffer of the client and return where they go
+// The connection is closed if the output can not grow
+unsigned char* reserve_serve_output(struct serve_client* client, long long length) {
+    long long needed = client->output_length + length;
+    if (needed > INT_MAX) {
+        client->is_closed = 1;
+        return NULL;
+    }
+    if (needed > client->output_capacity) {
+        long long capacity = client->output_capacity == 0 ? READ_BUFFER_SIZE : client->output_capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        if (capacity > INT_MAX) {
+            capacity = INT_MAX;
+        }
+        unsigned char* output = realloc(client->output, capacity);
+        if (output == NULL) {
+            client->is_closed = 1;
+            return NULL;
+        }
+        client->output = output;
+        client->output_capacity = capacity;
+    }
+    return client->output + client->output_length;
+}
+
+// Write back and sync the changes of the requests once, then send the queued responses of every client
+void commit_serve_requests(int fd, int epoll_fd) {
+    if (is_commit_pending) {
+        flush_disk_image(fd);
+        is_commit_pending = 0;
+    }
+    for (int i = 0; i < n_serve_clients; i++) {
+        if (serve_clients[i]->output_length > serve_clients[i]->output_sent) {
+            send_serve_output(serve_clients[i], epoll_fd);
+        }
+    }
+}
+
+// Send as much of the queued output as the non-blocking socket takes
+// If the socket is full, epoll waits for it to be writable instead of readable until the rest is sent
+void send_serve_output(struct serve_client* client, int epoll_fd) {
+    while (client->output_sent < client->output_length) {
+        ssize_t result = send(client->socket, client->output + client->output_sent, client->output_length - client->output_sent, MSG_NOSIGNAL);
+        if (result > 0) {
+            client->output_sent += result;
+        } else if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            // The responses can not be delivered anymore
+            client->is_closed = 1;
+            client->output_sent = client->output_length;
+        }
+    }
+
+    int is_output_waiting = client->output_sent < client->output_length;
+    if (!is_output_waiting) {
+        client->output_length = 0;
+        client->output_sent = 0;
+    }
+    if (is_output_waiting != client->is_output_waiting) {
+        struct epoll_event event = { .events = is_output_waiting ? EPOLLOUT : EPOLLIN, .data.ptr = client };
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket, &event);
+        client->is_output_waiting = is_output_waiting;
+    }
+}
+
+// Close the connection of the client and remove it from the client list
+void close_serve_client(int epoll_fd, int client_index) {
+    struct serve_client* client = serve_clients[client_index];
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+    close(client->socket);
+    free(client->input);
+    free(client->output);
+    free(client);
+    serve_clients[client_index] = serve_clients[--n_serve_clients];
+}
+
+// Write back the changes of the operation in the crash consistent order: data, FAT table, FSInfo sector
+// and root directory. The data is synced before any metadata refers to it, in the op sync mode this is
+// the only extra sync and the metadata is synced once at the end. In the always sync mode every step is
+// synced, in the none sync mode nothing is synced
+int flush_disk_image(int fd) {
+    int is_metadata_pending = fat_table_cache_first_dirty_sector >= 0 || root_directory_first_dirty_entry >= 0
+        || (fs_info_sector_dirty && fs_info_sector != NULL && fat_table_cache != NULL);
+    if (!is_metadata_pending && !is_data_pending) {
+        return SUCCESS;
+    }
+
+    // A new sequence of the journal starts with its header, the header is synced with the data before the first
+    // transaction of the sequence is written
+    int is_journaled = is_journal_enabled && is_metadata_pending;
+    int is_journal_header_pending = is_journaled && !is_journal_header_synced;
+    if (is_journal_header_pending && write_journal_header(fd, journal_sequence) == FAILURE) {
+        return FAILURE;
+    }
+
+    // Make sure that the data is on the disk before the FAT table and the directory entries refer to it
+    if ((is_data_pending || is_journal_header_pending) && is_metadata_pending && sync_mode == SYNC_MODE_OPERATION) {
+        storage->sync(fd);
+        is_journal_header_synced = is_journal_header_synced || is_journal_header_pending;
+    }
+
+    // With the journal the metadata writes are collected to a transaction that is committed with a single sync
+    if (is_journaled) {
+        journal_transaction_length = sizeof(struct journal_transaction);
+        is_journal_transaction_open = 1;
+    }
+
+    // The FAT table writes are synced with them in the always sync mode
+    int result = flush_fat_table_cache(fd);
+
+    // Update the free cluster count and the next free cluster of the FSInfo sector
+    if (write_fs_info_sector(fd) == FAILURE) {
+        result = FAILURE;
+    }
+
+    if (flush_root_directory(fd) == FAILURE) {
+        result = FAILURE;
+    }
+
+    if (is_journaled) {
+        is_journal_transaction_open = 0;
+        if (commit_journal_transaction(fd) == FAILURE) {
+            result = FAILURE;
+        }
+    } else {
+        sync_disk_image(fd);
+        if (sync_mode == SYNC_MODE_OPERATION) {
+            storage->sync(fd);
+        }
+    }
+    is_data_pending = 0;
+
+    // The old chains are on the disk image no more, the other processes may reuse their clusters now
+    release_pending_free_clusters();
+
+    return result;
+}
+
+// Sync the disk image after a write in the always sync mode
+// In the other modes the write is only marked pending and synced by flush_disk_image
+void sync_disk_image(int fd) {
+    if (sync_mode == SYNC_MODE_ALWAYS) {
+        storage->sync(fd);
+    }
+}
+
+// Find the journal in the reserved sectors and replay the transactions that were committed but are not in place
+// The transactions stay in the journal until it is full, their in place writes are not synced, so they are missing
+// after a crash of the system or of a writer between its commit and its writes. Every process checks them before
+// it reads the disk image, a writer holds the exclusive lock of the FAT tables already, a reader takes it for the
+// replay and then holds its shared lock again
+// The journal is used by the flushes with --journal if the reserved sectors after the boot sectors have room for it
+int open_journal(int fd, int is_writer) {
+    int first_sector = JOURNAL_FIRST_SECTOR;
+    if (boot_sector->fat32.info_sector >= first_sector) {
+        first_sector = boot_sector->fat32.info_sector + 1;
+    }
+    // The backup boot sectors are as many as the boot sectors, the boot sector, the FSInfo sector and the boot code
+    if (boot_sector->fat32.backup_boot + 3 > first_sector) {
+        first_sector = boot_sector->fat32.backup_boot + 3;
+    }
+    if (reserved_sectors - first_sector < JOURNAL_MIN_SECTORS) {
+        if (is_journal_requested) {
+            printf("WARNING: The reserved sectors have no room for the journal, it is not used!\n");
+        }
+        return SUCCESS;
+    }
+
+    journal_offset = (off_t) first_sector * sector_size;
+    journal_size = (reserved_sectors - first_sector) * sector_size;
+    journal = malloc(journal_size);
+    if (journal == NULL) {
+        printf("Could not allocate memory for the journal!\n");
+        return FAILURE;
+    }
+    if (read_journal(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    if (journal_length > 0 && !is_journal_applied(fd)) {
+        // The shared lock is released first so that two readers do not wait for each other,
+        // another writer may change the journal meanwhile, so it is read again under the exclusive lock
+        if (!is_writer && (lock_fat_tables(fd, F_UNLCK) == FAILURE || lock_fat_tables(fd, F_WRLCK) == FAILURE || read_journal(fd) == FAILURE)) {
+            return FAILURE;
+        }
+        if (apply_journal_transactions(fd, journal + sector_size, journal_length) == FAILURE) {
+            printf("Could not write back the journal!\n");
+            return FAILURE;
+        }
+        read_fs_info_sector(fd);
+        if (!is_writer && lock_fat_tables(fd, F_RDLCK) == FAILURE) {
+            return FAILURE;
+        }
+    }
+
+    // A header that was read back was synced before the transactions of its sequence, so the transactions of this
+    // process are appended without writing it again. The header of a new sequence is synced before its first transaction
+    is_journal_enabled = is_journal_requested;
+    if (!is_journal_enabled) {
+        free(journal);
+        journal = NULL;
+    }
+    return SUCCESS;
+}
+
+// Read the journal from the reserved sectors and find the end of the committed transactions of its sequence
+// The reserved sectors of a disk image that never had a journal start its first sequence
+int read_journal(int fd) {
+    if (storage->read_at(fd, journal, journal_size, journal_offset) != journal_size) {
+        printf("Could not read the journal!\n");
+        free(journal);
+        journal = NULL;
+        return FAILURE;
+    }
+    struct journal_header* header = (struct journal_header*) journal;
+    journal_sequence = 1;
+    journal_length = 0;
+    is_journal_header_synced = 0;
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) == 0
+        && header->checksum == get_journal_checksum(journal, sizeof(header->magic) + sizeof(header->sequence))) {
+        journal_sequence = header->sequence;
+        journal_length = find_journal_end(journal_sequence);
+        is_journal_header_synced = 1;
+    }
+    return SUCCESS;
+}
+
+// Return 1 if every byte of the committed transactions is in place as the last transaction that writes it left it
+// The ranges of the FAT table are checked in every mirrored copy
+int is_journal_applied(int fd) {
+    // The ranges are collected first, a range is at most as long as the journal
+    int max_ranges = journal_length / sizeof(struct journal_range);
+    struct journal_range* ranges = malloc(max_ranges * sizeof(struct journal_range));
+    unsigned char** range_bytes = malloc(max_ranges * sizeof(unsigned char*));
+    unsigned char* buffer = malloc(journal_length);
+    int is_applied = ranges != NULL && range_bytes != NULL && buffer != NULL;
+    int n_ranges = 0;
+    unsigned char* transactions = journal + sector_size;
+    for (int position = 0; position < journal_length && is_applied;) {
+        struct journal_transaction* transaction = (struct journal_transaction*) (transactions + position);
+        int end = sizeof(struct journal_transaction) + transaction->length;
+        for (int range_position = sizeof(struct journal_transaction); range_position < end && n_ranges < max_ranges;) {
+            memcpy(&ranges[n_ranges], transactions + position + range_position, sizeof(struct journal_range));
+            range_bytes[n_ranges] = transactions + position + range_position + sizeof(struct journal_range);
+            range_position += sizeof(struct journal_range) + ranges[n_ranges].length;
+            n_ranges++;
+        }
+        position += (end + sector_size - 1) & ~(sector_size - 1);
+    }
+
+    for (int i = 0; i < n_ranges && is_applied; i++) {
+        int n_copies = ranges[i].flags & JOURNAL_RANGE_FAT_TABLE ? n_mirrored_fat_tables : 1;
+        for (int copy = 0; copy < n_copies && is_applied; copy++) {
+            off_t offset = ranges[i].offset + (ranges[i].flags & JOURNAL_RANGE_FAT_TABLE ? get_fat_table_copy_offset(copy) : 0);
+            if (storage->read_at(fd, buffer, ranges[i].length, offset) != ranges[i].length) {
+                is_applied = 0;
+                break;
+            }
+            for (unsigned int j = 0; j < ranges[i].length && is_applied; j++) {
+                if (buffer[j] == range_bytes[i][j]) {
+                    continue;
+                }
+                // A byte that a later range writes again is checked with that range
+                unsigned long long byte_offset = ranges[i].offset + j;
+                is_applied = 0;
+                for (int k = i + 1; k < n_ranges && !is_applied; k++) {
+                    is_applied = ranges[k].flags == ranges[i].flags && ranges[k].offset <= byte_offset
+                        && byte_offset < ranges[k].offset + ranges[k].length;
+                }
+            }
+        }
+    }
+
+    free(ranges);
+    free(range_bytes);
+    free(buffer);
+    return is_applied;
+}
+
+// Return the length of the valid transactions of the sequence at the start of the journal
+// The transactions end at the first one that is torn, of an earlier sequence or was never written
+int find_journal_end(unsigned int sequence) {
+    int capacity = journal_size - sector_size;
+    int position = 0;
+    while (capacity - position >= (int) sizeof(struct journal_transaction)) {
+        unsigned char* bytes = journal + sector_size + position;
+        struct journal_transaction* transaction = (struct journal_transaction*) bytes;
+        if (memcmp(transaction->magic, JOURNAL_TRANSACTION_MAGIC, sizeof(transaction->magic)) != 0
+            || transaction->sequence != sequence || transaction->length > capacity - position - sizeof(struct journal_transaction)) {
+            break;
+        }
+        unsigned int checksum = transaction->checksum;
+        transaction->checksum = 0;
+        unsigned int expected_checksum = get_journal_checksum(bytes, sizeof(struct journal_transaction) + transaction->length);
+        transaction->checksum = checksum;
+        if (checksum != expected_checksum) {
+            break;
+        }
+        position += (sizeof(struct journal_transaction) + transaction->length + sector_size - 1) & ~(sector_size - 1);
+    }
+    return position;
+}
+
+// Write the ranges of the transactions in place, the ranges of the FAT table to every mirrored copy
+// The writes are not synced, the caller syncs them before the transactions are dropped
+int apply_journal_transactions(int fd, unsigned char* transactions, int length) {
+    int result = SUCCESS;
+    int position = 0;
+    while (position < length) {
+        struct journal_transaction* transaction = (struct journal_transaction*) (transactions + position);
+        int end = sizeof(struct journal_transaction) + transaction->length;
+        int range_position = sizeof(struct journal_transaction);
+        while (range_position < end) {
+            // The ranges follow each other without alignment
+            struct journal_range range;
+            memcpy(&range, transactions + position + range_position, sizeof(range));
+            unsigned char* bytes = transactions + position + range_position + sizeof(range);
+            int n_copies = range.flags & JOURNAL_RANGE_FAT_TABLE ? n_mirrored_fat_tables : 1;
+            for (int copy = 0; copy < n_copies; copy++) {
+                off_t offset = range.offset + (range.flags & JOURNAL_RANGE_FAT_TABLE ? get_fat_table_copy_offset(copy) : 0);
+                if (storage->write_at(fd, bytes, range.length, offset) != range.length) {
+                    result = FAILURE;
+                }
+            }
+            range_position += sizeof(range) + range.length;
+        }
+        position += (end + sector_size - 1) & ~(sector_size - 1);
+    }
+    return result;
+}
+
+// Write the header sector of the sequence to the journal
+int write_journal_header(int fd, unsigned int sequence) {
+    memset(journal, 0, sector_size);
+    struct journal_header* header = (struct journal_header*) journal;
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->sequence = sequence;
+    header->checksum = get_journal_checksum(journal, sizeof(header->magic) + sizeof(header->sequence));
+    if (storage->write_at(fd, journal, sector_size, journal_offset) != sector_size) {
+        printf("Could not write the journal!\n");
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+// Append a metadata write to the transaction that is collected
+int add_journal_range(off_t offset, const void* bytes, size_t length, unsigned int flags) {
+    int needed = journal_transaction_length + sizeof(struct journal_range) + length;
+    if (needed > journal_transaction_capacity) {
+        // The capacity stays a multiple of the sector size, so the padding of the transaction fits
+        int capacity = journal_transaction_capacity == 0 ? journal_size : journal_transaction_capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        unsigned char* transaction = realloc(journal_transaction, capacity);
+        if (transaction == NULL) {
+            printf("Could not allocate memory for the journal!\n");
+            return FAILURE;
+        }
+        journal_transaction = transaction;
+        journal_transaction_capacity = capacity;
+    }
+
+    struct journal_range range = { offset, length, flags };
+    memcpy(journal_transaction + journal_transaction_length, &range, sizeof(range));
+    memcpy(journal_transaction + journal_transaction_length + sizeof(range), bytes, length);
+    journal_transaction_length = needed;
+    return SUCCESS;
+}
+
+// Append the collected transaction to the journal and sync it, the transaction is committed then and written in place
+// If the journal is full it is checkpointed first. A transaction that is larger than the journal is written in place
+// after the checkpoint, in the order of the flush like without the journal
+int commit_journal_transaction(int fd) {
+    if (journal_transaction_length <= (int) sizeof(struct journal_transaction)) {
+        return SUCCESS;
+    }
+
+    struct journal_transaction* transaction = (struct journal_transaction*) journal_transaction;
+    memcpy(transaction->magic, JOURNAL_TRANSACTION_MAGIC, sizeof(transaction->magic));
+    transaction->sequence = journal_sequence;
+    transaction->length = journal_transaction_length - sizeof(struct journal_transaction);
+    transaction->checksum = 0;
+    transaction->reserved = 0;
+    transaction->checksum = get_journal_checksum(journal_transaction, journal_transaction_length);
+    int padded_length = (journal_transaction_length + sector_size - 1) & ~(sector_size - 1);
+    memset(journal_transaction + journal_transaction_length, 0, padded_length - journal_transaction_length);
+
+    int capacity = journal_size - sector_size;
+    if (journal_length + padded_length > capacity && checkpoint_journal(fd) == FAILURE) {
+        return FAILURE;
+    }
+    if (padded_length > capacity) {
+        int result = apply_journal_transactions(fd, journal_transaction, padded_length);
+        storage->sync(fd);
+        return result;
+    }
+
+    // The header of the sequence of a checkpoint must be on the disk before its transactions
+    if (!is_journal_header_synced) {
+        if (write_journal_header(fd, journal_sequence) == FAILURE) {
+            return FAILURE;
+        }
+        storage->sync(fd);
+        is_journal_header_synced = 1;
+    }
+
+    if (storage->write_at(fd, journal_transaction, padded_length, journal_offset + sector_size + journal_length) != padded_length) {
+        printf("Could not write the journal!\n");
+        return FAILURE;
+    }
+    memcpy(journal + sector_size + journal_length, journal_transaction, padded_length);
+    journal_length += padded_length;
+    storage->sync(fd);
+
+    // The committed writes are made in place without a sync, a replay writes them again if they are lost
+    apply_journal_transactions(fd, journal_transaction, padded_length);
+    return SUCCESS;
+}
+
+// Write the transactions of the journal in place and sync them, then start the next sequence with an empty journal
+// The header of the next sequence is synced before its first transaction, until then a replay of the old sequence
+// writes the same bytes again
+int checkpoint_journal(int fd) {
+    if (journal == NULL || journal_length == 0) {
+        return SUCCESS;
+    }
+
+    // The transactions stay in the journal if they can not be written, so they are replayed later
+    if (apply_journal_transactions(fd, journal + sector_size, journal_length) == FAILURE) {
+        printf("Could not write back the journal!\n");
+        return FAILURE;
+    }
+    storage->sync(fd);
+
+    journal_sequence++;
+    journal_length = 0;
+    is_journal_header_synced = 0;
+    return write_journal_header(fd, journal_sequence);
+}
+
+// FNV-1a hash of the bytes of the journal
+unsigned int get_journal_checksum(const unsigned char* bytes, size_t length) {
+    unsigned int checksum = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        checksum = (checksum ^ bytes[i]) * 16777619u;
+    }
+    return checksum;
+}
+
+// Unmap the disk image if it is mapped and close it
+void close_disk_image(int fd) {
+    if (image_map != NULL) {
+        munmap(image_map, image_map_size);
+        image_map = NULL;
+    }
+    close_io_ring();
+    storage = &fd_backend;
+    close(fd);
+}
+
+// Read from the disk image with pread
+ssize_t fd_read_at(int fd, void* buffer, size_t length, off_t offset) {
+    return pread(fd, buffer, length, offset);
+}
+
+// Write to the disk image with pwrite
+ssize_t fd_write_at(int fd, const void* buffer, size_t length, off_t offset) {
+    return pwrite(fd, buffer, length, offset);
+}
+
+// Write the vectors to the disk image with pwritev
+ssize_t fd_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset) {
+    return pwritev(fd, iov, iov_count, offset);
+}
+
+// Sync the data of the disk image
+int fd_sync(int fd) {
+    return fdatasync(fd);
+}
+
+// Zero the range by punching a hole into the disk image, so a sparse image does not grow
+// If the file system can not punch holes, the range is zeroed in place without writing it
+int fd_zero_range(int fd, off_t offset, off_t length) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP) {
+        return -1;
+    }
+    return fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
+
+// Submit the writes one after the other with the write function of the storage backend
+// If is_synced is set, the written data is synced after the writes
+int write_requests_one_by_one(int fd, const struct write_request* requests, int n_requests, int is_synced) {
+    int result = SUCCESS;
+    for (int i = 0; i < n_requests; i++) {
+        if (storage->write_at(fd, requests[i].buffer, requests[i].length, requests[i].offset) != requests[i].length) {
+            result = FAILURE;
+        }
+    }
+    if (is_synced && storage->sync(fd) < 0) {
+        result = FAILURE;
+    }
+    return result;
+}
+
+// Read the blocks of the file with pread into a buffer and pass them to the consumer
+// The read-ahead stage advises the next window of the chain while the current block is consumed
+// Return the number of bytes that are consumed before the end of the chain or a failure
+int fd_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context) {
+    static unsigned char read_buffer[READ_BUFFER_SIZE];
+    struct file_block_cursor cursor = { map, file_size, READ_BUFFER_SIZE, 0, 0 };
+    struct read_ahead read_ahead;
+    init_read_ahead(&read_ahead, map, file_size);
+    off_t disk_offset;
+    int file_offset;
+    int length;
+    int read_size = 0;
+    while (get_next_file_block(&cursor, &disk_offset, &file_offset, &length)) {
+        advance_read_ahead(fd, &read_ahead, file_offset);
+        if (read_block_counting_hits(fd, read_buffer, length, disk_offset) != length) {
+            printf("Could not read the file!\n");
+            break;
+        }
+        if (consume(read_buffer, file_offset, length, context) == FAILURE) {
+            break;
+        }
+        read_size += length;
+    }
+    return read_size;
+}
+
+// Pass the blocks of the file to the consumer directly from the mapping
+// The read-ahead stage advises the kernel to map the next window of the chain
+int mmap_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context) {
+    struct file_block_cursor cursor = { map, file_size, READ_BUFFER_SIZE, 0, 0 };
+    struct read_ahead read_ahead;
+    init_read_ahead(&read_ahead, map, file_size);
+    off_t disk_offset;
+    int file_offset;
+    int length;
+    int read_size = 0;
+    while (get_next_file_block(&cursor, &disk_offset, &file_offset, &length)) {
+        if (disk_offset + length > image_map_size) {
+            printf("Could not read the file!\n");
+            break;
+        }
+        advance_read_ahead(fd, &read_ahead, file_offset);
+        if (consume(image_map + disk_offset, file_offset, length, context) == FAILURE) {
+            break;
+        }
+        read_size += length;
+    }
+    return read_size;
+}
+
+// Start the read-ahead stage of the file at its beginning
+void init_read_ahead(struct read_ahead* read_ahead, struct extent_map* map, int file_size) {
+    struct file_block_cursor cursor = { map, file_size, INT_MAX, 0, 0 };
+    read_ahead->cursor = cursor;
+    read_ahead->advised_file_offset = 0;
+}
+
+// Advise the chain up to a window ahead of the given file offset
+// The window is refilled when half of it has been read, so the advised ranges are large and merged
+void advance_read_ahead(int fd, struct read_ahead* read_ahead, int file_offset) {
+    if (read_ahead_window == 0 || read_ahead->advised_file_offset - file_offset > read_ahead_window / 2) {
+        return;
+    }
+
+    off_t range_start = 0;
+    off_t range_end = 0;
+    int window_end = file_offset + read_ahead_window;
+    read_ahead->cursor.max_block_length = window_end - read_ahead->advised_file_offset;
+    off_t disk_offset;
+    int block_offset;
+    int length;
+    while (read_ahead->advised_file_offset < window_end
+        && get_next_file_block(&read_ahead->cursor, &disk_offset, &block_offset, &length)) {
+        // Merge the disk adjacent blocks
+        if (disk_offset != range_end) {
+            advise_disk_range(fd, range_start, range_end);
+            range_start = disk_offset;
+        }
+        range_end = disk_offset + length;
+        read_ahead->advised_file_offset = block_offset + length;
+        read_ahead->cursor.max_block_length = window_end - read_ahead->advised_file_offset;
+    }
+    advise_disk_range(fd, range_start, range_end);
+}
+
+// Advise the kernel to read the range of the disk image, through the mapping if the disk image is mapped
+void advise_disk_range(int fd, off_t start, off_t end) {
+    if (start >= end) {
+        return;
+    }
+    read_ahead_advised_bytes += end - start;
+    read_ahead_advice_calls++;
+    if (image_map != NULL) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        off_t page_start = start / page_size * page_size;
+        if (end > image_map_size) {
+            end = image_map_size;
+        }
+        madvise(image_map + page_start, end - page_start, MADV_WILLNEED);
+    } else {
+        posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+    }
+}
+
+// Read the block with pread and count a hit if it is already in the page cache
+// With --read-ahead-stats the block is first read without waiting for the disk, a miss is read again normally
+int read_block_counting_hits(int fd, unsigned char* buffer, int length, off_t offset) {
+    if (!is_read_ahead_stats_requested) {
+        return pread(fd, buffer, length, offset);
+    }
+    if (is_nowait_read_supported) {
+        struct iovec iov = { buffer, length };
+        ssize_t result = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+        if (result == length) {
+            read_ahead_hits++;
+            return length;
+        }
+        if (result < 0 && errno != EAGAIN) {
+            is_nowait_read_supported = 0;
+        }
+    }
+    read_ahead_misses++;
+    return pread(fd, buffer, length, offset);
+}
+
+// Print the statistics of the read-ahead to the standard error
+void print_read_ahead_statistics() {
+    fprintf(stderr, "Read-ahead: window %d KB, %lld hits, %lld misses, %lld bytes advised in %lld calls\n",
+        read_ahead_window / 1024, read_ahead_hits, read_ahead_misses, read_ahead_advised_bytes, read_ahead_advice_calls);
+}
+
+// Count a call of the operation with its bytes, the latency is added to the histogram if it is not negative
+void count_operation(enum stats_operation operation, long long n_bytes, long long latency_ns) {
+    struct operation_stats* stats = &operation_stats[operation];
+    stats->calls++;
+    if (n_bytes > 0) {
+        stats->bytes += n_bytes;
+    }
+    if (latency_ns < 0) {
+        return;
+    }
+
+    stats->timed_calls++;
+    stats->total_latency_ns += latency_ns;
+    if (latency_ns > stats->max_latency_ns) {
+        stats->max_latency_ns = latency_ns;
+    }
+    int bucket = 0;
+    for (long long us = latency_ns / 1000; us > 0 && bucket < N_LATENCY_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    stats->latency_buckets[bucket]++;
+}
+
+long long get_monotonic_time_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Print the statistics as a single JSON object to the standard error
+// The latency histogram maps the upper bound of each non-empty bucket in microseconds to its count
+void print_statistics() {
+    const char* sync_mode_names[] = { "always", "op", "none" };
+    fprintf(stderr, "{\"backend\": \"%s\", \"sync_mode\": \"%s\", \"syncs\": %lld, ",
+        measured_storage != NULL ? measured_storage->name : storage->name, sync_mode_names[sync_mode], stats_syncs);
+    fprintf(stderr, "\"fat_entries_scanned\": %lld, \"clusters_allocated\": %lld, \"clusters_freed\": %lld, \"operations\": {",
+        stats_fat_entries_scanned, stats_clusters_allocated, stats_clusters_freed);
+    int is_first = 1;
+    for (int i = 0; i < N_STATS_OPERATIONS; i++) {
+        struct operation_stats* stats = &operation_stats[i];
+        if (stats->calls == 0) {
+            continue;
+        }
+        fprintf(stderr, "%s\"%s\": {\"calls\": %lld, \"bytes\": %lld", is_first ? "" : ", ", stats_operation_names[i], stats->calls, stats->bytes);
+        is_first = 0;
+        if (stats->timed_calls == 0) {
+            fprintf(stderr, "}");
+            continue;
+        }
+        fprintf(stderr, ", \"total_us\": %.1f, \"mean_us\": %.2f, \"max_us\": %.1f, \"latency_us\": {",
+            stats->total_latency_ns / 1e3, stats->total_latency_ns / 1e3 / stats->timed_calls, stats->max_latency_ns / 1e3);
+        int is_first_bucket = 1;
+        for (int j = 0; j < N_LATENCY_BUCKETS; j++) {
+            if (stats->latency_buckets[j] > 0) {
+                fprintf(stderr, "%s\"<%lld\": %lld", is_first_bucket ? "" : ", ", 1LL << j, stats->latency_buckets[j]);
+                is_first_bucket = 0;
+            }
+        }
+        fprintf(stderr, "}}");
+    }
+    fprintf(stderr, "}}\n");
+}
+
+// The stats backend counts and times each call and passes it to the measured backend
+ssize_t stats_read_at(int fd, void* buffer, size_t length, off_t offset) {
+    STATS_TIMER_START(start);
+    ssize_t result = measured_storage->read_at(fd, buffer, length, offset);
+    STATS_TIMER_END(STATS_STORAGE_READ, start, result);
+    return result;
+}
+
+ssize_t stats_write_at(int fd, const void* buffer, size_t length, off_t offset) {
+    STATS_TIMER_START(start);
+    ssize_t result = measured_storage->write_at(fd, buffer, length, offset);
+    STATS_TIMER_END(STATS_STORAGE_WRITE, start, result);
+    return result;
+}
+
+ssize_t stats_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset) {
+    STATS_TIMER_START(start);
+    ssize_t result = measured_storage->writev_at(fd, iov, iov_count, offset);
+    STATS_TIMER_END(STATS_STORAGE_WRITEV, start, result);
+    return result;
+}
+
+int stats_sync(int fd) {
+    STATS_TIMER_START(start);
+    int result = measured_storage->sync(fd);
+    STATS_TIMER_END(STATS_STORAGE_SYNC, start, 0);
+    STATS_ADD(stats_syncs, 1);
+    return result;
+}
+
+int stats_zero_range(int fd, off_t offset, off_t length) {
+    STATS_TIMER_START(start);
+    int result = measured_storage->zero_range(fd, offset, length);
+    STATS_TIMER_END(STATS_STORAGE_ZERO_RANGE, start, result == 0 ? length : 0);
+    return result;
+}
+
+// A synced batch that does not sync through the sync call, like the drained sync of io_uring, is counted as a sync
+int stats_write_batch(int fd, const struct write_request* requests, int n_requests, int is_synced) {
+    long long n_bytes = 0;
+    for (int i = 0; i < n_requests; i++) {
+        n_bytes += requests[i].length;
+    }
+    long long syncs_before = stats_syncs;
+    STATS_TIMER_START(start);
+    int result = measured_storage->write_batch(fd, requests, n_requests, is_synced);
+    STATS_TIMER_END(STATS_STORAGE_WRITE_BATCH, start, n_bytes);
+    if (is_synced && stats_syncs == syncs_before) {
+        STATS_ADD(stats_syncs, 1);
+    }
+    return result;
+}
+
+int stats_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context) {
+    STATS_TIMER_START(start);
+    int result = measured_storage->read_file_blocks(fd, map, file_size, consume, context);
+    STATS_TIMER_END(STATS_STORAGE_READ_FILE_BLOCKS, start, result);
+    return result;
+}
+
+// Get the next block of the file, the blocks end at the extent boundaries, at the file size
+// and at the end of the cluster chain if it is shorter than the file
+// Return 1 if there is a next block, 0 otherwise
+int get_next_file_block(struct file_block_cursor* cursor, off_t* disk_offset, int* file_offset, int* length) {
+    while (cursor->extent_index < cursor->map->n_extents && cursor->file_offset < cursor->file_size) {
+        struct cluster_extent* extent = &cursor->map->extents[cursor->extent_index];
+        long long extent_start = (long long) extent->file_cluster * cluster_size;
+        long long extent_end = (long long) (extent->file_cluster + extent->length) * cluster_size;
+        if (extent_end > cursor->file_size) {
+            extent_end = cursor->file_size;
+        }
+        if (cursor->file_offset >= extent_end) {
+            cursor->extent_index++;
+            continue;
+        }
+
+        *length = extent_end - cursor->file_offset < cursor->max_block_length ? extent_end - cursor->file_offset : cursor->max_block_length;
+        *disk_offset = get_cluster_offset(extent->first_cluster) + (cursor->file_offset - extent_start);
+        *file_offset = cursor->file_offset;
+        cursor->file_offset += *length;
+        return 1;
+    }
+    return 0;
+}
+
+// Set up an io_uring instance for the disk image, map its rings and register the read buffer pool
+// The buffer pool is used with plain reads if it can not be registered, for example because of the memlock limit
+int setup_io_ring(int fd) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, IO_RING_QUEUE_DEPTH, &params);
+    if (ring_fd < 0) {
+        return FAILURE;
+    }
+
+    io_ring.ring_fd = ring_fd;
+    io_ring.sq_entries = params.sq_entries;
+    io_ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    io_ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io_ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io_ring.sq_ring = mmap(NULL, io_ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    io_ring.cq_ring = mmap(NULL, io_ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, io_ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (posix_memalign((void**) &io_ring.buffers, IMPORT_BUFFER_ALIGNMENT, IO_RING_N_BUFFERS * READ_BUFFER_SIZE) != 0) {
+        io_ring.buffers = NULL;
+    }
+    if (io_ring.sq_ring == MAP_FAILED || io_ring.cq_ring == MAP_FAILED || sqes == MAP_FAILED || io_ring.buffers == NULL) {
+        io_ring.sqes = sqes == MAP_FAILED ? NULL : sqes;
+        close_io_ring();
+        return FAILURE;
+    }
+    io_ring.sqes = sqes;
+
+    unsigned char* sq_ring = io_ring.sq_ring;
+    unsigned char* cq_ring = io_ring.cq_ring;
+    io_ring.sq_head = (unsigned int*) (sq_ring + params.sq_off.head);
+    io_ring.sq_tail = (unsigned int*) (sq_ring + params.sq_off.tail);
+    io_ring.sq_ring_mask = (unsigned int*) (sq_ring + params.sq_off.ring_mask);
+    io_ring.sq_array = (unsigned int*) (sq_ring + params.sq_off.array);
+    io_ring.cq_head = (unsigned int*) (cq_ring + params.cq_off.head);
+    io_ring.cq_tail = (unsigned int*) (cq_ring + params.cq_off.tail);
+    io_ring.cq_ring_mask = (unsigned int*) (cq_ring + params.cq_off.ring_mask);
+    io_ring.cqes = (struct io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+
+    // Register the read buffers, so the kernel does not map them for every read
+    struct iovec buffer_iovecs[IO_RING_N_BUFFERS];
+    for (int i = 0; i < IO_RING_N_BUFFERS; i++) {
+        buffer_iovecs[i].iov_base = io_ring.buffers + i * READ_BUFFER_SIZE;
+        buffer_iovecs[i].iov_len = READ_BUFFER_SIZE;
+    }
+    io_ring.is_buffers_registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffer_iovecs, IO_RING_N_BUFFERS) == 0;
+
+    storage = &uring_backend;
+    return SUCCESS;
+}
+
+// Unmap the rings and close the io_uring instance if it is set up
+void close_io_ring() {
+    if (io_ring.ring_fd < 0) {
+        return;
+    }
+    if (io_ring.sqes != NULL) {
+        munmap(io_ring.sqes, io_ring.sqes_size);
+    }
+    if (io_ring.sq_ring != NULL && io_ring.sq_ring != MAP_FAILED) {
+        munmap(io_ring.sq_ring, io_ring.sq_ring_size);
+    }
+    if (io_ring.cq_ring != NULL && io_ring.cq_ring != MAP_FAILED) {
+        munmap(io_ring.cq_ring, io_ring.cq_ring_size);
+    }
+    free(io_ring.buffers);
+    close(io_ring.ring_fd);
+    memset(&io_ring, 0, sizeof(io_ring));
+    io_ring.ring_fd = -1;
+}
+
+// Return a cleared submission queue entry, the queued entries are submitted first if the queue is full
+struct io_uring_sqe* get_io_ring_sqe() {
+    unsigned int tail = *io_ring.sq_tail;
+    if (tail - __atomic_load_n(io_ring.sq_head, __ATOMIC_ACQUIRE) >= io_ring.sq_entries) {
+        submit_io_ring(0);
+    }
+    unsigned int index = tail & *io_ring.sq_ring_mask;
+    struct io_uring_sqe* sqe = &io_ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    io_ring.sq_array[index] = index;
+    __atomic_store_n(io_ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io_ring.n_unsubmitted++;
+    return sqe;
+}
+
+// Submit the queued entries with a single system call and wait for wait_nr completions
+int submit_io_ring(unsigned int wait_nr) {
+    while (1) {
+        int result = syscall(__NR_io_uring_enter, io_ring.ring_fd, io_ring.n_unsubmitted, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (result >= 0) {
+            io_ring.n_unsubmitted -= result;
+            return SUCCESS;
+        }
+        if (errno != EINTR) {
+            return FAILURE;
+        }
+    }
+}
+
+// Wait for the next completion and return its user data and its result
+int wait_io_ring_completion(unsigned long long* user_data, int* result) {
+    while (1) {
+        unsigned int head = *io_ring.cq_head;
+        if (head != __atomic_load_n(io_ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &io_ring.cqes[head & *io_ring.cq_ring_mask];
+            *user_data = cqe->user_data;
+            *result = cqe->res;
+            __atomic_store_n(io_ring.cq_head, head + 1, __ATOMIC_RELEASE);
+            return SUCCESS;
+        }
+        if (submit_io_ring(1) == FAILURE) {
+            return FAILURE;
+        }
+    }
+}
+
+// Submit a single request and wait for it, return its result like the matching system call
+int run_io_ring_request(int opcode, int fd, const void* address, unsigned int length, off_t offset) {
+    struct io_uring_sqe* sqe = get_io_ring_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) address;
+    sqe->len = length;
+    sqe->off = offset;
+    if (opcode == IORING_OP_FSYNC) {
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+
+    unsigned long long user_data;
+    int result;
+    if (submit_io_ring(1) == FAILURE || wait_io_ring_completion(&user_data, &result) == FAILURE) {
+        return -1;
+    }
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+
+// Read from the disk image with a single io_uring request
+ssize_t uring_read_at(int fd, void* buffer, size_t length, off_t offset) {
+    return run_io_ring_request(IORING_OP_READ, fd, buffer, length, offset);
+}
+
+// Write to the disk image with a single io_uring request
+ssize_t uring_write_at(int fd, const void* buffer, size_t length, off_t offset) {
+    return run_io_ring_request(IORING_OP_WRITE, fd, buffer, length, offset);
+}
+
+// Write the vectors to the disk image with a single io_uring request
+ssize_t uring_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset) {
+    return run_io_ring_request(IORING_OP_WRITEV, fd, iov, iov_count, offset);
+}
+
+// Sync the data of the disk image with an io_uring request
+int uring_sync(int fd) {
+    return run_io_ring_request(IORING_OP_FSYNC, fd, NULL, 0, 0);
+}
+
+// Submit the writes together and wait for all of them, as many writes as the queue holds go in one system call
+// If is_synced is set, a sync is queued behind the writes with a drain, so it starts after every write is done
+int uring_write_batch(int fd, const struct write_request* requests, int n_requests, int is_synced) {
+    int result = SUCCESS;
+    int first = 0;
+    while (first < n_requests || is_synced) {
+        unsigned int n_queued = 0;
+        for (; first < n_requests && n_queued < io_ring.sq_entries; first++, n_queued++) {
+            struct io_uring_sqe* sqe = get_io_ring_sqe();
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long) requests[first].buffer;
+            sqe->len = requests[first].length;
+            sqe->off = requests[first].offset;
+            sqe->user_data = first;
+        }
+        // The sync goes with the last writes
+        if (first == n_requests && is_synced && n_queued < io_ring.sq_entries) {
+            struct io_uring_sqe* sqe = get_io_ring_sqe();
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = fd;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->flags = IOSQE_IO_DRAIN;
+            sqe->user_data = n_requests;
+            n_queued++;
+            is_synced = 0;
+        }
+
+        if (submit_io_ring(n_queued) == FAILURE) {
+            return FAILURE;
+        }
+        for (unsigned int i = 0; i < n_queued; i++) {
+            unsigned long long user_data;
+            int written;
+            if (wait_io_ring_completion(&user_data, &written) == FAILURE) {
+                return FAILURE;
+            }
+            if (user_data == n_requests ? written < 0 : written != requests[user_data].length) {
+                result = FAILURE;
+            }
+        }
+    }
+    return result;
+}
+
+// Read the blocks of the file through io_uring into the buffer pool and pass them to the consumer in file order
+// Up to IO_RING_N_BUFFERS reads are queued ahead along the extents, so the latencies of the reads overlap
+// even if the file is fragmented. The completions that arrive before their turn are remembered in their slot
+int uring_read_file_blocks(int fd, struct extent_map* map, int file_size, int (*consume)(unsigned char* bytes, int file_offset, int length, void* context), void* context) {
+    struct {
+        int file_offset;
+        int length;
+        int result;
+        int is_done;
+    } slots[IO_RING_N_BUFFERS];
+    struct file_block_cursor cursor = { map, file_size, READ_BUFFER_SIZE, 0, 0 };
+    int next_submit = 0;
+    int next_consume = 0;
+    int is_end = 0;
+    int is_failed = 0;
+    int read_size = 0;
+
+    while (1) {
+        // Queue reads into the free buffers
+        int n_queued = 0;
+        while (!is_end && !is_failed && next_submit - next_consume < IO_RING_N_BUFFERS) {
+            off_t disk_offset;
+            int slot = next_submit % IO_RING_N_BUFFERS;
+            if (!get_next_file_block(&cursor, &disk_offset, &slots[slot].file_offset, &slots[slot].length)) {
+                is_end = 1;
+                break;
+            }
+            slots[slot].is_done = 0;
+
+            struct io_uring_sqe* sqe = get_io_ring_sqe();
+            sqe->opcode = io_ring.is_buffers_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long) (io_ring.buffers + slot * READ_BUFFER_SIZE);
+            sqe->len = slots[slot].length;
+            sqe->off = disk_offset;
+            sqe->buf_index = slot;
+            sqe->user_data = slot;
+            next_submit++;
+            n_queued++;
+        }
+        if (n_queued > 0 && submit_io_ring(0) == FAILURE) {
+            // The queued reads are submitted with the next wait
+            is_failed = 1;
+        }
+        if (next_consume == next_submit) {
+            break;
+        }
+
+        // Wait for the next block in order
+        int slot = next_consume % IO_RING_N_BUFFERS;
+        while (!slots[slot].is_done) {
+            unsigned long long user_data;
+            int result;
+            if (wait_io_ring_completion(&user_data, &result) == FAILURE) {
+                printf("Could not read the file!\n");
+                return read_size;
+            }
+            slots[user_data].result = result;
+            slots[user_data].is_done = 1;
+        }
+        next_consume++;
+
+        // After a failure the queued reads are only drained
+        if (is_failed) {
+            continue;
+        }
+        if (slots[slot].result != slots[slot].length) {
+            printf("Could not read the file!\n");
+            is_failed = 1;
+            continue;
+        }
+        if (consume(io_ring.buffers + slot * READ_BUFFER_SIZE, slots[slot].file_offset, slots[slot].length, context) == FAILURE) {
+            is_failed = 1;
+            continue;
+        }
+        read_size += slots[slot].length;
+    }
+    return read_size;
+}
+
+// Map the whole disk image and select the mmap backend
+// Without the read-ahead of the cluster chains the kernel is advised that the mapping is read sequentially
+int map_disk_image(int fd) {
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) < 0 || image_stat.st_size == 0) {
+        return FAILURE;
+    }
+
+    void* map = mmap(NULL, image_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return FAILURE;
+    }
+    if (read_ahead_window == 0) {
+        madvise(map, image_stat.st_size, MADV_SEQUENTIAL);
+    }
+    image_map = map;
+    image_map_size = image_stat.st_size;
+    storage = &mmap_backend;
+    return SUCCESS;
+}
+
+// Copy from the mapping of the disk image
+ssize_t mmap_read_at(int fd, void* buffer, size_t length, off_t offset) {
+    if (offset < 0 || offset >= image_map_size) {
+        return 0;
+    }
+    if (offset + (off_t) length > image_map_size) {
+        length = image_map_size - offset;
+    }
+    memcpy(buffer, image_map + offset, length);
+    return length;
+}
+
+// Copy to the mapping of the disk image and remember the changed range for msync
+// The buffer can be the mapped range itself if it is changed in place
+ssize_t mmap_write_at(int fd, const void* buffer, size_t length, off_t offset) {
+    if (offset < 0 || offset + (off_t) length > image_map_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (buffer != image_map + offset) {
+        memcpy(image_map + offset, buffer, length);
+    }
+    mark_image_range_dirty(offset, offset + length);
+    return length;
+}
+
+// Copy the vectors to the mapping of the disk image
+ssize_t mmap_writev_at(int fd, const struct iovec* iov, int iov_count, off_t offset) {
+    ssize_t total = 0;
+    for (int i = 0; i < iov_count; i++) {
+        ssize_t written = mmap_write_at(fd, iov[i].iov_base, iov[i].iov_len, offset + total);
+        if (written < 0) {
+            return total > 0 ? total : -1;
+        }
+        total += written;
+    }
+    return total;
+}
+
+// Zero the range through the file, the shared mapping sees the zeroed pages
+// The zeroed range is not a changed range of the mapping, so the next sync also syncs the file
+int mmap_zero_range(int fd, off_t offset, off_t length) {
+    if (offset < 0 || offset + length > image_map_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    int result = fd_zero_range(fd, offset, length);
+    if (result == 0) {
+        is_image_range_zeroed = 1;
+    }
+    return result;
+}
+
+// Sync the changed ranges of the mapping with msync, and the file if ranges are zeroed through it
+int mmap_sync(int fd) {
+    int result = SUCCESS;
+    if (is_image_range_zeroed) {
+        is_image_range_zeroed = 0;
+        if (fdatasync(fd) < 0) {
+            result = FAILURE;
+        }
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < n_image_dirty_ranges; i++) {
+        // msync needs a page aligned address
+        off_t start = image_dirty_ranges[i].start / page_size * page_size;
+        if (msync(image_map + start, image_dirty_ranges[i].end - start, MS_SYNC) < 0) {
+            result = FAILURE;
+        }
+    }
+    n_image_dirty_ranges = 0;
+    return result;
+}
+
+// Add the range to the changed ranges of the mapping, overlapping and adjacent ranges are merged
+// If there are too many ranges, every range is merged into one
+void mark_image_range_dirty(off_t start, off_t end) {
+    for (int i = 0; i < n_image_dirty_ranges; i++) {
+        struct dirty_range* range = &image_dirty_ranges[i];
+        if (start <= range->end && end >= range->start) {
+            range->start = start < range->start ? start : range->start;
+            range->end = end > range->end ? end : range->end;
+            return;
+        }
+    }
+
+    if (n_image_dirty_ranges == MAX_DIRTY_RANGES) {
+        for (int i = 1; i < n_image_dirty_ranges; i++) {
+            if (image_dirty_ranges[i].start < image_dirty_ranges[0].start) {
+                image_dirty_ranges[0].start = image_dirty_ranges[i].start;
+            }
+            if (image_dirty_ranges[i].end > image_dirty_ranges[0].end) {
+                image_dirty_ranges[0].end = image_dirty_ranges[i].end;
+            }
+        }
+        n_image_dirty_ranges = 1;
+        mark_image_range_dirty(start, end);
+        return;
+    }
+
+    image_dirty_ranges[n_image_dirty_ranges].start = start;
+    image_dirty_ranges[n_image_dirty_ranges].end = end;
+    n_image_dirty_ranges++;
+}
+
+// Copy the FAT table from the mapping to a private buffer before it is changed
+// Otherwise the kernel could write the changed entries back before the data they refer to
+// In the none sync mode the order does not matter and the mapped FAT table is changed in place
+int make_fat_table_cache_private() {
+    if (!is_fat_table_cache_mapped || sync_mode == SYNC_MODE_NONE) {
+        return SUCCESS;
+    }
+    unsigned char* private_cache = malloc(fat_size * sector_size);
+    if (private_cache == NULL) {
+        printf("Could not allocate memory for the FAT table!\n");
+        return FAILURE;
+    }
+    memcpy(private_cache, fat_table_cache, fat_size * sector_size);
+    fat_table_cache = private_cache;
+    is_fat_table_cache_mapped = 0;
+    return SUCCESS;
+}
+
+// Write the bytes to the file starting at the given start offset and length with the given data
+// This operation can overwrite existing data in the file and add new data, potentially allocating new free clusters to the file.
+// Data is an unsigned integer between 0 and 255
+// The same data byte will be written in consecutive bytes
+// If the file is empty, the program will allocate a new cluster for the file and update the FAT table
+// If the file is not empty, the program will find the cluster that contains the start offset and write the data
+// If the length is larger than the remaining space in the cluster, the program will allocate a new cluster(s) and update the FAT table
+int write_bytes_to_file(int fd, int start_offset, int length, int data) {
+    // Find the entry with the given file name and extension
+    int directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
+    if (directory_entry_index == FAILURE) {
+        printf("File not found!\n");
+        return FAILURE;
+    }
+
+    // Check if the start offset is valid   
+    if (start_offset < 0) {
+        printf("Start offset is invalid!\n Start offset: %d\n", start_offset);
+        return FAILURE;
+    }
+
+    // Check if the start offset is not larger than the file size
+    if (start_offset > file_directory_entry->size) {
+        printf("Start offset is larger than the file size! Start offset: %d, File size: %d\n", start_offset, file_directory_entry->size);
+        return FAILURE;
+    }
+
+    // Remember the size of the file before the write to know which clusters hold file data
+    int old_file_size = file_directory_entry->size;
+
+    // Find the current cluster size of the file and the clusters needed for the new data
+    int file_cluster_size = file_directory_entry->size / cluster_size + (file_directory_entry->size % cluster_size != 0);
+    int clusters_needed = (start_offset + length) / cluster_size + ((start_offset + length) % cluster_size != 0) - file_cluster_size;
+
+    // Get the first cluster of the file by combining the high and low bytes
+    unsigned int first_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
+
+    // Get the extent map of the file, it is empty if the file has no clusters
+    struct extent_map* map = get_extent_map(fd, first_cluster);
+    if (map == NULL) {
+        return FAILURE;
+    }
+
+    // Allocate new clusters if needed
+    if (clusters_needed > 0) {
+        // Find the last cluster of the file from the last extent
+        unsigned int current_cluster = 0;
+        if (file_cluster_size > 0) {
+            current_cluster = get_extent_map_cluster(map, file_cluster_size - 1);
+        }
+
+        // Allocate all of the new clusters at once, they are already chained in the FAT table
+        unsigned int* new_clusters = malloc(clusters_needed * sizeof(unsigned int));
+        if (new_clusters == NULL) {
+            return FAILURE;
+        }
+        if (allocate_clusters(fd, clusters_needed, new_clusters) == FAILURE) {
+            printf("No free clusters available!\n");
+            free(new_clusters);
+            return FAILURE;
+        }
+
+        // Update the FAT table
+        if (current_cluster == 0) {
+            // Update the first cluster of the file and build its extent map from the new chain
+            file_directory_entry->starthi = new_clusters[0] >> 16;
+            file_directory_entry->start = new_clusters[0] & 0xFFFF;
+            first_cluster = new_clusters[0];
+            map = get_extent_map(fd, first_cluster);
+        } else {
+            // Change the end value of the last cluster to the first new cluster
+            write_fat_table_entry(fd, current_cluster, new_clusters[0]);
+            if (append_to_extent_map(map, new_clusters, clusters_needed) == FAILURE) {
+                invalidate_extent_map(first_cluster);
+                map = get_extent_map(fd, first_cluster);
+            }
+        }
+
+        free(new_clusters);
+        if (map == NULL) {
+            return FAILURE;
+        }
+    }
+
+    // Write the data to the file before the directory entry is updated, so the metadata refers to written data
+    // Find the offset in the cluster that contains the start offset
+    int cluster_offset = start_offset % cluster_size;
+
+    // The cluster that contains the start offset is found from the extent map
+    if (length > 0) {
+        int result = fill_cluster_chain(fd, map, start_offset / cluster_size, cluster_offset, length, data, old_file_size - (start_offset - cluster_offset));
+        if (result == FAILURE) {
+            return FAILURE;
+        }
+    }
+
+    // Update the file directory entry in the root directory
+
+    // Increase the size of the file if the length + start offset is larger than the file size
+    if (start_offset + length > file_directory_entry->size) {
+        file_directory_entry->size = start_offset + length;
+    }
+
+    // Update the time and date of the file directory entry
+    time_t current_time = time(NULL);
+    struct tm* time_info = localtime(&current_time);
+    file_directory_entry->time = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
+    file_directory_entry->date = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+    file_directory_entry->adate = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+
+    // Update the file directory entry in the root directory
+    // It is written back after the FAT table when the disk image is flushed
+    int result = write_file_directory_entry(fd, directory_entry_index);
+    if (result == FAILURE) {
+        return FAILURE;
+    }
+
+    printf("Bytes written to the file successfully!\n");
+    return SUCCESS;
+}
+
+// Fill length bytes of the file with the data byte starting at the cluster offset of the given cluster of the file
+// The clusters are taken from the extents of the file and each extent is written with a single pwritev
+// Full clusters are written from an aligned buffer that is filled once for each data byte, only the partial first
+// and last clusters are read, modified and written back. Existing length is the size of the file data from the start
+// of the first cluster, a partial last cluster without any file data after the written bytes is not read
+// Runs of full clusters filled with zeros are zeroed by the storage backend without writing them
+// The data is marked pending and synced before the metadata when the disk image is flushed
+int fill_cluster_chain(int fd, struct extent_map* map, unsigned int first_file_cluster, int cluster_offset, int length, int data, int existing_length) {
+    static unsigned char* fill_buffer;
+    static int fill_buffer_data = -1;
+    static unsigned char first_cluster_buffer[MAX_CLUSTER_SIZE];
+    static unsigned char last_cluster_buffer[MAX_CLUSTER_SIZE];
+    struct iovec iov[MAX_WRITE_VECTORS];
+
+    if (fill_buffer == NULL && posix_memalign((void**) &fill_buffer, IMPORT_BUFFER_ALIGNMENT, FILL_BUFFER_SIZE) != 0) {
+        fill_buffer = NULL;
+        return FAILURE;
+    }
+    if (fill_buffer_data != data) {
+        memset(fill_buffer, data, FILL_BUFFER_SIZE);
+        fill_buffer_data = data;
+    }
+    int is_zero_fill = data == 0 && is_zero_range_supported;
+
+    // Check if the cluster chain covers the bytes that are written
+    int end = cluster_offset + length;
+    int n_clusters = end / cluster_size + (end % cluster_size != 0);
+    if (first_file_cluster + n_clusters > map->n_clusters) {
+        printf("Cluster chain of the file is broken!\n");
+        return FAILURE;
+    }
+
+    int result = SUCCESS;
+    int extent_index = find_extent_index(map, first_file_cluster);
+    int i = 0;
+    while (i < n_clusters && result == SUCCESS) {
+        // Find the part of the extent that is written, starting at the cluster i
+        struct cluster_extent* extent = &map->extents[extent_index++];
+        unsigned int file_cluster = first_file_cluster + i;
+        unsigned int extent_cluster = extent->first_cluster + (file_cluster - extent->file_cluster);
+        int extent_end = i + (extent->file_cluster + extent->length - file_cluster);
+        if (extent_end > n_clusters) {
+            extent_end = n_clusters;
+        }
+
+        off_t offset = get_cluster_offset(extent_cluster);
+        int iov_count = 0;
+        off_t zero_length = 0;
+        for (int k = i; k < extent_end && result == SUCCESS; k++) {
+            // Find the written part of the cluster
+            int low = k == 0 ? cluster_offset : 0;
+            int high = k == n_clusters - 1 ? end - k * cluster_size : cluster_size;
+
+            // Full clusters of a zero fill are zeroed together after the vectors before them are written
+            if (is_zero_fill && low == 0 && high == cluster_size) {
+                if (iov_count > 0) {
+                    result = write_iovecs(fd, iov, iov_count, offset);
+                    for (int v = 0; v < iov_count; v++) {
+                        offset += iov[v].iov_len;
+                    }
+                    iov_count = 0;
+                }
+                zero_length += cluster_size;
+                continue;
+            }
+            if (zero_length > 0) {
+                result = zero_disk_range(fd, offset, zero_length);
+                offset += zero_length;
+                zero_length = 0;
+                if (result == FAILURE) {
+                    break;
+                }
+            }
+
+            if (low == 0 && high == cluster_size) {
+                // Full cluster, extend the previous fill vector if possible
+                if (iov_count > 0 && iov[iov_count - 1].iov_base == fill_buffer
+                    && iov[iov_count - 1].iov_len + cluster_size <= FILL_BUFFER_SIZE) {
+                    iov[iov_count - 1].iov_len += cluster_size;
+                    continue;
+                }
+                iov[iov_count].iov_base = fill_buffer;
+                iov[iov_count].iov_len = cluster_size;
+            } else {
+                // Partial cluster, read the cluster if it holds file data outside of the written part
+                unsigned char* cluster_buffer = k == 0 ? first_cluster_buffer : last_cluster_buffer;
+                if (low > 0 || existing_length > k * cluster_size + high) {
+                    if (read_cluster(fd, cluster_buffer, extent_cluster + (k - i)) == FAILURE) {
+                        result = FAILURE;
+                        break;
+                    }
+                }
+                memset(cluster_buffer + low, data, high - low);
+                iov[iov_count].iov_base = cluster_buffer;
+                iov[iov_count].iov_len = cluster_size;
+            }
+            iov_count++;
+
+            // Write the vectors if there is no room for another one
+            if (iov_count == MAX_WRITE_VECTORS) {
+                result = write_iovecs(fd, iov, iov_count, offset);
+                for (int v = 0; v < iov_count; v++) {
+                    offset += iov[v].iov_len;
+                }
+                iov_count = 0;
+            }
+        }
+
+        // Write or zero the rest of the extent
+        if (iov_count > 0 && result == SUCCESS) {
+            result = write_iovecs(fd, iov, iov_count, offset);
+        }
+        if (zero_length > 0 && result == SUCCESS) {
+            result = zero_disk_range(fd, offset, zero_length);
+        }
+
+        i = extent_end;
+    }
+    is_data_pending = 1;
+    sync_disk_image(fd);
+
+    return result;
+}
+
+// Change the size of the file with the input file name
+// Shrinking ends the chain at the cluster of the new last byte and frees the rest of it in the cached FAT table
+// Growing allocates the new clusters with one allocator call, which prefers a contiguous run, and chains them
+// to the end of the file. The new bytes are only zeroed if is_zeroed is set, with the zero fill of the clusters
+// The FAT table and the directory entry are written back once when the disk image is flushed
+int resize_file(int fd, int new_size, int is_zeroed) {
+    int directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
+    if (directory_entry_index == FAILURE) {
+        printf("File not found!\n");
+        return FAILURE;
+    }
+
+    int old_size = file_directory_entry->size;
+    unsigned int first_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
+    int old_n_clusters = old_size / cluster_size + (old_size % cluster_size != 0);
+    int new_n_clusters = new_size / cluster_size + (new_size % cluster_size != 0);
+    struct extent_map* map = get_extent_map(fd, first_cluster);
+    if (map == NULL) {
+        return FAILURE;
+    }
+    if (map->n_clusters < (unsigned int) old_n_clusters) {
+        printf("Cluster chain of the file is broken!\n");
+        return FAILURE;
+    }
+
+    if (new_n_clusters < (int) map->n_clusters) {
+        // Cut the chain after the new last cluster, or free all of it if the file becomes empty
+        if (new_n_clusters == 0) {
+            free_cluster_chain(fd, first_cluster);
+            file_directory_entry->starthi = 0;
+            file_directory_entry->start = 0;
+        } else {
+            unsigned int last_cluster = get_extent_map_cluster(map, new_n_clusters - 1);
+            unsigned int next_cluster = get_extent_map_cluster(map, new_n_clusters);
+            write_fat_table_entry(fd, last_cluster, FAT_TABLE_END_OF_FILE_VALUE);
+            invalidate_extent_map(first_cluster);
+            free_cluster_chain(fd, next_cluster);
+        }
+    } else if (new_n_clusters > (int) map->n_clusters) {
+        int clusters_needed = new_n_clusters - map->n_clusters;
+        unsigned int* new_clusters = malloc(clusters_needed * sizeof(unsigned int));
+        if (new_clusters == NULL) {
+            return FAILURE;
+        }
+        if (allocate_clusters(fd, clusters_needed, new_clusters) == FAILURE) {
+            printf("No free clusters available!\n");
+            free(new_clusters);
+            return FAILURE;
+        }
+
+        if (map->n_clusters == 0) {
+            file_directory_entry->starthi = new_clusters[0] >> 16;
+            file_directory_entry->start = new_clusters[0] & 0xFFFF;
+            first_cluster = new_clusters[0];
+        } else {
+            write_fat_table_entry(fd, get_extent_map_cluster(map, map->n_clusters - 1), new_clusters[0]);
+            if (append_to_extent_map(map, new_clusters, clusters_needed) == FAILURE) {
+                invalidate_extent_map(first_cluster);
+            }
+        }
+        free(new_clusters);
+    }
+
+    // Zero the new bytes before the directory entry refers to them
+    if (is_zeroed && new_size > old_size) {
+        map = get_extent_map(fd, first_cluster);
+        if (map == NULL) {
+            return FAILURE;
+        }
+        int cluster_offset = old_size % cluster_size;
+        if (fill_cluster_chain(fd, map, old_size / cluster_size, cluster_offset, new_size - old_size, 0, cluster_offset) == FAILURE) {
+            return FAILURE;
+        }
+    }
+
+    // Update the size, the time and the date of the file directory entry
+    file_directory_entry->size = new_size;
+    time_t current_time = time(NULL);
+    struct tm* time_info = localtime(&current_time);
+    file_directory_entry->time = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
+    file_directory_entry->date = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+    file_directory_entry->adate = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+    if (write_file_directory_entry(fd, directory_entry_index) == FAILURE) {
+        return FAILURE;
+    }
+
+    printf("File resized successfully!\n");
+    return SUCCESS;
+}
+
+// Zero the range of the disk image with the storage backend
+// If the backend can not zero ranges, the range is written from the zero filled buffer instead
+int zero_disk_range(int fd, off_t offset, off_t length) {
+    static unsigned char zero_buffer[FILL_BUFFER_SIZE];
+    if (is_zero_range_supported) {
+        if (storage->zero_range(fd, offset, length) == 0) {
+            return SUCCESS;
+        }
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            return FAILURE;
+        }
+        is_zero_range_supported = 0;
+    }
+
+    while (length > 0) {
+        int n = length < FILL_BUFFER_SIZE ? length : FILL_BUFFER_SIZE;
+        ssize_t written = storage->write_at(fd, zero_buffer, n, offset);
+        if (written <= 0) {
+            return FAILURE;
+        }
+        offset += written;
+        length -= written;
+    }
+    return SUCCESS;
+}
+
+// Write the vectors to the disk image starting at the offset, short writes are continued
+int write_iovecs(int fd, struct iovec* iov, int iov_count, off_t offset) {
+    while (iov_count > 0) {
+        ssize_t written = storage->writev_at(fd, iov, iov_count, offset);
+        if (written <= 0) {
+            return FAILURE;
+        }
+        offset += written;
+
+        // Skip the written vectors and advance the partially written one
+        while (iov_count > 0 && written >= (ssize_t) iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (unsigned char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return SUCCESS;
+}
+
+// Delete the file named with given input in the root directory, and free the blocks allocated for it in the FAT
+int delete_file(int fd) {
+    // Find the entry with the given file name and extension
+    int directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
+    if (directory_entry_index == FAILURE) {
+        printf("File not found!\n");
+        return FAILURE;
+    }
+
+    int result = delete_file_at(fd, directory_entry_index);
+    if (result == FAILURE) {
+        return FAILURE;
+    }
+
+    printf("File deleted successfully!\n");
+    return SUCCESS;
+}
+
+// Delete the files with the given names and the files matching the given patterns(*, ? and [...])
+// The names are found in the name index and the patterns are matched in a single pass over the root directory
+// The chains are freed in the cached FAT table, so the changed FAT sectors, FSInfo and directory clusters
+// are written once when the disk image is flushed
+int delete_files(int fd, char** names, int n_names) {
+    if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    int result = SUCCESS;
+    int n_deleted = 0;
+    char* patterns[n_names];
+    int n_patterns = 0;
+    for (int i = 0; i < n_names; i++) {
+        if (strpbrk(names[i], "*?[") != NULL) {
+            if (check_file_name_pattern(names[i]) == FAILURE) {
+                printf("File name pattern %s is invalid!\n", names[i]);
+                result = FAILURE;
+                continue;
+            }
+            patterns[n_patterns++] = names[i];
+            continue;
+        }
+
+        if (set_input_file_name(names[i]) == FAILURE) {
+            printf("File name %s is invalid!\n", names[i]);
+            result = FAILURE;
+            continue;
+        }
+        int directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
+        if (directory_entry_index == FAILURE) {
+            printf("File %s not found!\n", input_file_name);
+            result = FAILURE;
+            continue;
+        }
+        if (delete_file_at(fd, directory_entry_index) == FAILURE) {
+            return FAILURE;
+        }
+        n_deleted++;
+    }
+
+    if (n_patterns > 0) {
+        char name[TOTAL_FILENAME_SIZE + DOT_SIZE + 1];
+        for (int i = 0; i < root_directory_end_entry; i++) {
+            struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+            if (!is_indexed_file_entry(entry)) {
+                continue;
+            }
+            get_file_name_of_entry(entry, name);
+            for (int j = 0; j < n_patterns; j++) {
+                if (fnmatch(patterns[j], name, 0) == 0) {
+                    memcpy(file_directory_entry_raw, entry, FILE_DIRECTORY_ENTRY_SIZE);
+                    file_directory_entry = (struct msdos_dir_entry*) file_directory_entry_raw;
+                    if (delete_file_at(fd, i) == FAILURE) {
+                        return FAILURE;
+                    }
+                    n_deleted++;
+                    break;
+                }
+            }
+        }
+    }
+
+    printf("%d files deleted successfully!\n", n_deleted);
+    return result;
+}
+
+// Free the chain of the file directory entry read at the given index and mark the entry as deleted
+int delete_file_at(int fd, int directory_entry_index) {
+    // Get the first cluster of the file by combining the high and low bytes
+    // and free the blocks allocated for the file in the FAT
+    unsigned int first_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
+    if (first_cluster != 0) {
+        free_cluster_chain(fd, first_cluster);
+    }
+
+    // Delete the file directory entry by setting the first byte to 0xE5
+    // The freed FAT table sectors and the entry are written back when the disk image is flushed
+    file_directory_entry->name[0] = 0xE5;
+    return write_file_directory_entry(fd, directory_entry_index);
+}
+
+// Free the cluster chain starting with the given cluster in the FAT table and in the free cluster bitmap
+// Return the number of freed clusters
+int free_cluster_chain(int fd, unsigned int first_cluster) {
+    unsigned int current_cluster = first_cluster;
+    unsigned int next_cluster = get_next_FAT_table_entry(fd, current_cluster);
+
+    // The chain is freed, so its extent map can not be used anymore
+    invalidate_extent_map(first_cluster);
+
+    // Free the blocks allocated for the file in the FAT in a loop
+    int n_freed = 0;
+    while (current_cluster < FAT_TABLE_END_OF_FILE_VALUE && current_cluster > 1 && current_cluster <= max_cluster_number) {
+        // Free the current cluster in the FAT table
+        write_fat_table_entry(fd, current_cluster, FAT_TABLE_FREE_CLUSTER_VALUE);
+        mark_cluster_free(current_cluster);
+        n_freed++;
+
+        // Get the next cluster
+        current_cluster = next_cluster;
+        next_cluster = get_next_FAT_table_entry(fd, current_cluster);
+    }
+
+    STATS_ADD(stats_clusters_freed, n_freed);
+    return n_freed;
+}
+
+// Import the contents of the host file, or of the standard input if the host file name is NULL, into the file
+// The file is created if it does not exist, otherwise its clusters are freed and its contents are replaced
+// For a regular host file all of the clusters are allocated with one allocator call, preferring a contiguous run,
+// and the data is copied by the kernel. Other inputs are read in large blocks and allocated block by block
+// The FAT table and the directory entry are written back once when the disk image is flushed
+int import_file(int fd, char* host_file_name) {
+    int host_fd = STDIN_FILENO;
+    if (host_file_name != NULL) {
+        host_fd = open(host_file_name, O_RDONLY);
+        if (host_fd < 0) {
+            printf("Could not open host file!\n");
+            return FAILURE;
+        }
+    }
+
+    int result = import_from_host_fd(fd, host_fd);
+    if (host_fd != STDIN_FILENO) {
+        close(host_fd);
+    }
+    return result;
+}
+
+// Import the contents of the open host file into the file, the host file is read from its current position
+int import_from_host_fd(int fd, int host_fd) {
+    unsigned char* buffer = NULL;
+    unsigned int* clusters = NULL;
+    int result = FAILURE;
+
+    // Find the file or create it
+    int directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
+    if (directory_entry_index == FAILURE) {
+        if (create_file_entry(fd) == FAILURE) {
+            goto cleanup;
+        }
+        directory_entry_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
+        if (directory_entry_index == FAILURE) {
+            goto cleanup;
+        }
+    }
+
+    // Free the old contents of the file
+    free_cluster_chain(fd, file_directory_entry->starthi << 16 | file_directory_entry->start);
+    file_directory_entry->starthi = 0;
+    file_directory_entry->start = 0;
+    file_directory_entry->size = 0;
+
+    if (posix_memalign((void**) &buffer, IMPORT_BUFFER_ALIGNMENT, IMPORT_BUFFER_SIZE) != 0) {
+        buffer = NULL;
+        goto cleanup;
+    }
+
+    struct stat host_stat;
+    long long file_size = 0;
+    if (fstat(host_fd, &host_stat) == 0 && S_ISREG(host_stat.st_mode)) {
+        // The size is known, allocate every cluster at once
+        if (host_stat.st_size > INT_MAX) {
+            printf("Host file is too large!\n");
+            goto cleanup;
+        }
+        file_size = host_stat.st_size;
+        int n_clusters = file_size / cluster_size + (file_size % cluster_size != 0);
+        if (n_clusters > 0) {
+            clusters = malloc(n_clusters * sizeof(unsigned int));
+            if (clusters == NULL) {
+                goto cleanup;
+            }
+            if (allocate_clusters(fd, n_clusters, clusters) == FAILURE) {
+                printf("No free clusters available!\n");
+                goto cleanup;
+            }
+            file_directory_entry->starthi = clusters[0] >> 16;
+            file_directory_entry->start = clusters[0] & 0xFFFF;
+            if (import_to_clusters(fd, host_fd, clusters, n_clusters, file_size, NULL) == FAILURE) {
+                goto cleanup;
+            }
+        }
+    } else {
+        // The size is not known, allocate the clusters of each block and link them to the end of the chain
+        clusters = malloc((IMPORT_BUFFER_SIZE / cluster_size) * sizeof(unsigned int));
+        if (clusters == NULL) {
+            goto cleanup;
+        }
+        unsigned int last_cluster = 0;
+        int length;
+        while ((length = read_full(host_fd, buffer, IMPORT_BUFFER_SIZE)) > 0) {
+            if (file_size + length > INT_MAX) {
+                printf("Host file is too large!\n");
+                goto cleanup;
+            }
+            int n_clusters = length / cluster_size + (length % cluster_size != 0);
+            if (allocate_clusters(fd, n_clusters, clusters) == FAILURE) {
+                printf("No free clusters available!\n");
+                goto cleanup;
+            }
+            if (last_cluster == 0) {
+                file_directory_entry->starthi = clusters[0] >> 16;
+                file_directory_entry->start = clusters[0] & 0xFFFF;
+            } else {
+                write_fat_table_entry(fd, last_cluster, clusters[0]);
+            }
+            last_cluster = clusters[n_clusters - 1];
+
+            if (import_to_clusters(fd, host_fd, clusters, n_clusters, length, buffer) == FAILURE) {
+                goto cleanup;
+            }
+            file_size += length;
+        }
+        if (length < 0) {
+            printf("Could not read host file!\n");
+            goto cleanup;
+        }
+    }
+
+    // Update the size, the time and the date of the file directory entry
+    file_directory_entry->size = file_size;
+    time_t current_time = time(NULL);
+    struct tm* time_info = localtime(&current_time);
+    file_directory_entry->time = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
+    file_directory_entry->date = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+    file_directory_entry->adate = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+
+    result = write_file_directory_entry(fd, directory_entry_index);
+    if (result == SUCCESS) {
+        printf("File imported successfully!\n");
+    }
+
+cleanup:
+    // On failure the clusters allocated for the new contents are freed and the entry is still written,
+    // so it is an empty file that does not refer to any freed cluster
+    if (result == FAILURE && directory_entry_index != FAILURE) {
+        unsigned int first_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
+        if (first_cluster != 0) {
+            free_cluster_chain(fd, first_cluster);
+        }
+        file_directory_entry->starthi = 0;
+        file_directory_entry->start = 0;
+        file_directory_entry->size = 0;
+        write_file_directory_entry(fd, directory_entry_index);
+    }
+    free(buffer);
+    free(clusters);
+    return result;
+}
+
+// Write length bytes of the host file into the clusters, each contiguous run of clusters is written at once
+// If the buffer is NULL the data is copied from the current position of the host file by the kernel,
+// with a fallback to reading it in aligned blocks. Otherwise the data is already in the buffer
+int import_to_clusters(int fd, int host_fd, unsigned int* clusters, int n_clusters, int length, unsigned char* buffer) {
+    static int is_copy_file_range_supported = 1;
+    static unsigned char* copy_buffer;
+    int buffer_offset = 0;
+
+    int i = 0;
+    while (i < n_clusters) {
+        // Find the end of the contiguous run starting at the cluster i
+        int run_end = i + 1;
+        while (run_end < n_clusters && clusters[run_end] == clusters[run_end - 1] + 1) {
+            run_end++;
+        }
+        off_t disk_offset = get_cluster_offset(clusters[i]);
+        long long run_length = (long long) (run_end - i) * cluster_size;
+        if (run_length > length) {
+            run_length = length;
+        }
+        length -= run_length;
+
+        while (run_length > 0) {
+            ssize_t written;
+            if (buffer != NULL) {
+                written = storage->write_at(fd, buffer + buffer_offset, run_length, disk_offset);
+                buffer_offset += written > 0 ? written : 0;
+            } else if (image_map != NULL) {
+                // Read the host file directly into the mapped clusters
+                written = read_full(host_fd, image_map + disk_offset, run_length);
+                if (written != run_length) {
+                    return FAILURE;
+                }
+                mark_image_range_dirty(disk_offset, disk_offset + written);
+            } else if (is_copy_file_range_supported) {
+                // The kernel advances the disk offset
+                written = copy_file_range(host_fd, NULL, fd, &disk_offset, run_length, 0);
+                if (written < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)) {
+                    is_copy_file_range_supported = 0;
+                    continue;
+                }
+                if (written <= 0) {
+                    return FAILURE;
+                }
+                run_length -= written;
+                continue;
+            } else {
+                // Read a block of the run and write it
+                if (copy_buffer == NULL && posix_memalign((void**) &copy_buffer, IMPORT_BUFFER_ALIGNMENT, IMPORT_BUFFER_SIZE) != 0) {
+                    copy_buffer = NULL;
+                    return FAILURE;
+                }
+                int n = run_length < IMPORT_BUFFER_SIZE ? run_length : IMPORT_BUFFER_SIZE;
+                if (read_full(host_fd, copy_buffer, n) != n) {
+                    return FAILURE;
+                }
+                written = storage->write_at(fd, copy_buffer, n, disk_offset);
+                if (written != n) {
+                    return FAILURE;
+                }
+            }
+            if (written <= 0) {
+                return FAILURE;
+            }
+            disk_offset += written;
+            run_length -= written;
+        }
+
+        i = run_end;
+    }
+
+    is_data_pending = 1;
+    sync_disk_image(fd);
+    return SUCCESS;
+}
+
+// Read until the buffer is full or the end of the file is reached
+// Return the number of bytes read, FAILURE if the read fails
+int read_full(int fd, unsigned char* buffer, int length) {
+    int total = 0;
+    while (total < length) {
+        ssize_t n = read(fd, buffer + total, length - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return FAILURE;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Creates a file named with given input in the root directory. This file will have a
+// corresponding directory entry, an initial size of 0, and no blocks allocated for it initially.
+int create_file_entry(int fd) {
+    // Check if there exists a same file in the root directory
+    int result = read_root_directory(fd, FIND_GIVEN_ENTRY);
+    if (result != FAILURE) {
+        printf("File already exists!\n");
+        return FAILURE;
+    }
+
+    // Find the first free entry in the root directory
+    int free_root_directory_entry_index = read_root_directory(fd, FIND_FREE_ENTRY);
+    if (free_root_directory_entry_index == FAILURE) {
+        printf("Root directory is full!\n");
+        return FAILURE;
+    }
+
+    // Create a new file directory entry for FAT32 file system
+    memset(file_directory_entry_raw, 0, FILE_DIRECTORY_ENTRY_SIZE);
+
+    // First 8 bytes are for the file name and the last 3 bytes for the extension, both padded with spaces
+    // The name is packed like the names that are looked up, the bytes after the terminator are not copied
+    pack_file_name(input_file_name, file_directory_entry->name);
+
+    // Set the attribute of the file directory entry to 0x20 as it is a file and not a directory
+    // Directory entries are not supported in this program
+    file_directory_entry->attr = 0x20;
+
+    // Set the creation time, date, last access date
+    time_t current_time = time(NULL);
+    struct tm* time_info = localtime(&current_time);
+    // Set the creation time
+    file_directory_entry->ctime_cs = (time_info->tm_sec % 2) * 100;
+    file_directory_entry->ctime = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
+    // Set the creation date
+    file_directory_entry->cdate = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
     // Set the last access date
     file_directory_entry->adate = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
 
-    // Set high start cluster, initially set to 0
-    file_directory_entry->starthi = 0;
+    // Set high start cluster, initially set to 0
+    file_directory_entry->starthi = 0;
+
+    // Set last write time, date
+    file_directory_entry->time = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
+    file_directory_entry->date = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+
+    // Set start cluster, initially set to 0
+    file_directory_entry->start = 0;
+
+    // Set the size of the file, initially set to 0
+    file_directory_entry->size = 0;
+
+    // Write the file directory entry to the root directory
+    return write_file_directory_entry(fd, free_root_directory_entry_index);
+}
+
+// Function to read the file in binary or ASCII, following the steps below:
+// - Read the root directory to get the file directory entry
+// - Get the first cluster of the file by combining the high and low bytes
+// - Read the FAT table entry for the first cluster to get the next cluster
+// - Start reading the file as a chain of clusters starting from the first cluster until the end of the file
+// - Read cluster by cluster from the disk image and print the contents of the file in binary or ASCII in sectors
+void read_file(int fd, int is_binary) {
+    // Read the root directory to get the file directory entry
+    int result = read_root_directory(fd, FIND_GIVEN_ENTRY);
+    if (result == FAILURE) {
+        printf("File not found!\n");
+        return;
+    }
+
+    // Get the first cluster of the file by combining the high and low bytes
+    unsigned int first_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
+
+    // Get the cluster chain of the file as extents
+    struct extent_map* map = get_extent_map(fd, first_cluster);
+    if (map == NULL) {
+        return;
+    }
+
+    // Print the contents of the file in binary or ASCII
+    // In binary form: It will display the content of the file in binary form on the screen. 
+    // The content can be either binary or text. Each byte will be printed in hexadecimal form. 
+    // With each line printing 16 bytes.The first hexadecimal number indicates the start
+    // offset of that line in the file.
+    // In ASCII form: It will display the content of the file in ASCII form on the screen.
+    // Start reading the file as a chain of clusters starting from the first cluster until the end of the file
+    // Contiguous clusters of each extent are read from the disk image in large blocks
+    // Large files are read and formatted by the read pipeline when there is more than one processor
+    fflush(stdout);
+    int file_size = file_directory_entry->size;
+    int n_threads = get_n_read_pipeline_threads(file_size);
+    int readable_size;
+    if (n_threads > 1) {
+        readable_size = run_read_pipeline(fd, map, file_size, is_binary, n_threads);
+    } else {
+        readable_size = storage->read_file_blocks(fd, map, file_size, dump_file_block, &is_binary);
+    }
+
+    // The cluster chain ended before the end of the file
+    if (readable_size < file_size) {
+        output_bytes("\n", 1);
+    }
+    flush_output();
+
+    printf("\nSuccesfully read!\n");
+}
+
+// Format a block of the file to the output buffer
+// The context points to the is_binary flag of the dump
+int dump_file_block(unsigned char* bytes, int file_offset, int length, void* context) {
+    dump_file_bytes(bytes, length, file_offset, file_directory_entry->size, *(int*) context);
+    return SUCCESS;
+}
+
+// Get the number of reader threads of the read pipeline for the file, 1 if it is read by the main thread
+// The io_uring and the stats backends are not shared by threads, so the pipeline reads with pread or from the mapping
+int get_n_read_pipeline_threads(int file_size) {
+    if (file_size < MIN_PIPELINE_FILE_SIZE) {
+        return 1;
+    }
+    int n_threads = read_pipeline_threads;
+    if (n_threads == 0) {
+        long n_processors = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_processors > 0 ? n_processors : 1;
+    }
+    int n_chunks = (file_size + PIPELINE_CHUNK_SIZE - 1) / PIPELINE_CHUNK_SIZE;
+    n_threads = n_threads < n_chunks ? n_threads : n_chunks;
+    return n_threads < MAX_PIPELINE_THREADS ? n_threads : MAX_PIPELINE_THREADS;
+}
+
+// Read and format the file with the read pipeline:
+// - The extent map of the file is the resolved chain, the file is split into chunks of PIPELINE_CHUNK_SIZE bytes
+// - Each reader thread claims the next chunk, reads its extents into a slot of the ring and formats it
+// - The main thread writes the formatted chunks in file order and gives each slot back for a later chunk
+// The slots are handed over with their sequence numbers without locks, a thread only sleeps on a slot that is not ready
+// Return the number of bytes that are dumped before the end of the chain or a failed read
+int run_read_pipeline(int fd, struct extent_map* map, int file_size, int is_binary, int n_threads) {
+    struct read_pipeline pipeline;
+    pipeline.fd = fd;
+    pipeline.map = map;
+    pipeline.file_size = file_size;
+    long long chain_size = (long long) map->n_clusters * cluster_size;
+    pipeline.readable_size = chain_size < file_size ? chain_size : file_size;
+    pipeline.is_binary = is_binary;
+    pipeline.n_chunks = (pipeline.readable_size + PIPELINE_CHUNK_SIZE - 1) / PIPELINE_CHUNK_SIZE;
+    pipeline.next_chunk = 0;
+    pipeline.n_slots = n_threads * PIPELINE_SLOTS_PER_THREAD;
+
+    // The buffers of the slots are taken from a single arena and reused for every chunk
+    int max_output_length = (PIPELINE_CHUNK_SIZE / HEX_DUMP_LINE_SIZE + 2) * MAX_HEX_DUMP_LINE_LENGTH;
+    size_t slot_size = PIPELINE_CHUNK_SIZE + max_output_length;
+    struct pipeline_slot slots[MAX_PIPELINE_THREADS * PIPELINE_SLOTS_PER_THREAD];
+    unsigned char* arena = malloc(pipeline.n_slots * slot_size);
+    if (arena == NULL) {
+        return storage->read_file_blocks(fd, map, file_size, dump_file_block, &is_binary);
+    }
+    for (int i = 0; i < pipeline.n_slots; i++) {
+        slots[i].sequence = i;
+        slots[i].bytes = arena + i * slot_size;
+        slots[i].output = (char*) slots[i].bytes + PIPELINE_CHUNK_SIZE;
+    }
+    pipeline.slots = slots;
+
+    pthread_t threads[MAX_PIPELINE_THREADS];
+    int n_started = 0;
+    for (; n_started < n_threads; n_started++) {
+        if (pthread_create(&threads[n_started], NULL, read_pipeline_worker, &pipeline) != 0) {
+            break;
+        }
+    }
+    if (n_started == 0) {
+        free(arena);
+        return storage->read_file_blocks(fd, map, file_size, dump_file_block, &is_binary);
+    }
+
+    // Write the chunks in order, after a failure the remaining chunks are only given back so every thread can finish
+    flush_output();
+    int dumped_size = 0;
+    int is_failed = 0;
+    for (int chunk = 0; chunk < pipeline.n_chunks; chunk++) {
+        struct pipeline_slot* slot = &slots[chunk % pipeline.n_slots];
+        wait_for_sequence(&slot->sequence, chunk + 1);
+        if (!is_failed && !slot->is_failed) {
+            for (int written = 0; written < slot->output_length;) {
+                ssize_t result = write(output_fd, slot->output + written, slot->output_length - written);
+                if (result <= 0) {
+                    is_failed = 1;
+                    break;
+                }
+                written += result;
+            }
+            if (!is_failed) {
+                long long chunk_end = (long long) (chunk + 1) * PIPELINE_CHUNK_SIZE;
+                dumped_size = chunk_end < pipeline.readable_size ? chunk_end : pipeline.readable_size;
+            }
+        }
+        is_failed |= slot->is_failed;
+        publish_sequence(&slot->sequence, chunk + pipeline.n_slots);
+    }
+
+    for (int i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(arena);
+    return dumped_size;
+}
+
+// Reader thread of the read pipeline, claims chunks until every chunk is claimed
+void* read_pipeline_worker(void* argument) {
+    struct read_pipeline* pipeline = argument;
+    while (1) {
+        int chunk = __atomic_fetch_add(&pipeline->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= pipeline->n_chunks) {
+            return NULL;
+        }
+
+        // Wait until the writer gives the slot back from the chunk n_slots before this one
+        struct pipeline_slot* slot = &pipeline->slots[chunk % pipeline->n_slots];
+        wait_for_sequence(&slot->sequence, chunk);
+
+        int file_offset = chunk * PIPELINE_CHUNK_SIZE;
+        int length = pipeline->readable_size - file_offset < PIPELINE_CHUNK_SIZE ? pipeline->readable_size - file_offset : PIPELINE_CHUNK_SIZE;
+        slot->is_failed = read_file_range(pipeline->fd, pipeline->map, file_offset, length, slot->bytes) == FAILURE;
+        slot->output_length = 0;
+        if (!slot->is_failed) {
+            slot->output_length = format_file_bytes(slot->bytes, length, file_offset, pipeline->file_size, pipeline->is_binary, slot->output);
+        }
+        publish_sequence(&slot->sequence, chunk + 1);
+    }
+}
+
+// Read the byte range of the file along its extents into the buffer
+// It is called by several threads at once, so it reads from the mapping of the disk image or with pread
+int read_file_range(int fd, struct extent_map* map, int file_offset, int length, unsigned char* buffer) {
+    struct file_block_cursor cursor = { map, file_offset + length, length, find_extent_index(map, file_offset / cluster_size), file_offset };
+    off_t disk_offset;
+    int block_offset;
+    int block_length;
+    while (get_next_file_block(&cursor, &disk_offset, &block_offset, &block_length)) {
+        unsigned char* destination = buffer + (block_offset - file_offset);
+        ssize_t result = image_map != NULL ? mmap_read_at(fd, destination, block_length, disk_offset) : pread(fd, destination, block_length, disk_offset);
+        if (result != block_length) {
+            return FAILURE;
+        }
+    }
+    return cursor.file_offset == file_offset + length ? SUCCESS : FAILURE;
+}
+
+// Wait until the sequence of a pipeline slot reaches the value, sleeping on the futex of the sequence
+void wait_for_sequence(int* sequence, int value) {
+    while (1) {
+        int current = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+        if (current == value) {
+            return;
+        }
+        syscall(SYS_futex, sequence, FUTEX_WAIT_PRIVATE, current, NULL, NULL, 0);
+    }
+}
+
+// Set the sequence of a pipeline slot and wake the threads that wait on it
+void publish_sequence(int* sequence, int value) {
+    __atomic_store_n(sequence, value, __ATOMIC_RELEASE);
+    syscall(SYS_futex, sequence, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// Walk the extents of the file and visit each contiguous byte range of the file on the disk image in order
+// The read-ahead stage advises the next extents while the current one is visited
+// The ranges end at the file size, or at the end of the cluster chain if it is shorter than the file
+// Return the number of bytes that are visited before the end or a failing visit
+int walk_file_extents(int fd, struct extent_map* map, int file_size, int (*visit)(int fd, off_t disk_offset, int file_offset, int length, void* context), void* context) {
+    struct read_ahead read_ahead;
+    init_read_ahead(&read_ahead, map, file_size);
+    int file_offset = 0;
+    for (int e = 0; e < map->n_extents && file_offset < file_size; e++) {
+        struct cluster_extent* extent = &map->extents[e];
+        off_t disk_offset = get_cluster_offset(extent->first_cluster);
+        long long extent_end = (long long) (extent->file_cluster + extent->length) * cluster_size;
+        if (extent_end > file_size) {
+            extent_end = file_size;
+        }
+
+        int length = extent_end - file_offset;
+        advance_read_ahead(fd, &read_ahead, file_offset);
+        if (visit(fd, disk_offset, file_offset, length, context) == FAILURE) {
+            return file_offset;
+        }
+        file_offset += length;
+    }
+    return file_offset;
+}
+
+// Export the raw bytes of the file to the host file, or to the output if the host file name is NULL
+// Each contiguous range is copied by the kernel without passing through a user buffer
+int export_file(int fd, char* host_file_name) {
+    // Read the root directory to get the file directory entry
+    int result = read_root_directory(fd, FIND_GIVEN_ENTRY);
+    if (result == FAILURE) {
+        fprintf(stderr, "File not found!\n");
+        return FAILURE;
+    }
+
+    // Get the cluster chain of the file as extents
+    unsigned int first_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
+    struct extent_map* map = get_extent_map(fd, first_cluster);
+    if (map == NULL) {
+        return FAILURE;
+    }
+
+    // Open the host file or use the output
+    int out_fd = output_fd;
+    if (host_file_name != NULL) {
+        out_fd = open(host_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            fprintf(stderr, "Could not open host file!\n");
+            return FAILURE;
+        }
+    } else {
+        fflush(stdout);
+    }
+
+    int file_size = file_directory_entry->size;
+    int exported_size = walk_file_extents(fd, map, file_size, copy_file_range_to_fd, &out_fd);
+
+    if (host_file_name != NULL) {
+        close(out_fd);
+    }
+
+    if (exported_size < file_size) {
+        fprintf(stderr, "Cluster chain of the file is broken!\n");
+        return FAILURE;
+    }
+
+    if (host_file_name != NULL) {
+        printf("File exported successfully!\n");
+    }
+    return SUCCESS;
+}
+
+// Copy a contiguous range of the disk image to the file descriptor in the context
+// copy_file_range is tried first, then sendfile and then a read and write through a buffer
+// if the kernel does not support the copy between these file types
+int copy_file_range_to_fd(int fd, off_t disk_offset, int file_offset, int length, void* context) {
+    static int is_copy_file_range_supported = 1;
+    static int is_sendfile_supported = 1;
+    int out_fd = *(int*) context;
+
+    while (length > 0) {
+        ssize_t copied = -1;
+        if (is_copy_file_range_supported) {
+            copied = copy_file_range(fd, &disk_offset, out_fd, NULL, length, 0);
+            if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)) {
+                is_copy_file_range_supported = 0;
+                continue;
+            }
+        } else if (is_sendfile_supported) {
+            copied = sendfile(out_fd, fd, &disk_offset, length);
+            if (copied < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                is_sendfile_supported = 0;
+                continue;
+            }
+        } else {
+            static unsigned char copy_buffer[READ_BUFFER_SIZE];
+            int n = length < READ_BUFFER_SIZE ? length : READ_BUFFER_SIZE;
+            copied = pread(fd, copy_buffer, n, disk_offset);
+            if (copied > 0) {
+                for (ssize_t written = 0; written < copied;) {
+                    ssize_t result = write(out_fd, copy_buffer + written, copied - written);
+                    if (result <= 0) {
+                        return FAILURE;
+                    }
+                    written += result;
+                }
+                disk_offset += copied;
+            }
+        }
+
+        if (copied <= 0) {
+            return FAILURE;
+        }
+        length -= copied;
+    }
+    return SUCCESS;
+}
+
+// Format the bytes of the file starting at the file offset to the output buffer
+// The bytes are formatted in pieces that fit the free space of the output buffer
+void dump_file_bytes(unsigned char* buffer, int length, int file_offset, int file_size, int is_binary) {
+    while (length > 0) {
+        int n = get_formattable_length(OUTPUT_BUFFER_SIZE - output_buffer_length, is_binary);
+        if (n <= 0) {
+            flush_output();
+            continue;
+        }
+        n = n < length ? n : length;
+        output_buffer_length += format_file_bytes(buffer, n, file_offset, file_size, is_binary, output_buffer + output_buffer_length);
+        buffer += n;
+        file_offset += n;
+        length -= n;
+    }
+}
+
+// Get the number of bytes whose formatted form surely fits the space
+// A range of bytes touches at most two lines more than its full lines, each line is at most MAX_HEX_DUMP_LINE_LENGTH
+int get_formattable_length(int space, int is_binary) {
+    if (!is_binary) {
+        return space - 1;
+    }
+    return (space / MAX_HEX_DUMP_LINE_LENGTH - 2) * HEX_DUMP_LINE_SIZE;
+}
+
+// Format the bytes of the file starting at the file offset to the output and return the formatted length
+// In binary form each line is the 8 digit hexadecimal offset followed by 16 bytes in hexadecimal,
+// in ASCII form the bytes are copied as they are. A new line is added after the last byte of the file
+int format_file_bytes(unsigned char* buffer, int length, int file_offset, int file_size, int is_binary, char* output) {
+    int output_length = 0;
+    if (!is_binary) {
+        memcpy(output, buffer, length);
+        output_length = length;
+        if (file_offset + length == file_size) {
+            output[output_length++] = '\n';
+        }
+        return output_length;
+    }
+
+    // Offset, 16 bytes with a space after each, new line and the new line of the end of the file
+    int k = 0;
+    while (k < length) {
+        int offset = file_offset + k;
+        char* line = output + output_length;
+        if (offset % HEX_DUMP_LINE_SIZE == 0 && k + HEX_DUMP_LINE_SIZE <= length) {
+            // Full line, the offset and the bytes are formatted at once
+            for (int d = 0; d < 8; d++) {
+                line[d] = hex_digits[(offset >> (28 - 4 * d)) & 0xF];
+            }
+            line[8] = ' ';
+            format_hex_dump_line(buffer + k, line + 9);
+            int line_length = 9 + 3 * HEX_DUMP_LINE_SIZE;
+            line[line_length++] = '\n';
+            if (offset + HEX_DUMP_LINE_SIZE == file_size) {
+                line[line_length++] = '\n';
+            }
+            output_length += line_length;
+            k += HEX_DUMP_LINE_SIZE;
+            continue;
+        }
+
+        // Partial line at the end of the file, the bytes are formatted one by one
+        int line_length = 0;
+        if (offset % HEX_DUMP_LINE_SIZE == 0) {
+            for (int d = 0; d < 8; d++) {
+                line[line_length++] = hex_digits[(offset >> (28 - 4 * d)) & 0xF];
+            }
+            line[line_length++] = ' ';
+        }
+        line[line_length++] = hex_digits[buffer[k] >> 4];
+        line[line_length++] = hex_digits[buffer[k] & 0xF];
+        line[line_length++] = ' ';
+        if ((offset + 1) % HEX_DUMP_LINE_SIZE == 0) {
+            line[line_length++] = '\n';
+        }
+        if (offset == file_size - 1) {
+            line[line_length++] = '\n';
+        }
+        output_length += line_length;
+        k++;
+    }
+    return output_length;
+}
+
+// Format 16 bytes as two hexadecimal digits and a space each
+// With SSE2 the nibbles of all of the bytes are converted to digits at once
+void format_hex_dump_line(unsigned char* bytes, char* line) {
+    char digits[2 * HEX_DUMP_LINE_SIZE];
+#ifdef __SSE2__
+    __m128i values = _mm_loadu_si128((const __m128i*) bytes);
+    __m128i low_mask = _mm_set1_epi8(0x0F);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(values, 4), low_mask);
+    __m128i low = _mm_and_si128(values, low_mask);
+
+    // Digit is '0' + nibble, 7 more for the nibbles larger than 9 to reach 'A'
+    __m128i nine = _mm_set1_epi8(9);
+    __m128i zero = _mm_set1_epi8('0');
+    __m128i letter_gap = _mm_set1_epi8('A' - '0' - 10);
+    high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letter_gap));
+    low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letter_gap));
+
+    // Interleave the high and low digits of each byte
+    _mm_storeu_si128((__m128i*) digits, _mm_unpacklo_epi8(high, low));
+    _mm_storeu_si128((__m128i*) (digits + HEX_DUMP_LINE_SIZE), _mm_unpackhi_epi8(high, low));
+#else
+    for (int i = 0; i < HEX_DUMP_LINE_SIZE; i++) {
+        digits[2 * i] = hex_digits[bytes[i] >> 4];
+        digits[2 * i + 1] = hex_digits[bytes[i] & 0xF];
+    }
+#endif
+
+    for (int i = 0; i < HEX_DUMP_LINE_SIZE; i++) {
+        line[3 * i] = digits[2 * i];
+        line[3 * i + 1] = digits[2 * i + 1];
+        line[3 * i + 2] = ' ';
+    }
+}
+
+// Append the bytes to the output buffer, the buffer is written when it is full
+void output_bytes(const char* bytes, int length) {
+    while (length > 0) {
+        if (output_buffer_length == OUTPUT_BUFFER_SIZE) {
+            flush_output();
+        }
+        int n = OUTPUT_BUFFER_SIZE - output_buffer_length;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(output_buffer + output_buffer_length, bytes, n);
+        output_buffer_length += n;
+        bytes += n;
+        length -= n;
+    }
+}
+
+// Write the output buffer to the output file descriptor
+int flush_output() {
+    int written = 0;
+    while (written < output_buffer_length) {
+        ssize_t result = write(output_fd, output_buffer + written, output_buffer_length - written);
+        if (result <= 0) {
+            output_buffer_length = 0;
+            return FAILURE;
+        }
+        written += result;
+    }
+    output_buffer_length = 0;
+    return SUCCESS;
+}
+
+// Function to get the next FAT table entry
+// Read the FAT table entry for the given cluster number from the FAT table cache
+int get_next_FAT_table_entry(int fd, unsigned int cluster_number) {
+    // Load the FAT table to the memory on the first access
+    if (fat_table_cache == NULL && load_fat_table_cache(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    // Check if the cluster number is in the FAT table
+    if (cluster_number >= fat_size * sector_size / FAT_TABLE_ENTRY_SIZE) {
+        return FAILURE;
+    }
+
+    // Convert the FAT table entry to an integer
+    int next_cluster = unsigned_bytes_to_int(fat_table_cache + cluster_number * FAT_TABLE_ENTRY_SIZE, FAT_TABLE_ENTRY_SIZE);
+    STATS_COUNT(STATS_GET_FAT_TABLE_ENTRY, FAT_TABLE_ENTRY_SIZE);
+    return next_cluster;
+}
+
+// Get the extent map of the file starting with the given cluster
+// The map is built with a single walk over the FAT table cache and kept in the extent map cache
+// If the first cluster is 0, the file has no clusters and an empty map is returned
+struct extent_map* get_extent_map(int fd, unsigned int first_cluster) {
+    struct extent_map* map = &extent_map_cache[first_cluster % EXTENT_MAP_CACHE_SIZE];
+    if (first_cluster != 0 && map->first_cluster == first_cluster) {
+        return map;
+    }
+
+    // The extents are copied from the sidecar index while the disk image is unchanged
+    if (first_cluster != 0 && is_index_usable() && load_extent_map_from_index(map, first_cluster) == SUCCESS) {
+        return map;
+    }
+
+    if (build_extent_map(fd, map, first_cluster) == FAILURE) {
+        return NULL;
+    }
+    return map;
+}
+
+// Walk the cluster chain starting with the given cluster and merge the contiguous clusters into extents
+// The walk stops at the end of file value or at an invalid cluster number
+int build_extent_map(int fd, struct extent_map* map, unsigned int first_cluster) {
+    map->first_cluster = first_cluster;
+    map->n_clusters = 0;
+    map->n_extents = 0;
+
+    unsigned int current_cluster = first_cluster;
+    while (current_cluster >= 2 && current_cluster <= max_cluster_number) {
+        // Stop if there is a loop in the chain
+        if (map->n_clusters > max_cluster_number) {
+            printf("WARNING: Detected a loop in the cluster chain!\n");
+            break;
+        }
+        if (append_to_extent_map(map, &current_cluster, 1) == FAILURE) {
+            map->first_cluster = 0;
+            return FAILURE;
+        }
+        current_cluster = get_next_FAT_table_entry(fd, current_cluster);
+    }
+
+    return SUCCESS;
+}
+
+// Append the clusters to the end of the extent map
+// A cluster that follows the last cluster of the map extends the last extent
+int append_to_extent_map(struct extent_map* map, unsigned int* clusters, int count) {
+    for (int i = 0; i < count; i++) {
+        struct cluster_extent* last = map->n_extents > 0 ? &map->extents[map->n_extents - 1] : NULL;
+        if (last != NULL && last->first_cluster + last->length == clusters[i]) {
+            last->length++;
+        } else {
+            // Grow the extent list if it is full
+            if (map->n_extents == map->capacity) {
+                int capacity = map->capacity == 0 ? 16 : map->capacity * 2;
+                struct cluster_extent* extents = realloc(map->extents, capacity * sizeof(struct cluster_extent));
+                if (extents == NULL) {
+                    return FAILURE;
+                }
+                map->extents = extents;
+                map->capacity = capacity;
+            }
+            map->extents[map->n_extents].first_cluster = clusters[i];
+            map->extents[map->n_extents].length = 1;
+            map->extents[map->n_extents].file_cluster = map->n_clusters;
+            map->n_extents++;
+        }
+        map->n_clusters++;
+    }
+    return SUCCESS;
+}
+
+// Find the index of the extent that contains the given cluster of the file with a binary search
+// The file cluster must be smaller than the number of clusters in the map
+int find_extent_index(struct extent_map* map, unsigned int file_cluster) {
+    int low = 0;
+    int high = map->n_extents - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (map->extents[middle].file_cluster <= file_cluster) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// Get the cluster number of the given cluster of the file
+unsigned int get_extent_map_cluster(struct extent_map* map, unsigned int file_cluster) {
+    struct cluster_extent* extent = &map->extents[find_extent_index(map, file_cluster)];
+    return extent->first_cluster + (file_cluster - extent->file_cluster);
+}
+
+// Remove the extent map of the file starting with the given cluster from the cache
+// It must be called when the cluster chain of the file is changed outside of the extent map
+void invalidate_extent_map(unsigned int first_cluster) {
+    struct extent_map* map = &extent_map_cache[first_cluster % EXTENT_MAP_CACHE_SIZE];
+    if (map->first_cluster == first_cluster) {
+        map->first_cluster = 0;
+    }
+}
+
+// Map the sidecar index of the disk image and check that it belongs to the current disk image
+// The index is trusted if the size, inode, mtime and ctime of the disk image and the geometry are the same,
+// the checksum of the FAT table is verified when the FAT table is loaded
+// The free cluster bitmap of the index is used in place, the private mapping keeps the changes out of the index file
+// Return FAILURE if the index is missing or stale, it is rebuilt at the end then
+int load_index(int fd, char* diskname) {
+    if (snprintf(index_path, sizeof(index_path), "%s%s", diskname, INDEX_FILE_SUFFIX) >= (int) sizeof(index_path)) {
+        printf("WARNING: The index name is too long, the index is not used!\n");
+        is_index_requested = 0;
+        return FAILURE;
+    }
+
+    int index_fd = open(index_path, O_RDONLY);
+    if (index_fd < 0) {
+        return FAILURE;
+    }
+    struct stat index_stat;
+    struct stat image_stat;
+    if (fstat(index_fd, &index_stat) != 0 || fstat(fd, &image_stat) != 0 || index_stat.st_size < (off_t) sizeof(struct index_header)) {
+        close(index_fd);
+        return FAILURE;
+    }
+    unsigned char* map = mmap(NULL, index_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+    if (map == MAP_FAILED) {
+        return FAILURE;
+    }
+
+    // Check the disk image, the geometry and the sections
+    struct index_header* header = (struct index_header*) map;
+    int max_root_directory_clusters = MAX_ROOT_DIRECTORY_ENTRIES / (cluster_size / FILE_DIRECTORY_ENTRY_SIZE);
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION
+        || header->cluster_size != (unsigned int) cluster_size || header->max_cluster_number != max_cluster_number
+        || header->fat_size != (unsigned int) fat_size || header->image_size != image_stat.st_size
+        || header->image_inode != (long long) image_stat.st_ino
+        || header->image_mtime_ns != (long long) image_stat.st_mtim.tv_sec * 1000000000 + image_stat.st_mtim.tv_nsec
+        || header->image_ctime_ns != (long long) image_stat.st_ctim.tv_sec * 1000000000 + image_stat.st_ctim.tv_nsec
+        || header->n_bitmap_words != (int) (max_cluster_number / 64 + 1)
+        || header->free_cluster_count < 0 || (unsigned int) header->free_cluster_count > max_cluster_number
+        || header->n_root_directory_clusters < 1 || header->n_root_directory_clusters > max_root_directory_clusters
+        || !is_index_section_valid(header->bitmap_offset, header->n_bitmap_words, sizeof(unsigned long long), index_stat.st_size)
+        || !is_index_section_valid(header->root_directory_offset, header->n_root_directory_clusters, sizeof(unsigned int), index_stat.st_size)
+        || !is_index_section_valid(header->files_offset, header->n_files, sizeof(struct index_file_record), index_stat.st_size)
+        || !is_index_section_valid(header->extents_offset, header->n_extents, sizeof(struct index_extent), index_stat.st_size)) {
+        munmap(map, index_stat.st_size);
+        return FAILURE;
+    }
+
+    index_map = map;
+    index_map_size = index_stat.st_size;
+    index_header = header;
+    free_cluster_bitmap = (unsigned long long*) (index_map + index_header->bitmap_offset);
+    free_cluster_count = index_header->free_cluster_count;
+    return SUCCESS;
+}
+
+// Check if a section of n elements at the offset is aligned and inside the index file
+int is_index_section_valid(long long offset, long long n_elements, size_t element_size, off_t index_size) {
+    return offset >= (long long) sizeof(struct index_header) && offset % INDEX_SECTION_ALIGNMENT == 0 && n_elements >= 0
+        && offset <= index_size && n_elements <= (index_size - offset) / (long long) element_size;
+}
+
+// Check if the root directory chain and the extent maps can be taken from the sidecar index
+// The index describes the disk image as it was opened, so it is only used until the first change
+int is_index_usable() {
+    return index_header != NULL && !is_index_dirty;
+}
+
+// Stop using the sidecar index, the free cluster bitmap and the extent maps are built from the FAT table again
+void drop_index() {
+    if (index_header == NULL) {
+        return;
+    }
+    if ((unsigned char*) free_cluster_bitmap >= index_map && (unsigned char*) free_cluster_bitmap < index_map + index_map_size) {
+        free_cluster_bitmap = NULL;
+    }
+    for (int i = 0; i < EXTENT_MAP_CACHE_SIZE; i++) {
+        extent_map_cache[i].first_cluster = 0;
+    }
+    munmap(index_map, index_map_size);
+    index_map = NULL;
+    index_map_size = 0;
+    index_header = NULL;
+}
+
+// Compare the checksum of the loaded FAT table with the checksum of the sidecar index
+// They only differ if the disk image was changed without changing its times, the index is dropped then
+void check_index_fat_checksum() {
+    if (index_header == NULL || index_header->fat_checksum == get_fat_table_checksum()) {
+        return;
+    }
+    printf("WARNING: The index does not match the FAT table, it is rebuilt!\n");
+    drop_index();
+}
+
+// Hash the FAT table cache 8 bytes at a time with FNV-1a
+unsigned long long get_fat_table_checksum() {
+    unsigned long long checksum = 14695981039346656037ULL;
+    size_t n_words = (size_t) fat_size * sector_size / sizeof(unsigned long long);
+    const unsigned long long* words = (const unsigned long long*) fat_table_cache;
+    for (size_t i = 0; i < n_words; i++) {
+        checksum = (checksum ^ words[i]) * 1099511628211ULL;
+    }
+    return checksum;
+}
+
+// Find the record of the file starting with the given cluster in the sidecar index with a binary search
+// Return NULL if the index has no such file
+struct index_file_record* find_index_file_record(unsigned int first_cluster) {
+    struct index_file_record* files = (struct index_file_record*) (index_map + index_header->files_offset);
+    int low = 0;
+    int high = index_header->n_files - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (files[middle].first_cluster == first_cluster) {
+            return &files[middle];
+        } else if (files[middle].first_cluster < first_cluster) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return NULL;
+}
+
+// Fill the extent map of the file starting with the given cluster from the sidecar index
+// Return FAILURE if the index has no such file, the map is built from the FAT table then
+int load_extent_map_from_index(struct extent_map* map, unsigned int first_cluster) {
+    struct index_file_record* record = find_index_file_record(first_cluster);
+    if (record == NULL || (unsigned long long) record->first_extent + record->n_extents > index_header->n_extents) {
+        return FAILURE;
+    }
+
+    if (map->capacity < (int) record->n_extents) {
+        struct cluster_extent* extents = realloc(map->extents, record->n_extents * sizeof(struct cluster_extent));
+        if (extents == NULL) {
+            return FAILURE;
+        }
+        map->extents = extents;
+        map->capacity = record->n_extents;
+    }
+
+    struct index_extent* extents = (struct index_extent*) (index_map + index_header->extents_offset) + record->first_extent;
+    map->n_clusters = 0;
+    for (unsigned int i = 0; i < record->n_extents; i++) {
+        map->extents[i].first_cluster = extents[i].first_cluster;
+        map->extents[i].length = extents[i].length;
+        map->extents[i].file_cluster = map->n_clusters;
+        map->n_clusters += extents[i].length;
+    }
+    map->n_extents = record->n_extents;
+    map->first_cluster = first_cluster;
+    return SUCCESS;
+}
+
+// Write the sidecar index if it is missing, stale or the disk image was changed
+// The extents of the files whose chains did not change are copied from the old index, the others are built
+// from the FAT table. The index is written to a temporary file that replaces the old index
+int save_index(int fd) {
+    if (is_index_usable()) {
+        return SUCCESS;
+    }
+    if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    // Collect the chains of the entries, the entries that were not written keep their chains
+    // and if the FAT table was not changed every chain is the same
+    struct index_file_record* files = malloc((root_directory_end_entry + 1) * sizeof(struct index_file_record));
+    struct index_extent* extents = NULL;
+    unsigned int n_extents = 0;
+    unsigned int extents_capacity = 0;
+    int n_files = 0;
+    int result = files == NULL ? FAILURE : SUCCESS;
+    for (int i = 0; i < root_directory_end_entry && result == SUCCESS; i++) {
+        struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+        unsigned int first_cluster = entry->starthi << 16 | entry->start;
+        if (entry->name[0] == 0x00 || entry->name[0] == 0xE5 || entry->attr == 0x0F || first_cluster < 2 || first_cluster > max_cluster_number) {
+            continue;
+        }
+
+        struct index_file_record* old_record = NULL;
+        if (index_header != NULL && (!is_index_fat_changed || !index_changed_entries[i])) {
+            old_record = find_index_file_record(first_cluster);
+        }
+        struct extent_map* map = NULL;
+        unsigned int n_file_extents;
+        if (old_record != NULL && (unsigned long long) old_record->first_extent + old_record->n_extents <= index_header->n_extents) {
+            n_file_extents = old_record->n_extents;
+        } else {
+            old_record = NULL;
+            map = get_extent_map(fd, first_cluster);
+            if (map == NULL) {
+                result = FAILURE;
+                break;
+            }
+            n_file_extents = map->n_extents;
+        }
+
+        // Grow the extent list if it is full
+        if (n_extents + n_file_extents > extents_capacity) {
+            unsigned int capacity = extents_capacity == 0 ? 1024 : extents_capacity;
+            while (capacity < n_extents + n_file_extents) {
+                capacity *= 2;
+            }
+            struct index_extent* new_extents = realloc(extents, capacity * sizeof(struct index_extent));
+            if (new_extents == NULL) {
+                result = FAILURE;
+                break;
+            }
+            extents = new_extents;
+            extents_capacity = capacity;
+        }
+
+        files[n_files].first_cluster = first_cluster;
+        files[n_files].n_extents = n_file_extents;
+        files[n_files].first_extent = n_extents;
+        if (old_record != NULL) {
+            struct index_extent* old_extents = (struct index_extent*) (index_map + index_header->extents_offset) + old_record->first_extent;
+            memcpy(extents + n_extents, old_extents, n_file_extents * sizeof(struct index_extent));
+            files[n_files].n_clusters = old_record->n_clusters;
+        } else {
+            for (int j = 0; j < map->n_extents; j++) {
+                extents[n_extents + j].first_cluster = map->extents[j].first_cluster;
+                extents[n_extents + j].length = map->extents[j].length;
+            }
+            files[n_files].n_clusters = map->n_clusters;
+        }
+        n_extents += n_file_extents;
+        n_files++;
+    }
+
+    // The walks above may have loaded the FAT table and dropped a stale index, so the bitmap is taken after them
+    if (result == SUCCESS && free_cluster_bitmap == NULL && build_free_cluster_bitmap(fd) == FAILURE) {
+        result = FAILURE;
+    }
+    if (result == FAILURE) {
+        printf("Could not build the index!\n");
+        free(files);
+        free(extents);
+        return FAILURE;
+    }
+
+    // Sort the records by the first cluster, a chain shared by several entries is kept once
+    qsort(files, n_files, sizeof(struct index_file_record), compare_index_file_records);
+    int n_unique_files = 0;
+    for (int i = 0; i < n_files; i++) {
+        if (n_unique_files == 0 || files[n_unique_files - 1].first_cluster != files[i].first_cluster) {
+            files[n_unique_files++] = files[i];
+        }
+    }
+
+    // The times of the disk image are taken after the flush, the FAT table checksum of the old index
+    // is still valid if the FAT table was not loaded
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) != 0) {
+        free(files);
+        free(extents);
+        return FAILURE;
+    }
+    struct index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.cluster_size = cluster_size;
+    header.max_cluster_number = max_cluster_number;
+    header.fat_size = fat_size;
+    header.image_size = image_stat.st_size;
+    header.image_inode = image_stat.st_ino;
+    header.image_mtime_ns = (long long) image_stat.st_mtim.tv_sec * 1000000000 + image_stat.st_mtim.tv_nsec;
+    header.image_ctime_ns = (long long) image_stat.st_ctim.tv_sec * 1000000000 + image_stat.st_ctim.tv_nsec;
+    header.fat_checksum = fat_table_cache != NULL ? get_fat_table_checksum() : index_header->fat_checksum;
+    header.free_cluster_count = free_cluster_count;
+    header.n_bitmap_words = max_cluster_number / 64 + 1;
+    header.n_root_directory_clusters = root_directory_n_clusters;
+    header.n_files = n_unique_files;
+    header.n_extents = n_extents;
+    header.bitmap_offset = sizeof(struct index_header);
+    header.root_directory_offset = header.bitmap_offset + (long long) header.n_bitmap_words * sizeof(unsigned long long);
+    header.files_offset = header.root_directory_offset
+        + (root_directory_n_clusters * sizeof(unsigned int) + INDEX_SECTION_ALIGNMENT - 1) / INDEX_SECTION_ALIGNMENT * INDEX_SECTION_ALIGNMENT;
+    header.extents_offset = header.files_offset + (long long) n_unique_files * sizeof(struct index_file_record);
+
+    // Write the sections to the temporary file, the gap after the root directory chain is a hole
+    char temporary_path[PATH_MAX + 4];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", index_path);
+    int index_fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (index_fd < 0) {
+        printf("Could not create the index!\n");
+        free(files);
+        free(extents);
+        return FAILURE;
+    }
+    if (write_index_section(index_fd, &header, sizeof(header), 0) == FAILURE
+        || write_index_section(index_fd, free_cluster_bitmap, header.n_bitmap_words * sizeof(unsigned long long), header.bitmap_offset) == FAILURE
+        || write_index_section(index_fd, root_directory_clusters, root_directory_n_clusters * sizeof(unsigned int), header.root_directory_offset) == FAILURE
+        || write_index_section(index_fd, files, n_unique_files * sizeof(struct index_file_record), header.files_offset) == FAILURE
+        || write_index_section(index_fd, extents, (size_t) n_extents * sizeof(struct index_extent), header.extents_offset) == FAILURE
+        || (sync_mode != SYNC_MODE_NONE && fdatasync(index_fd) != 0)) {
+        result = FAILURE;
+    }
+    if (close(index_fd) != 0 || result == FAILURE || rename(temporary_path, index_path) != 0) {
+        printf("Could not write the index!\n");
+        unlink(temporary_path);
+        result = FAILURE;
+    }
+
+    free(files);
+    free(extents);
+    return result;
+}
+
+// Order the file records of the sidecar index by their first clusters
+int compare_index_file_records(const void* a, const void* b) {
+    unsigned int first = ((const struct index_file_record*) a)->first_cluster;
+    unsigned int second = ((const struct index_file_record*) b)->first_cluster;
+    return first < second ? -1 : first > second;
+}
+
+// Write a section of the sidecar index at its offset, the short writes are continued
+int write_index_section(int index_fd, const void* bytes, size_t length, off_t offset) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = pwrite(index_fd, (const unsigned char*) bytes + written, length - written, offset + written);
+        if (result <= 0) {
+            return FAILURE;
+        }
+        written += result;
+    }
+    return SUCCESS;
+}
+
+// Take the locks of the command before it reads the FAT table or the root directory
+// The readers(-l, -r, -x, -check, -snapshot, -diff) share the locks. The writers hold the FAT table lock exclusively unless the FAT table
+// is shared, then the shared FAT table coordinates their allocations. -r, -x, -w and -t only lock the entry of their file,
+// the other commands lock the whole root directory
+int lock_disk_image(int fd, char* option) {
+    int is_reader = is_reader_option(option);
+    int is_file_command = strcmp(option, "-r") == 0 || strcmp(option, "-x") == 0 || strcmp(option, "-w") == 0
+        || strcmp(option, "-t") == 0;
+
+    // The processes of the shared FAT table hold a shared lock of the FAT tables since they attached
+    if (shared_fat == NULL && lock_fat_tables(fd, is_reader ? F_RDLCK : F_WRLCK) == FAILURE) {
+        return FAILURE;
+    }
+    root_directory_lock_type = is_reader || is_file_command ? F_RDLCK : F_WRLCK;
+    if (is_file_command) {
+        directory_entry_lock_type = is_reader ? F_RDLCK : F_WRLCK;
+    }
+    return SUCCESS;
+}
+
+// Return 1 if the command of the option only reads the disk image
+int is_reader_option(char* option) {
+    return strcmp(option, "-l") == 0 || strcmp(option, "-r") == 0 || strcmp(option, "-x") == 0 || strcmp(option, "-check") == 0
+        || strcmp(option, "-snapshot") == 0 || strcmp(option, "-diff") == 0;
+}
+
+// Lock or unlock the byte range of the disk image with an advisory fcntl lock, waiting for the conflicting locks
+// If the file system does not support the locks the disk image is used without them
+int lock_disk_range(int fd, short type, off_t start, off_t length) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = length;
+    while (fcntl(fd, F_SETLKW, &lock) != 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EDEADLK) {
+            printf("Could not lock the disk image, another process is waiting for the locks of this process!\n");
+            return FAILURE;
+        }
+        if (!is_lock_warning_printed) {
+            printf("WARNING: Could not lock the disk image, it is used without locks!\n");
+            is_lock_warning_printed = 1;
+        }
+        return SUCCESS;
+    }
+    return SUCCESS;
+}
+
+// Lock or unlock every copy of the FAT table
+int lock_fat_tables(int fd, short type) {
+    return lock_disk_range(fd, type, (off_t) reserved_sectors * sector_size, (off_t) number_of_fat_tables * fat_size * sector_size);
+}
+
+// Lock or unlock the clusters of the root directory in the given range of its chain, contiguous clusters are locked together
+int lock_root_directory_clusters(int fd, short type, int first_cluster_index, int end_cluster_index) {
+    for (int i = first_cluster_index; i < end_cluster_index;) {
+        int run_length = 1;
+        while (i + run_length < end_cluster_index && root_directory_clusters[i + run_length] == root_directory_clusters[i] + run_length) {
+            run_length++;
+        }
+        if (lock_disk_range(fd, type, get_cluster_offset(root_directory_clusters[i]), (off_t) run_length * cluster_size) == FAILURE) {
+            return FAILURE;
+        }
+        i += run_length;
+    }
+    return SUCCESS;
+}
+
+// Replace the lock of the root directory with the lock of the given entry, so the other files can be changed meanwhile
+// The entry may be changed between the two locks, so it is read again and must still be the same file
+int lock_directory_entry(int fd, int directory_entry_index) {
+    if (lock_root_directory_clusters(fd, F_UNLCK, 0, root_directory_n_clusters) == FAILURE) {
+        return FAILURE;
+    }
+    int entries_per_cluster = cluster_size / FILE_DIRECTORY_ENTRY_SIZE;
+    off_t offset = get_cluster_offset(root_directory_clusters[directory_entry_index / entries_per_cluster])
+        + (off_t) (directory_entry_index % entries_per_cluster) * FILE_DIRECTORY_ENTRY_SIZE;
+    if (lock_disk_range(fd, directory_entry_lock_type, offset, FILE_DIRECTORY_ENTRY_SIZE) == FAILURE) {
+        return FAILURE;
+    }
+    locked_directory_entry = directory_entry_index;
+
+    unsigned char entry_raw[FILE_DIRECTORY_ENTRY_SIZE];
+    if (storage->read_at(fd, entry_raw, FILE_DIRECTORY_ENTRY_SIZE, offset) != FILE_DIRECTORY_ENTRY_SIZE) {
+        printf("Could not read the root directory!\n");
+        return FAILURE;
+    }
+    unsigned char* entry = root_directory + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE;
+    if (memcmp(entry_raw, entry, TOTAL_FILENAME_SIZE) != 0 || ((struct msdos_dir_entry*) entry_raw)->attr != ((struct msdos_dir_entry*) entry)->attr) {
+        printf("The file was deleted by another process!\n");
+        return FAILURE;
+    }
+    memcpy(entry, entry_raw, FILE_DIRECTORY_ENTRY_SIZE);
+    return SUCCESS;
+}
+
+// Attach to the shared FAT table of the disk image, it is named by the device and the inode of the disk image
+// Every attached process holds a shared lock of the users byte of the segment, so a process that can lock it
+// exclusively is the only user and loads the FAT table from the disk image again. The FAT tables of the disk image
+// stay locked shared until the end, so the processes without --shared-fat can only read them meanwhile
+int attach_shared_fat(int fd) {
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) != 0 || lock_fat_tables(fd, F_RDLCK) == FAILURE) {
+        return FAILURE;
+    }
+    snprintf(shared_fat_name, sizeof(shared_fat_name), "/fatmod-%llx-%llx", (unsigned long long) image_stat.st_dev,
+        (unsigned long long) image_stat.st_ino);
+
+    // Attaching and detaching are serialized by the attach byte, a segment that was removed by the last user
+    // while this process waited for the byte is opened again
+    struct stat segment_stat;
+    for (;;) {
+        shared_fat_fd = shm_open(shared_fat_name, O_RDWR | O_CREAT, 0600);
+        if (shared_fat_fd < 0) {
+            return FAILURE;
+        }
+        if (lock_disk_range(shared_fat_fd, F_WRLCK, SHARED_FAT_ATTACH_LOCK_BYTE, 1) == FAILURE || fstat(shared_fat_fd, &segment_stat) != 0) {
+            close(shared_fat_fd);
+            shared_fat_fd = -1;
+            return FAILURE;
+        }
+        if (segment_stat.st_nlink > 0) {
+            break;
+        }
+        close(shared_fat_fd);
+    }
+
+    size_t fat_bytes = (size_t) fat_size * sector_size;
+    shared_fat_size = SHARED_FAT_HEADER_SIZE + fat_bytes + (max_cluster_number / 64 + 1) * sizeof(unsigned long long);
+    struct flock users_lock;
+    memset(&users_lock, 0, sizeof(users_lock));
+    users_lock.l_type = F_WRLCK;
+    users_lock.l_whence = SEEK_SET;
+    users_lock.l_start = SHARED_FAT_USERS_LOCK_BYTE;
+    users_lock.l_len = 1;
+    int is_only_user = fcntl(shared_fat_fd, F_SETLK, &users_lock) == 0;
+    if ((is_only_user && ftruncate(shared_fat_fd, shared_fat_size) != 0)
+        || (!is_only_user && segment_stat.st_size < (off_t) shared_fat_size)) {
+        close(shared_fat_fd);
+        shared_fat_fd = -1;
+        return FAILURE;
+    }
+    void* segment = mmap(NULL, shared_fat_size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_fat_fd, 0);
+    if (segment == MAP_FAILED) {
+        close(shared_fat_fd);
+        shared_fat_fd = -1;
+        return FAILURE;
+    }
+    shared_fat = segment;
+
+    if (is_only_user) {
+        // Load the FAT table from the disk image and build the free cluster bitmap in the segment
+        memset(shared_fat, 0, SHARED_FAT_HEADER_SIZE);
+        shared_fat->max_cluster_number = max_cluster_number;
+        shared_fat->fat_size = fat_size;
+        shared_fat->sector_size = sector_size;
+        shared_fat->fat_offset = SHARED_FAT_HEADER_SIZE;
+        shared_fat->bitmap_offset = SHARED_FAT_HEADER_SIZE + fat_bytes;
+        if (storage->read_at(fd, (unsigned char*) shared_fat + shared_fat->fat_offset, fat_bytes, fat_table_offset) != (ssize_t) fat_bytes) {
+            printf("Could not read FAT table!\n");
+            detach_shared_fat();
+            return FAILURE;
+        }
+        free_cluster_bitmap = (unsigned long long*) ((unsigned char*) shared_fat + shared_fat->bitmap_offset);
+        if (build_free_cluster_bitmap(fd) == FAILURE) {
+            detach_shared_fat();
+            return FAILURE;
+        }
+        shared_fat->free_cluster_count = free_cluster_count;
+        memcpy(shared_fat->magic, SHARED_FAT_MAGIC, sizeof(shared_fat->magic));
+    } else if (memcmp(shared_fat->magic, SHARED_FAT_MAGIC, sizeof(shared_fat->magic)) != 0
+        || shared_fat->max_cluster_number != max_cluster_number || shared_fat->fat_size != (unsigned int) fat_size
+        || shared_fat->sector_size != (unsigned int) sector_size) {
+        printf("The shared FAT table does not match the disk image!\n");
+        detach_shared_fat();
+        return FAILURE;
+    } else {
+        free_cluster_bitmap = (unsigned long long*) ((unsigned char*) shared_fat + shared_fat->bitmap_offset);
+        refresh_free_cluster_count();
+    }
+
+    // Stay a user until the end
+    lock_disk_range(shared_fat_fd, F_RDLCK, SHARED_FAT_USERS_LOCK_BYTE, 1);
+    lock_disk_range(shared_fat_fd, F_UNLCK, SHARED_FAT_ATTACH_LOCK_BYTE, 1);
+    return SUCCESS;
+}
+
+// Detach from the shared FAT table after the flush, the last user removes the segment
+void detach_shared_fat() {
+    if (shared_fat == NULL) {
+        return;
+    }
+    lock_disk_range(shared_fat_fd, F_WRLCK, SHARED_FAT_ATTACH_LOCK_BYTE, 1);
+    struct flock users_lock;
+    memset(&users_lock, 0, sizeof(users_lock));
+    users_lock.l_type = F_WRLCK;
+    users_lock.l_whence = SEEK_SET;
+    users_lock.l_start = SHARED_FAT_USERS_LOCK_BYTE;
+    users_lock.l_len = 1;
+    if (fcntl(shared_fat_fd, F_SETLK, &users_lock) == 0) {
+        shm_unlink(shared_fat_name);
+    }
+
+    // The FAT table cache and the free cluster bitmap point into the segment
+    if (fat_table_cache == (unsigned char*) shared_fat + shared_fat->fat_offset) {
+        fat_table_cache = NULL;
+    }
+    free_cluster_bitmap = NULL;
+    munmap(shared_fat, shared_fat_size);
+    shared_fat = NULL;
+    close(shared_fat_fd);
+    shared_fat_fd = -1;
+}
+
+// Read the whole FAT table from the disk image to the FAT table cache with a single read
+int load_fat_table_cache(int fd) {
+    fat_table_cache_dirty_sectors = calloc(fat_size, 1);
+    if (fat_table_cache_dirty_sectors == NULL) {
+        printf("Could not allocate memory for the FAT table!\n");
+        return FAILURE;
+    }
+
+    // The shared FAT table is used in place, the first process that attached read it from the disk image
+    if (shared_fat != NULL) {
+        fat_table_cache = (unsigned char*) shared_fat + shared_fat->fat_offset;
+        return SUCCESS;
+    }
+
+    // The mapped FAT table is used in place until it is changed
+    if (image_map != NULL && fat_table_offset + (off_t) fat_size * sector_size <= image_map_size) {
+        fat_table_cache = image_map + fat_table_offset;
+        is_fat_table_cache_mapped = 1;
+        check_index_fat_checksum();
+        return SUCCESS;
+    }
+
+    fat_table_cache = malloc(fat_size * sector_size);
+    if (fat_table_cache == NULL || fat_table_cache_dirty_sectors == NULL) {
+        printf("Could not allocate memory for the FAT table!\n");
+        free(fat_table_cache);
+        free(fat_table_cache_dirty_sectors);
+        fat_table_cache = NULL;
+        fat_table_cache_dirty_sectors = NULL;
+        return FAILURE;
+    }
+
+    // Read the FAT table
+    ssize_t result = storage->read_at(fd, fat_table_cache, fat_size * sector_size, fat_table_offset);
+    if (result != fat_size * sector_size) {
+        printf("Could not read FAT table!\n");
+        free(fat_table_cache);
+        free(fat_table_cache_dirty_sectors);
+        fat_table_cache = NULL;
+        fat_table_cache_dirty_sectors = NULL;
+        return FAILURE;
+    }
+
+    check_index_fat_checksum();
+    return SUCCESS;
+}
+
+// Write the dirty sectors of the FAT table cache back to every mirrored FAT table of the disk image
+// Dirty sectors that are at most a few clean sectors apart are written together with the clean sectors between them
+// The writes of every copy are collected and submitted to the storage backend as one batch, the caller syncs the disk image
+int flush_fat_table_cache(int fd) {
+    // Nothing to write if the cache is not loaded or not changed
+    if (fat_table_cache == NULL || fat_table_cache_first_dirty_sector < 0) {
+        return SUCCESS;
+    }
+
+    // Collect the ranges of the dirty sectors
+    struct write_request ranges[MAX_WRITE_REQUESTS];
+    int n_ranges = 0;
+    int sector = fat_table_cache_first_dirty_sector;
+    while (sector <= fat_table_cache_last_dirty_sector) {
+        // Skip the clean sectors
+        if (!fat_table_cache_dirty_sectors[sector]) {
+            sector++;
+            continue;
+        }
+
+        // Find the end of the dirty range, short runs of clean sectors are included
+        int range_end = sector;
+        int last_dirty_sector = sector;
+        while (range_end <= fat_table_cache_last_dirty_sector && range_end - last_dirty_sector <= FAT_FLUSH_MAX_GAP_SECTORS) {
+            if (fat_table_cache_dirty_sectors[range_end]) {
+                fat_table_cache_dirty_sectors[range_end] = 0;
+                last_dirty_sector = range_end;
+            }
+            range_end++;
+        }
+        range_end = last_dirty_sector + 1;
+
+        if (n_ranges == MAX_WRITE_REQUESTS) {
+            // Too many ranges, the last range is extended over the clean sectors to the new one
+            ranges[n_ranges - 1].length = (off_t) range_end * sector_size - ranges[n_ranges - 1].offset;
+        } else {
+            ranges[n_ranges].offset = (off_t) sector * sector_size;
+            ranges[n_ranges].buffer = fat_table_cache + ranges[n_ranges].offset;
+            ranges[n_ranges].length = (size_t) (range_end - sector) * sector_size;
+            n_ranges++;
+        }
+
+        sector = range_end;
+    }
+
+    fat_table_cache_first_dirty_sector = -1;
+    fat_table_cache_last_dirty_sector = -1;
+
+    // A transaction of the journal holds the ranges once, they are written to every copy at the checkpoint
+    if (is_journal_transaction_open) {
+        for (int i = 0; i < n_ranges; i++) {
+            if (add_journal_range(ranges[i].offset, ranges[i].buffer, ranges[i].length, JOURNAL_RANGE_FAT_TABLE) == FAILURE) {
+                return FAILURE;
+            }
+        }
+        return SUCCESS;
+    }
+
+    // Write the ranges to every copy, copy by copy so that each copy is written in order
+    // In the always sync mode the last batch is synced with the writes
+    int result = SUCCESS;
+    struct write_request requests[MAX_WRITE_REQUESTS];
+    int n_requests = 0;
+    for (int copy = 0; copy < n_mirrored_fat_tables; copy++) {
+        off_t copy_offset = get_fat_table_copy_offset(copy);
+        for (int i = 0; i < n_ranges; i++) {
+            if (n_requests == MAX_WRITE_REQUESTS) {
+                if (storage->write_batch(fd, requests, n_requests, 0) == FAILURE) {
+                    result = FAILURE;
+                }
+                n_requests = 0;
+            }
+            requests[n_requests] = ranges[i];
+            requests[n_requests].offset += copy_offset;
+            n_requests++;
+        }
+    }
+    if (n_requests > 0 && storage->write_batch(fd, requests, n_requests, sync_mode == SYNC_MODE_ALWAYS) == FAILURE) {
+        result = FAILURE;
+    }
+
+    return result;
+}
 
-    // Set last write time, date
-    file_directory_entry->time = (time_info->tm_hour << 11) | (time_info->tm_min << 5) | (time_info->tm_sec / 2);
-    file_directory_entry->date = ((time_info->tm_year - 80) << 9) | ((time_info->tm_mon + 1) << 5) | time_info->tm_mday;
+// Return the offset of the given copy of the FAT table in the disk image
+// If the mirroring is disabled, the only copy is the active FAT table
+off_t get_fat_table_copy_offset(int copy) {
+    if (n_mirrored_fat_tables == 1) {
+        return fat_table_offset;
+    }
+    return (off_t) (reserved_sectors + copy * fat_size) * sector_size;
+}
 
-    // Set start cluster, initially set to 0
-    file_directory_entry->start = 0;
+// Compare the mirrored copies of the FAT table with the FAT table cache and report the copies that differ
+// Return the number of copies that differ
+int check_fat_table_copies(int fd) {
+    static unsigned char copy_buffer[READ_BUFFER_SIZE];
+    int n_differing_copies = 0;
+    for (int copy = 1; copy < n_mirrored_fat_tables; copy++) {
+        int n_differing_sectors = 0;
+        for (off_t offset = 0; offset < (off_t) fat_size * sector_size; offset += READ_BUFFER_SIZE) {
+            int length = (off_t) fat_size * sector_size - offset < READ_BUFFER_SIZE ? (off_t) fat_size * sector_size - offset : READ_BUFFER_SIZE;
+            if (storage->read_at(fd, copy_buffer, length, get_fat_table_copy_offset(copy) + offset) != length) {
+                printf("Could not read FAT table copy %d!\n", copy + 1);
+                n_differing_sectors++;
+                break;
+            }
+            for (int i = 0; i < length; i += sector_size) {
+                n_differing_sectors += memcmp(copy_buffer + i, fat_table_cache + offset + i, sector_size) != 0;
+            }
+        }
+        if (n_differing_sectors > 0) {
+            printf("ERROR: FAT table copy %d differs from the first copy in %d sectors!\n", copy + 1, n_differing_sectors);
+            n_differing_copies++;
+        }
+    }
+    return n_differing_copies;
+}
 
-    // Set the size of the file, initially set to 0
-    file_directory_entry->size = 0;
+// Build the free cluster bitmap from the FAT table cache
+// Every cluster between 2 and the max cluster number with a free FAT table entry is marked free
+// The free cluster count is calculated with popcount over the bitmap words
+int build_free_cluster_bitmap(int fd) {
+    // Load the FAT table to the memory on the first access
+    if (fat_table_cache == NULL && load_fat_table_cache(fd) == FAILURE) {
+        return FAILURE;
+    }
 
-    // Write the file directory entry to the root directory
-    return write_file_directory_entry(fd, free_root_directory_entry_index);
+    // The bitmap of the shared FAT table is built in place
+    int n_words = max_cluster_number / 64 + 1;
+    if (free_cluster_bitmap != NULL) {
+        memset(free_cluster_bitmap, 0, n_words * sizeof(unsigned long long));
+    } else {
+        free_cluster_bitmap = calloc(n_words, sizeof(unsigned long long));
+    }
+    if (free_cluster_bitmap == NULL) {
+        printf("Could not allocate memory for the free cluster bitmap!\n");
+        return FAILURE;
+    }
+
+    // Set the bits of the free clusters, 4 FAT table entries are checked at once
+    for (unsigned int i = 0; i <= max_cluster_number; i += 4) {
+        unsigned long long mask = get_free_fat_table_entries_mask(i);
+        free_cluster_bitmap[i / 64] |= mask << (i % 64);
+    }
+    // Clusters 0 and 1 are reserved and the clusters after the max cluster number can not be used
+    free_cluster_bitmap[0] &= ~3ULL;
+    if ((max_cluster_number + 1) % 64 != 0) {
+        free_cluster_bitmap[max_cluster_number / 64] &= (1ULL << ((max_cluster_number + 1) % 64)) - 1;
+    }
+
+    // Count the free clusters
+    free_cluster_count = 0;
+    for (int i = 0; i < n_words; i++) {
+        free_cluster_count += __builtin_popcountll(free_cluster_bitmap[i]);
+    }
+
+    return SUCCESS;
 }
 
-// Function to read the file in binary or ASCII, following the steps below:
-// - Read the root directory to get the file directory entry
-// - Get the first cluster of the file by combining the high and low bytes
-// - Read the FAT table entry for the first cluster to get the next cluster
-// - Start reading the file as a chain of clusters starting from the first cluster until the end of the file
-// - Read cluster by cluster from the disk image and print the contents of the file in binary or ASCII in sectors
-void read_file(int fd, int is_binary) {
-    // Read the root directory to get the file directory entry
-    int result = read_root_directory(fd, FIND_GIVEN_ENTRY);
-    if (result == FAILURE) {
-        printf("File not found!\n");
+// Return a 4 bit mask of the free FAT table entries starting from the given entry
+// Bit i is set if the entry first + i is free, the entries beyond the FAT table are not free
+unsigned int get_free_fat_table_entries_mask(unsigned int first) {
+    unsigned int n_entries = fat_size * sector_size / FAT_TABLE_ENTRY_SIZE;
+    if (first + 4 <= n_entries) {
+#ifdef __SSE2__
+        // Compare the low 28 bits of 4 entries with the free value at once
+        __m128i entries = _mm_loadu_si128((const __m128i*) (fat_table_cache + first * FAT_TABLE_ENTRY_SIZE));
+        entries = _mm_and_si128(entries, _mm_set1_epi32(FAT_TABLE_ENTRY_MASK));
+        __m128i is_free = _mm_cmpeq_epi32(entries, _mm_set1_epi32(FAT_TABLE_FREE_CLUSTER_VALUE));
+        return _mm_movemask_ps(_mm_castsi128_ps(is_free));
+#endif
+    }
+
+    unsigned int mask = 0;
+    for (unsigned int i = 0; i < 4 && first + i < n_entries; i++) {
+        int value = unsigned_bytes_to_int(fat_table_cache + (first + i) * FAT_TABLE_ENTRY_SIZE, FAT_TABLE_ENTRY_SIZE);
+        if ((value & FAT_TABLE_ENTRY_MASK) == FAT_TABLE_FREE_CLUSTER_VALUE) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+// Count the free FAT table entries between the first and the last(inclusive) cluster numbers
+// 4 entries are compared at once and the matches are counted with popcount
+int count_free_fat_table_entries(unsigned int first, unsigned int last) {
+    int count = 0;
+    unsigned int i = first;
+    // Count the entries one by one until the entry is aligned to 4
+    for (; i <= last && i % 4 != 0; i++) {
+        count += get_free_fat_table_entries_mask(i) & 1;
+    }
+    for (; i + 3 <= last; i += 4) {
+        count += __builtin_popcount(get_free_fat_table_entries_mask(i));
+    }
+    for (; i <= last; i++) {
+        count += get_free_fat_table_entries_mask(i) & 1;
+    }
+    return count;
+}
+
+// Check the volume in three steps without changing the disk image:
+// - Worker threads scan ranges of the FAT table in parallel, count the free, end of chain and bad entries
+//   and mark the clusters that are linked to in a shared bitmap
+// - The chain of every directory entry is walked and its clusters are marked owned, a cluster that is already
+//   owned is cross-linked and a chain that does not match the size of its file is reported
+// - Worker threads count the used clusters that are not owned, the orphaned chains start with the ones that
+//   are not linked to
+// Return FAILURE if an error is found
+int check_disk_image(int fd) {
+    if (fat_table_cache == NULL && load_fat_table_cache(fd) == FAILURE) {
+        return FAILURE;
+    }
+    if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    int n_words = max_cluster_number / 64 + 1;
+    unsigned long long* referenced_clusters = calloc(n_words, sizeof(unsigned long long));
+    unsigned long long* owned_clusters = calloc(n_words, sizeof(unsigned long long));
+    if (referenced_clusters == NULL || owned_clusters == NULL) {
+        printf("Could not allocate memory for the cluster bitmaps!\n");
+        free(referenced_clusters);
+        free(owned_clusters);
+        return FAILURE;
+    }
+
+    // Split the FAT table into ranges of whole bitmap words, one range for each worker thread
+    unsigned int n_clusters = max_cluster_number - 1;
+    long n_processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_ranges = n_processors > 0 ? n_processors : 1;
+    n_ranges = n_ranges < MAX_CHECK_THREADS ? n_ranges : MAX_CHECK_THREADS;
+    if (n_clusters / n_ranges < MIN_CHECK_RANGE_SIZE) {
+        n_ranges = n_clusters / MIN_CHECK_RANGE_SIZE + 1;
+    }
+    unsigned int range_size = (n_clusters / n_ranges + 64) / 64 * 64;
+    struct fat_scan_range ranges[MAX_CHECK_THREADS];
+    memset(ranges, 0, sizeof(ranges));
+    for (int i = 0; i < n_ranges; i++) {
+        ranges[i].first_cluster = i == 0 ? 2 : i * range_size;
+        ranges[i].last_cluster = i == n_ranges - 1 ? max_cluster_number : (i + 1) * range_size - 1;
+        ranges[i].referenced_clusters = referenced_clusters;
+        ranges[i].owned_clusters = owned_clusters;
+    }
+
+    int n_errors = 0;
+    if (run_fat_scan_workers(ranges, n_ranges, scan_fat_table_range) == FAILURE) {
+        n_errors++;
+    }
+
+    // Walk the chains of the root directory and of its entries
+    n_errors += check_cluster_chain(fd, root_directory_cluster_number, -1, "the root directory", owned_clusters);
+    int n_files = 0;
+    for (int i = 0; i < root_directory_end_entry; i++) {
+        struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+        if (entry->name[0] == 0x00 || entry->name[0] == 0xE5 || entry->attr == 0x0F || (entry->attr & 0x08)) {
+            continue;
+        }
+        unsigned int first_cluster = entry->starthi << 16 | entry->start;
+        char name[TOTAL_FILENAME_SIZE + DOT_SIZE];
+        get_file_name_of_entry(entry, name);
+        // Directories do not have a size
+        n_errors += check_cluster_chain(fd, first_cluster, entry->attr & 0x10 ? -1 : (int) entry->size, name, owned_clusters);
+        n_files++;
+    }
+
+    if (run_fat_scan_workers(ranges, n_ranges, count_orphaned_clusters) == FAILURE) {
+        n_errors++;
+    }
+    free(referenced_clusters);
+    free(owned_clusters);
+
+    // Sum up the results of the ranges
+    struct fat_scan_range total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < n_ranges; i++) {
+        total.n_free += ranges[i].n_free;
+        total.n_end_of_chain += ranges[i].n_end_of_chain;
+        total.n_bad += ranges[i].n_bad;
+        total.n_invalid_links += ranges[i].n_invalid_links;
+        total.n_multiply_linked += ranges[i].n_multiply_linked;
+        total.n_orphaned += ranges[i].n_orphaned;
+        total.n_orphaned_chains += ranges[i].n_orphaned_chains;
+    }
+
+    printf("Checked %u clusters in %d ranges and %d directory entries\n", n_clusters, n_ranges, n_files);
+    printf("Free clusters: %d, used clusters: %d, bad clusters: %d\n", total.n_free, n_clusters - total.n_free - total.n_bad, total.n_bad);
+    if (total.n_invalid_links > 0) {
+        printf("ERROR: %d FAT table entries link to invalid clusters!\n", total.n_invalid_links);
+        n_errors += total.n_invalid_links;
+    }
+    if (total.n_multiply_linked > 0) {
+        printf("ERROR: %d clusters are linked by more than one FAT table entry!\n", total.n_multiply_linked);
+        n_errors += total.n_multiply_linked;
+    }
+    if (total.n_orphaned > 0) {
+        printf("ERROR: %d orphaned clusters in %d lost chains!\n", total.n_orphaned, total.n_orphaned_chains);
+        n_errors += total.n_orphaned_chains > 0 ? total.n_orphaned_chains : 1;
+    }
+    n_errors += check_fat_table_copies(fd);
+    if (fs_info_sector != NULL && fs_info_sector->free_clusters != FS_INFO_UNKNOWN_VALUE
+        && fs_info_sector->free_clusters != total.n_free) {
+        printf("WARNING: Free cluster count of the FSInfo sector is %u, the true count is %d!\n",
+            fs_info_sector->free_clusters, total.n_free);
+    }
+
+    if (n_errors > 0) {
+        printf("Found %d errors!\n", n_errors);
+        return FAILURE;
+    }
+    printf("No errors found!\n");
+    return SUCCESS;
+}
+
+// Start a worker thread for each range and wait for all of them
+// The last range is scanned by the calling thread
+int run_fat_scan_workers(struct fat_scan_range* ranges, int n_ranges, void* (*worker)(void*)) {
+    int result = SUCCESS;
+    int n_started = 0;
+    for (; n_started < n_ranges - 1; n_started++) {
+        if (pthread_create(&ranges[n_started].thread, NULL, worker, &ranges[n_started]) != 0) {
+            break;
+        }
+    }
+    // The ranges without a thread are scanned here
+    for (int i = n_started; i < n_ranges; i++) {
+        worker(&ranges[i]);
+    }
+    for (int i = 0; i < n_started; i++) {
+        if (pthread_join(ranges[i].thread, NULL) != 0) {
+            result = FAILURE;
+        }
+    }
+    return result;
+}
+
+// Classify the FAT table entries of the range and mark the clusters that they link to
+// 4 entries are compared with the free, end of chain and bad values at once, only the links are handled one by one
+// The masked entries are below 2^28, so the signed comparison of SSE2 works for them
+void* scan_fat_table_range(void* argument) {
+    struct fat_scan_range* range = argument;
+    unsigned int cluster = range->first_cluster;
+    while (cluster <= range->last_cluster) {
+        unsigned int link_mask = 0xF;
+        int n_entries = range->last_cluster - cluster + 1 < 4 ? range->last_cluster - cluster + 1 : 4;
+#ifdef __SSE2__
+        if (n_entries == 4) {
+            __m128i entries = _mm_loadu_si128((const __m128i*) (fat_table_cache + cluster * FAT_TABLE_ENTRY_SIZE));
+            entries = _mm_and_si128(entries, _mm_set1_epi32(FAT_TABLE_ENTRY_MASK));
+            unsigned int free_mask = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpeq_epi32(entries, _mm_set1_epi32(FAT_TABLE_FREE_CLUSTER_VALUE))));
+            unsigned int end_mask = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpgt_epi32(entries, _mm_set1_epi32(FAT_TABLE_BAD_CLUSTER_VALUE))));
+            unsigned int bad_mask = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpeq_epi32(entries, _mm_set1_epi32(FAT_TABLE_BAD_CLUSTER_VALUE))));
+            range->n_free += __builtin_popcount(free_mask);
+            range->n_end_of_chain += __builtin_popcount(end_mask);
+            range->n_bad += __builtin_popcount(bad_mask);
+            link_mask = ~(free_mask | end_mask | bad_mask) & 0xF;
+            if (link_mask == 0) {
+                cluster += 4;
+                continue;
+            }
+        }
+#endif
+        for (int i = 0; i < n_entries; i++) {
+            unsigned int value = unsigned_bytes_to_int(fat_table_cache + (cluster + i) * FAT_TABLE_ENTRY_SIZE, FAT_TABLE_ENTRY_SIZE)
+                & FAT_TABLE_ENTRY_MASK;
+            if (!((link_mask >> i) & 1)) {
+                // Already counted by the vector comparison
+                continue;
+            } else if (value == FAT_TABLE_FREE_CLUSTER_VALUE) {
+                range->n_free++;
+            } else if (value >= FAT_TABLE_END_OF_FILE_VALUE) {
+                range->n_end_of_chain++;
+            } else if (value == FAT_TABLE_BAD_CLUSTER_VALUE) {
+                range->n_bad++;
+            } else if (value < 2 || value > max_cluster_number) {
+                range->n_invalid_links++;
+            } else {
+                // The bitmap is shared by the threads, so the bit is set atomically
+                unsigned long long bit = 1ULL << (value % 64);
+                if (__atomic_fetch_or(&range->referenced_clusters[value / 64], bit, __ATOMIC_RELAXED) & bit) {
+                    range->n_multiply_linked++;
+                }
+            }
+        }
+        cluster += n_entries;
+    }
+    return NULL;
+}
+
+// Count the used clusters of the range that are not owned by a directory entry
+// An orphaned cluster that no entry links to is the start of a lost chain
+void* count_orphaned_clusters(void* argument) {
+    struct fat_scan_range* range = argument;
+    for (unsigned int cluster = range->first_cluster; cluster <= range->last_cluster; cluster++) {
+        // Skip the words without any used and not owned cluster
+        if (cluster % 64 == 0 && cluster + 63 <= range->last_cluster && range->owned_clusters[cluster / 64] == ~0ULL) {
+            cluster += 63;
+            continue;
+        }
+        if ((range->owned_clusters[cluster / 64] >> (cluster % 64)) & 1) {
+            continue;
+        }
+        unsigned int value = unsigned_bytes_to_int(fat_table_cache + cluster * FAT_TABLE_ENTRY_SIZE, FAT_TABLE_ENTRY_SIZE)
+            & FAT_TABLE_ENTRY_MASK;
+        if (value == FAT_TABLE_FREE_CLUSTER_VALUE || value == FAT_TABLE_BAD_CLUSTER_VALUE) {
+            continue;
+        }
+        range->n_orphaned++;
+        if (!((range->referenced_clusters[cluster / 64] >> (cluster % 64)) & 1)) {
+            range->n_orphaned_chains++;
+        }
+    }
+    return NULL;
+}
+
+// Walk the cluster chain starting with the given cluster and mark its clusters owned
+// Report the clusters that are already owned, the chains that do not end properly
+// and the chains whose length does not match the file size(a negative size is not checked)
+// Return the number of errors
+int check_cluster_chain(int fd, unsigned int first_cluster, int file_size, const char* name, unsigned long long* owned_clusters) {
+    int n_errors = 0;
+    unsigned int n_chain_clusters = 0;
+    unsigned int cluster = first_cluster;
+    if (cluster != 0 && (cluster < 2 || cluster > max_cluster_number)) {
+        printf("ERROR: First cluster %u of %s is invalid!\n", cluster, name);
+        return 1;
+    }
+
+    while (cluster != 0) {
+        unsigned long long bit = 1ULL << (cluster % 64);
+        if (owned_clusters[cluster / 64] & bit) {
+            // Stop at the cross-link, the rest of the chain is owned by the other file or forms a loop
+            printf("ERROR: Cluster %u of %s is cross-linked!\n", cluster, name);
+            n_errors++;
+            break;
+        }
+        owned_clusters[cluster / 64] |= bit;
+        n_chain_clusters++;
+
+        unsigned int next_cluster = get_next_FAT_table_entry(fd, cluster) & FAT_TABLE_ENTRY_MASK;
+        if (next_cluster >= FAT_TABLE_END_OF_FILE_VALUE) {
+            break;
+        }
+        if (next_cluster < 2 || next_cluster > max_cluster_number) {
+            printf("ERROR: Chain of %s ends with the invalid entry 0x%08X at cluster %u!\n", name, next_cluster, cluster);
+            n_errors++;
+            break;
+        }
+        cluster = next_cluster;
+    }
+
+    if (file_size >= 0) {
+        unsigned int n_needed_clusters = (file_size + cluster_size - 1) / cluster_size;
+        if (n_chain_clusters != n_needed_clusters && n_errors == 0) {
+            printf("ERROR: Size of %s is %d bytes but its chain has %u clusters instead of %u!\n",
+                name, file_size, n_chain_clusters, n_needed_clusters);
+            n_errors++;
+        }
+    }
+
+    return n_errors;
+}
+
+// Move the chain of every fragmented file, or of the file with the input file name, to a contiguous run
+// The runs are taken first-fit from the start of the volume, so the files are also compacted
+// The files are moved in groups in the crash safe order of commit_defrag_moves, a file that does not fit
+// is moved after the chains of the previous group are freed
+int defragment_files(int fd, int is_single_file) {
+    int single_file_index = -1;
+    if (is_single_file) {
+        single_file_index = read_root_directory(fd, FIND_GIVEN_ENTRY);
+        if (single_file_index == FAILURE) {
+            printf("File not found!\n");
+            return FAILURE;
+        }
+    } else if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    print_fragmentation(fd, "Fragmentation before", single_file_index);
+
+    struct defrag_move moves[MAX_DEFRAG_MOVES];
+    int n_moves = 0;
+    int n_moved_files = 0;
+    long long n_moved_clusters = 0;
+    int result = SUCCESS;
+    int first_index = is_single_file ? single_file_index : 0;
+    int last_index = is_single_file ? single_file_index : root_directory_end_entry - 1;
+    for (int i = first_index; i <= last_index; i++) {
+        struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+        if (!is_indexed_file_entry(entry)) {
+            continue;
+        }
+        unsigned int first_cluster = entry->starthi << 16 | entry->start;
+        if (first_cluster < 2) {
+            continue;
+        }
+        struct extent_map* map = get_extent_map(fd, first_cluster);
+        if (map == NULL) {
+            result = FAILURE;
+            continue;
+        }
+        if (map->n_extents <= 1) {
+            continue;
+        }
+        int n_clusters = map->n_clusters;
+
+        // Free the chains of the moved files if there is no room for this one
+        unsigned int new_first_cluster = allocate_cluster_run(fd, n_clusters);
+        if (new_first_cluster == 0 && n_moves > 0) {
+            if (commit_defrag_moves(fd, moves, n_moves) == FAILURE) {
+                return FAILURE;
+            }
+            n_moves = 0;
+            new_first_cluster = allocate_cluster_run(fd, n_clusters);
+            map = get_extent_map(fd, first_cluster);
+        }
+        char name[TOTAL_FILENAME_SIZE + DOT_SIZE];
+        get_file_name_of_entry(entry, name);
+        if (new_first_cluster == 0) {
+            printf("WARNING: There is no contiguous run of %d free clusters for %s!\n", n_clusters, name);
+            continue;
+        }
+
+        if (map == NULL || copy_chain_to_run(fd, map, new_first_cluster) == FAILURE) {
+            printf("Could not copy the clusters of %s!\n", name);
+            free_cluster_chain(fd, new_first_cluster);
+            result = FAILURE;
+            continue;
+        }
+        moves[n_moves].directory_entry_index = i;
+        moves[n_moves].old_first_cluster = first_cluster;
+        moves[n_moves].new_first_cluster = new_first_cluster;
+        n_moves++;
+        n_moved_files++;
+        n_moved_clusters += n_clusters;
+
+        if (n_moves == MAX_DEFRAG_MOVES) {
+            if (commit_defrag_moves(fd, moves, n_moves) == FAILURE) {
+                return FAILURE;
+            }
+            n_moves = 0;
+        }
+    }
+    if (n_moves > 0 && commit_defrag_moves(fd, moves, n_moves) == FAILURE) {
+        return FAILURE;
+    }
+
+    printf("Moved %d files with %lld clusters\n", n_moved_files, n_moved_clusters);
+    print_fragmentation(fd, "Fragmentation after", single_file_index);
+    return result;
+}
+
+// Copy the clusters of the chain to the contiguous run starting with the new first cluster
+// The extents are read into a large buffer that is written to the run with a single write when it is full
+int copy_chain_to_run(int fd, struct extent_map* map, unsigned int new_first_cluster) {
+    static unsigned char* copy_buffer;
+    if (copy_buffer == NULL && posix_memalign((void**) &copy_buffer, IMPORT_BUFFER_ALIGNMENT, DEFRAG_BUFFER_SIZE) != 0) {
+        copy_buffer = NULL;
+        printf("Could not allocate memory for the copy buffer!\n");
+        return FAILURE;
+    }
+
+    int chain_size = map->n_clusters * cluster_size;
+    struct file_block_cursor cursor = { map, chain_size, DEFRAG_BUFFER_SIZE, 0, 0 };
+    struct read_ahead read_ahead;
+    init_read_ahead(&read_ahead, map, chain_size);
+    off_t target_offset = get_cluster_offset(new_first_cluster);
+    int buffer_length = 0;
+    off_t disk_offset;
+    int file_offset;
+    int length;
+    while (get_next_file_block(&cursor, &disk_offset, &file_offset, &length)) {
+        advance_read_ahead(fd, &read_ahead, file_offset);
+        if (storage->read_at(fd, copy_buffer + buffer_length, length, disk_offset) != length) {
+            return FAILURE;
+        }
+        buffer_length += length;
+        cursor.max_block_length = DEFRAG_BUFFER_SIZE - buffer_length;
+
+        if (buffer_length == DEFRAG_BUFFER_SIZE || file_offset + length == chain_size) {
+            if (storage->write_at(fd, copy_buffer, buffer_length, target_offset) != buffer_length) {
+                return FAILURE;
+            }
+            target_offset += buffer_length;
+            buffer_length = 0;
+            cursor.max_block_length = DEFRAG_BUFFER_SIZE;
+        }
+    }
+    if (file_offset + length != chain_size) {
+        return FAILURE;
+    }
+
+    is_data_pending = 1;
+    sync_disk_image(fd);
+    return SUCCESS;
+}
+
+// Switch the files to their copied chains in a crash safe order, each step is flushed before the next one:
+// - The copied data and the new chains are written, the old chains are still complete
+// - The directory entries are changed to start with the new chains
+// - The old chains are freed
+// A crash can only leave lost chains behind, which are reported by -check, but never a broken file
+int commit_defrag_moves(int fd, struct defrag_move* moves, int n_moves) {
+    if (flush_disk_image(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    for (int i = 0; i < n_moves; i++) {
+        memcpy(file_directory_entry_raw, root_directory + moves[i].directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE, FILE_DIRECTORY_ENTRY_SIZE);
+        file_directory_entry = (struct msdos_dir_entry*) file_directory_entry_raw;
+        file_directory_entry->start = moves[i].new_first_cluster & 0xFFFF;
+        file_directory_entry->starthi = moves[i].new_first_cluster >> 16;
+        if (write_file_directory_entry(fd, moves[i].directory_entry_index) == FAILURE) {
+            return FAILURE;
+        }
+    }
+    if (flush_disk_image(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    for (int i = 0; i < n_moves; i++) {
+        free_cluster_chain(fd, moves[i].old_first_cluster);
+    }
+    return flush_disk_image(fd);
+}
+
+// Print the number of extents of the files, or of the file with the given entry index if it is not negative
+// The score is the percentage of the cluster boundaries in the chains that are not contiguous on the disk
+void print_fragmentation(int fd, const char* title, int directory_entry_index) {
+    int n_files = 0;
+    long long n_clusters = 0;
+    long long n_extents = 0;
+    int first_index = directory_entry_index >= 0 ? directory_entry_index : 0;
+    int last_index = directory_entry_index >= 0 ? directory_entry_index : root_directory_end_entry - 1;
+    for (int i = first_index; i <= last_index; i++) {
+        struct msdos_dir_entry* entry = (struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE);
+        unsigned int first_cluster = entry->starthi << 16 | entry->start;
+        if (!is_indexed_file_entry(entry) || first_cluster < 2) {
+            continue;
+        }
+        struct extent_map* map = get_extent_map(fd, first_cluster);
+        if (map == NULL) {
+            continue;
+        }
+        n_files++;
+        n_clusters += map->n_clusters;
+        n_extents += map->n_extents;
+    }
+
+    double score = n_clusters > n_files ? 100.0 * (n_extents - n_files) / (n_clusters - n_files) : 0.0;
+    printf("%s: %d files with %lld clusters in %lld extents, score %.1f%%\n", title, n_files, n_clusters, n_extents, score);
+}
+
+// Allocate the first contiguous run of count free clusters from the start of the volume and chain it
+// Return the first cluster of the run, or 0 if there is no such run
+unsigned int allocate_cluster_run(int fd, int count) {
+    // The FAT table is loaded first, it drops the bitmap of a stale index
+    if (fat_table_cache == NULL && load_fat_table_cache(fd) == FAILURE) {
+        return 0;
+    }
+    if (free_cluster_bitmap == NULL && build_free_cluster_bitmap(fd) == FAILURE) {
+        return 0;
+    }
+    refresh_free_cluster_count();
+    if (count <= 0 || count > free_cluster_count) {
+        return 0;
+    }
+
+    // A run that another process claims first is searched again
+    unsigned int run_start = 0;
+    for (int attempt = 0; attempt < MAX_CLAIM_ATTEMPTS; attempt++) {
+        run_start = find_free_cluster_run(2, max_cluster_number + 1, count);
+        if (run_start == 0 || claim_clusters(run_start, count)) {
+            break;
+        }
+        run_start = 0;
+    }
+    if (run_start == 0) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        unsigned int value = i + 1 < count ? run_start + i + 1 : FAT_TABLE_END_OF_FILE_VALUE;
+        write_fat_table_entry(fd, run_start + i, value);
+    }
+    STATS_ADD(stats_clusters_allocated, count);
+    return run_start;
+}
+
+// Find the first run of at least count free clusters between start and end(exclusive)
+// Bitmap words without any free cluster and words with only free clusters are skipped at once
+// Return the first cluster of the run, if there is no such run return 0
+unsigned int find_free_cluster_run(unsigned int start, unsigned int end, int count) {
+    unsigned int run_start = 0;
+    int run_length = 0;
+    unsigned int cluster = start;
+    while (cluster < end) {
+        unsigned long long word = free_cluster_bitmap[cluster / 64];
+        if (cluster % 64 == 0 && word == 0) {
+            // There is no free cluster in this word
+            run_length = 0;
+            cluster += 64;
+        } else if (cluster % 64 == 0 && word == ~0ULL && cluster + 64 <= end) {
+            // Every cluster in this word is free
+            if (run_length == 0) {
+                run_start = cluster;
+            }
+            run_length += 64;
+            cluster += 64;
+        } else {
+            if ((word >> (cluster % 64)) & 1) {
+                if (run_length == 0) {
+                    run_start = cluster;
+                }
+                run_length++;
+            } else {
+                run_length = 0;
+            }
+            cluster++;
+        }
+
+        if (run_length >= count) {
+            STATS_ADD(stats_fat_entries_scanned, cluster - start);
+            return run_start;
+        }
+    }
+
+    STATS_ADD(stats_fat_entries_scanned, end > start ? end - start : 0);
+    return 0;
+}
+
+// Allocate count free clusters, chain them in the FAT table and mark the last one as the end of file
+// A contiguous run is preferred, searching next-fit from the hint and then from the beginning
+// If there is no such run, the free clusters are taken in next-fit order
+// The allocated cluster numbers are written to the clusters array in chain order
+int allocate_clusters(int fd, int count, unsigned int* clusters) {
+    // Build the free cluster bitmap on the first allocation
+    // The FAT table is loaded first, it drops the bitmap of a stale index
+    if (fat_table_cache == NULL && load_fat_table_cache(fd) == FAILURE) {
+        return FAILURE;
+    }
+    if (free_cluster_bitmap == NULL && build_free_cluster_bitmap(fd) == FAILURE) {
+        return FAILURE;
+    }
+
+    // Check if there are enough free clusters
+    refresh_free_cluster_count();
+    if (count <= 0 || count > free_cluster_count) {
+        return FAILURE;
+    }
+
+    // Try to find a contiguous run, a run that another process claims first is searched again
+    unsigned int run_start = 0;
+    for (int attempt = 0; attempt < MAX_CLAIM_ATTEMPTS; attempt++) {
+        run_start = find_free_cluster_run(next_free_cluster_hint, max_cluster_number + 1, count);
+        if (run_start == 0) {
+            run_start = find_free_cluster_run(2, max_cluster_number + 1, count);
+        }
+        if (run_start == 0 || claim_clusters(run_start, count)) {
+            break;
+        }
+        run_start = 0;
+    }
+
+    if (run_start != 0) {
+        for (int i = 0; i < count; i++) {
+            clusters[i] = run_start + i;
+        }
+    } else {
+        // Take the free clusters one by one starting from the hint and wrapping around
+        // The clusters that other processes claim first are skipped, and the allocation fails after a full round
+        unsigned int cluster = next_free_cluster_hint;
+        int n_claimed = 0;
+        for (unsigned int n_scanned = 0; n_claimed < count && n_scanned < max_cluster_number; cluster++, n_scanned++) {
+            if (cluster > max_cluster_number) {
+                cluster = 2;
+            }
+            if (((free_cluster_bitmap[cluster / 64] >> (cluster % 64)) & 1) && claim_clusters(cluster, 1)) {
+                clusters[n_claimed++] = cluster;
+            }
+            STATS_ADD(stats_fat_entries_scanned, 1);
+        }
+        if (n_claimed < count) {
+            for (int i = 0; i < n_claimed; i++) {
+                release_cluster(clusters[i]);
+            }
+            return FAILURE;
+        }
+    }
+    STATS_ADD(stats_clusters_allocated, count);
+
+    // Chain the clusters in the FAT table
+    for (int i = 0; i < count; i++) {
+        unsigned int value = i + 1 < count ? clusters[i + 1] : FAT_TABLE_END_OF_FILE_VALUE;
+        write_fat_table_entry(fd, clusters[i], value);
+    }
+
+    // Continue the next search after the last allocated cluster
+    next_free_cluster_hint = clusters[count - 1] + 1;
+    if (next_free_cluster_hint > max_cluster_number) {
+        next_free_cluster_hint = 2;
+    }
+
+    return SUCCESS;
+}
+
+// Mark the cluster free in the free cluster bitmap if the bitmap is built
+// With the shared FAT table the cluster is released after the flush, so no other process reuses it
+// while the old chain is still on the disk image
+void mark_cluster_free(unsigned int cluster_number) {
+    if (free_cluster_bitmap == NULL || cluster_number < 2 || cluster_number > max_cluster_number) {
+        return;
+    }
+    if (shared_fat == NULL) {
+        release_cluster(cluster_number);
         return;
     }
 
-    // Get the first cluster of the file by combining the high and low bytes
-    unsigned int current_cluster = file_directory_entry->starthi << 16 | file_directory_entry->start;
-    unsigned int next_cluster = get_next_FAT_table_entry(fd, current_cluster);
-
-    // Start reading the file as a chain of clusters starting from the first cluster until the end of the file
-    // Read cluster by cluster from the disk image
-    unsigned char cluster_buffer[CLUSTERSIZE];
-    for (int i = 0; i < file_directory_entry->size; i += CLUSTERSIZE) {
-        // Check if the next cluster is the end of the file
-        if (current_cluster >= FAT_TABLE_END_OF_FILE_VALUE) {
-            printf("\n");
-            break;
+    // Grow the pending list if it is full
+    if (n_pending_free_clusters == pending_free_clusters_capacity) {
+        int capacity = pending_free_clusters_capacity == 0 ? 1024 : pending_free_clusters_capacity * 2;
+        unsigned int* clusters = realloc(pending_free_clusters, capacity * sizeof(unsigned int));
+        if (clusters == NULL) {
+            // The cluster is leaked until the shared FAT table is loaded again
+            return;
         }
+        pending_free_clusters = clusters;
+        pending_free_clusters_capacity = capacity;
+    }
+    pending_free_clusters[n_pending_free_clusters++] = cluster_number;
+}
 
-        // Read the cluster
-        read_cluster(fd, cluster_buffer, current_cluster);
-
-        // Print the contents of the file in binary or ASCII in sectors
-        // In binary form: It will display the content of the file in binary form on the screen. 
-        // The content can be either binary or text. Each byte will be printed in hexadecimal form. 
-        // With each line printing 16 bytes.The first hexadecimal number indicates the start
-        // offset of that line in the file.
-        // In ASCII form: It will display the content of the file in ASCII form on the screen.
-        if (is_binary) {
-            // Print the contents of the file in binary
-            // Print the current sector
-            for (int k = 0; k < CLUSTERSIZE; k++) {
-                // For every 16 bytes, print the start offset of that line in the file
-                if (k % 16 == 0) {
-                    printf("%08X ", i + k);
-                }
-                // Print the content of the file in hexadecimal form
-                printf("%02X ", cluster_buffer[k]);
-                // Print a new line after every 16 bytes
-                if ((k + 1) % 16 == 0) {
-                    printf("\n");
-                }
-
-                // End of the file is reached so print a new line and break the loop
-                if (i + k == file_directory_entry->size - 1) {
-                    printf("\n");
-                    break;
-                }
-            }
-
-        } else {
-            // Print the contents of the file in ASCII
-            for (int k = 0; k < CLUSTERSIZE; k++) {
-                printf("%c", cluster_buffer[k]);
+// Release the clusters that were freed before the last flush to the other processes of the shared FAT table
+void release_pending_free_clusters() {
+    for (int i = 0; i < n_pending_free_clusters; i++) {
+        release_cluster(pending_free_clusters[i]);
+    }
+    n_pending_free_clusters = 0;
+}
 
-                // End of the file is reached so print a new line and break the loop
-                if (i + k == file_directory_entry->size - 1) {
-                    printf("\n");
-                    break;
+// Claim count free clusters starting from the first cluster in the free cluster bitmap
+// Each bitmap word is claimed with a compare and swap, so the processes sharing the bitmap never claim the same cluster
+// Return 0 if one of the clusters is not free anymore, the clusters claimed before it are released then
+int claim_clusters(unsigned int first_cluster, int count) {
+    unsigned int end = first_cluster + count;
+    for (unsigned int cluster = first_cluster; cluster < end;) {
+        unsigned int shift = cluster % 64;
+        unsigned int n = end - cluster < 64 - shift ? end - cluster : 64 - shift;
+        unsigned long long mask = n == 64 ? ~0ULL : ((1ULL << n) - 1) << shift;
+        unsigned long long* word = &free_cluster_bitmap[cluster / 64];
+        unsigned long long old_word = __atomic_load_n(word, __ATOMIC_RELAXED);
+        do {
+            if ((old_word & mask) != mask) {
+                for (unsigned int claimed = first_cluster; claimed < cluster; claimed++) {
+                    release_cluster(claimed);
                 }
+                return 0;
             }
-        }
+        } while (!__atomic_compare_exchange_n(word, &old_word, old_word & ~mask, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        add_to_free_cluster_count(-(int) n);
+        cluster += n;
+    }
+    return 1;
+}
 
-        // Get the next cluster
-        current_cluster = next_cluster;
-        next_cluster = get_next_FAT_table_entry(fd, current_cluster);
+// Set the bit of the cluster in the free cluster bitmap
+// Return 1 if the cluster was used before, 0 if it was already free
+int release_cluster(unsigned int cluster_number) {
+    unsigned long long bit = 1ULL << (cluster_number % 64);
+    if (__atomic_fetch_or(&free_cluster_bitmap[cluster_number / 64], bit, __ATOMIC_ACQ_REL) & bit) {
+        return 0;
     }
+    add_to_free_cluster_count(1);
+    return 1;
+}
 
-    printf("\nSuccesfully read!\n");
+// Change the free cluster count, and the count of the shared FAT table
+void add_to_free_cluster_count(int n) {
+    free_cluster_count += n;
+    if (shared_fat != NULL) {
+        __atomic_add_fetch(&shared_fat->free_cluster_count, n, __ATOMIC_RELAXED);
+    }
 }
 
-// Function to get the next FAT table entry
-// Read the FAT table entry for the given cluster number
-int get_next_FAT_table_entry(int fd, unsigned int cluster_number) {
-    // Calculate the offset
-    off_t offset = fat_table_offset + cluster_number * FAT_TABLE_ENTRY_SIZE;
-    lseek(fd, offset, SEEK_SET);
+// Take the free cluster count of the shared FAT table, it includes the allocations of the other processes
+void refresh_free_cluster_count() {
+    if (shared_fat != NULL) {
+        free_cluster_count = __atomic_load_n(&shared_fat->free_cluster_count, __ATOMIC_RELAXED);
+    }
+}
 
-    // Read the FAT table entry
-    int result = read(fd, fat_table_entry, FAT_TABLE_ENTRY_SIZE);
+// Read the FSInfo sector of the volume
+// If the sector is valid, its next free cluster field is used as the next-fit allocation hint
+int read_fs_info_sector(int fd) {
+    int result = read_sector(fd, fs_info_sector_raw, boot_sector->fat32.info_sector);
+    if (result == FAILURE) {
+        return FAILURE;
+    }
 
-    if (result < 0) {
+    fs_info_sector = (struct fat_boot_fsinfo*) fs_info_sector_raw;
+    if (fs_info_sector->signature1 != FAT_FSINFO_SIG1 || fs_info_sector->signature2 != FAT_FSINFO_SIG2) {
+        printf("WARNING: FSInfo sector is invalid!\n");
+        fs_info_sector = NULL;
         return FAILURE;
     }
 
-    // Convert the FAT table entry to an integer
-    int next_cluster = unsigned_bytes_to_int(fat_table_entry, FAT_TABLE_ENTRY_SIZE);
-    return next_cluster;
+    // Start the search from the beginning if the next free cluster is unknown or invalid
+    next_free_cluster_hint = fs_info_sector->next_cluster;
+    if (next_free_cluster_hint < 2 || next_free_cluster_hint > max_cluster_number) {
+        next_free_cluster_hint = 2;
+    }
+
+    return SUCCESS;
+}
+
+// Write the free cluster count and the next free cluster to the FSInfo sector with a single write
+// If the free cluster bitmap is not built, the free clusters are counted from the FAT table cache
+// Nothing is written if the FAT table is not changed or the FSInfo sector is not valid
+int write_fs_info_sector(int fd) {
+    if (!fs_info_sector_dirty || fs_info_sector == NULL || fat_table_cache == NULL) {
+        return SUCCESS;
+    }
+
+    // The clusters that are released after this flush are free on the disk image
+    refresh_free_cluster_count();
+    if (free_cluster_bitmap != NULL) {
+        fs_info_sector->free_clusters = free_cluster_count + n_pending_free_clusters;
+    } else {
+        fs_info_sector->free_clusters = count_free_fat_table_entries(2, max_cluster_number);
+    }
+    fs_info_sector->next_cluster = next_free_cluster_hint;
+
+    fs_info_sector_dirty = 0;
+    if (is_journal_transaction_open) {
+        return add_journal_range((off_t) boot_sector->fat32.info_sector * sector_size, fs_info_sector_raw, sector_size, 0);
+    }
+    return write_sector(fd, fs_info_sector_raw, boot_sector->fat32.info_sector);
 }
 
 // Read the contents of the root directory which is stored in the second cluster
-// For simplicity, we will assume that the root directory is one cluster in size
 // Traverse every entry in the root directory and do the following:
 // If the option option is set LIST_DIRECTORIES and valid, print the file name and extension
-// If the option option is set FIND_FREE_ENTRY and empty, find the first free entry in the root directory and return the index of the entry
-// Else(FIND_GIVEN_ENTRY), find the entry with the given file name and extension
+// If the option option is set FIND_FREE_ENTRY, return the index of a free entry from the free entry list,
+// the root directory is extended by a cluster if it is full
+// Else(FIND_GIVEN_ENTRY), find the entry with the given file name and extension in the name index
 // and set the file_directory_entry pointer to that entry, return the index of the entry, if not found return FAILURE
 int read_root_directory(int fd, int option) {
-    // Read the root directory from the disk image
-    int result = read_cluster(fd, root_directory, root_directory_cluster_number);
-    if (result < 0) {
+    // Read the root directory from the disk image once
+    if (!is_root_directory_loaded && load_root_directory(fd) == FAILURE) {
         return FAILURE;
     }
 
-    // Traverse every entry in the root directory
-    // Skip the first entry because it is the volume label
-    for (int i = 0; i < root_directory_max_content_size; i++) {
+    // The found or the new entry is read into the file directory entry buffer
+    file_directory_entry = (struct msdos_dir_entry*) file_directory_entry_raw;
+    if (option == FIND_FREE_ENTRY) {
+        return get_free_root_directory_entry(fd);
+    }
+
+    if (option == FIND_GIVEN_ENTRY) {
+        unsigned char packed_name[TOTAL_FILENAME_SIZE];
+        pack_file_name(input_file_name, packed_name);
+        int slot = find_name_index_slot(packed_name);
+        if (slot < 0) {
+            return FAILURE;
+        }
+
+        // A command on a single file only keeps the lock of its entry, the entry is read again once it is locked
+        int directory_entry_index = name_index[slot];
+        if (directory_entry_lock_type != F_UNLCK && directory_entry_index != locked_directory_entry
+            && lock_directory_entry(fd, directory_entry_index) == FAILURE) {
+            return FAILURE;
+        }
+
+        // Read the file directory entry
+        memcpy(file_directory_entry_raw, root_directory + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE, FILE_DIRECTORY_ENTRY_SIZE);
+        return directory_entry_index;
+    }
+
+    // Traverse every used entry in the root directory
+    for (int i = 0; i < root_directory_end_entry; i++) {
         // Read the file directory entry
         memcpy(file_directory_entry_raw, root_directory + i * FILE_DIRECTORY_ENTRY_SIZE, FILE_DIRECTORY_ENTRY_SIZE);
         file_directory_entry = (struct msdos_dir_entry*) file_directory_entry_raw;
@@ -739,109 +6614,385 @@ int read_root_directory(int fd, int option) {
         // Check if the file is a valid file
         if (file_directory_entry->name[0] == 0x00 || file_directory_entry->name[0] == 0xE5) {
             // This entry is free or deleted
-            // If the option is FIND_FREE_ENTRY, return the index of first free entry
-            if (option == FIND_FREE_ENTRY) {
-                return i;
-            }
+            continue;
         } else if (file_directory_entry->attr == 0x08) {
             // This entry is a volume label
-            if (LIST_DIRECTORIES == option) {
-                printf("Volume label: %s\n", file_directory_entry->name);
-            }
+            printf("Volume label: %s\n", file_directory_entry->name);
         } else if (file_directory_entry->attr == 0x10) {
             // This entry is a directory
             // This project does not support directories
             printf("WARNING: Detected directory entry. Directories are not supported!\n");
-            continue;
         } else if (file_directory_entry->attr == 0x0F) {
             // This entry is a long file name entry
             // This project does not support long file names
             printf("WARNING: Detected long file name entry. Long file name entries are not supported!\n");
-            continue;
         } else if (file_directory_entry->attr == 0x20) {
-            // If we are looking for a free entry, continue the loop, no need to check this entry
-            if (option == FIND_FREE_ENTRY) {
-                continue;
-            }
-
             // This entry is a valid file
-            // Get the file name and extension by inserting a dot between them
-            // File name is 11 bytes long consisting of 8 bytes for the name and 3 bytes for the extension
-            memset(total_file_name, '\0', TOTAL_FILENAME_SIZE + DOT_SIZE);
-
-            // Loop through the file name and extension but only get the following characters
-            // letters, digits, -, _,
-            int file_name_index = 0;
-            for (int j = 0; j < FILENAME_SIZE; j++) {
-                if (isalnum(file_directory_entry->name[j]) || file_directory_entry->name[j] == '-'
-                    || file_directory_entry->name[j] == '_') {
-                    total_file_name[file_name_index++] = file_directory_entry->name[j];
-                } else {
-                    break;
-                }
-            }
+            // Print the file name and extension and size of the file
+            get_file_name_of_entry(file_directory_entry, total_file_name);
+            printf("%s %d\n", total_file_name, file_directory_entry->size);
+        } else {
+            // This entry is invalid
+            printf("WARNING: Detected invalid entry!\n");
+        }
+    }
+
+    return SUCCESS;
+}
+
+// Read every cluster of the root directory by following its cluster chain, contiguous clusters are read together
+// Then index the names of the files and collect the free entries
+int load_root_directory(int fd) {
+    int entries_per_cluster = cluster_size / FILE_DIRECTORY_ENTRY_SIZE;
+    int max_clusters = MAX_ROOT_DIRECTORY_ENTRIES / entries_per_cluster;
+    root_directory_clusters = malloc(max_clusters * sizeof(unsigned int));
+    if (root_directory_clusters == NULL) {
+        printf("Could not allocate memory for the root directory!\n");
+        return FAILURE;
+    }
+
+    // Follow the cluster chain, the directory is cut at the FAT limit of the entries
+    // The chain of a valid sidecar index is used without loading the FAT table
+    if (is_index_usable()) {
+        root_directory_n_clusters = index_header->n_root_directory_clusters;
+        memcpy(root_directory_clusters, index_map + index_header->root_directory_offset, root_directory_n_clusters * sizeof(unsigned int));
+    }
+    unsigned int current_cluster = root_directory_n_clusters == 0 ? root_directory_cluster_number : 0;
+    while (current_cluster >= 2 && current_cluster <= max_cluster_number && root_directory_n_clusters < max_clusters) {
+        root_directory_clusters[root_directory_n_clusters++] = current_cluster;
+        current_cluster = get_next_FAT_table_entry(fd, current_cluster);
+    }
+    if (root_directory_n_clusters == 0) {
+        printf("Root directory cluster is invalid!\n");
+        return FAILURE;
+    }
+
+    // Lock the clusters before they are read, with the shared FAT table another process may have extended
+    // the directory while the lock was waited for, so the chain is followed on from its last locked cluster
+    for (int n_locked = 0; root_directory_lock_type != F_UNLCK && n_locked < root_directory_n_clusters;) {
+        if (lock_root_directory_clusters(fd, root_directory_lock_type, n_locked, root_directory_n_clusters) == FAILURE) {
+            return FAILURE;
+        }
+        n_locked = root_directory_n_clusters;
+        current_cluster = shared_fat != NULL ? get_next_FAT_table_entry(fd, root_directory_clusters[n_locked - 1]) : 0;
+        while (current_cluster >= 2 && current_cluster <= max_cluster_number && root_directory_n_clusters < max_clusters) {
+            root_directory_clusters[root_directory_n_clusters++] = current_cluster;
+            current_cluster = get_next_FAT_table_entry(fd, current_cluster);
+        }
+    }
+    root_directory_max_content_size = root_directory_n_clusters * entries_per_cluster;
+
+    root_directory = malloc(MAX_ROOT_DIRECTORY_ENTRIES * FILE_DIRECTORY_ENTRY_SIZE);
+    root_directory_names = malloc(MAX_ROOT_DIRECTORY_ENTRIES * (TOTAL_FILENAME_SIZE));
+    root_directory_dirty_clusters = calloc(max_clusters, 1);
+    free_directory_entries = malloc(MAX_ROOT_DIRECTORY_ENTRIES * sizeof(int));
+    if (is_index_requested) {
+        index_changed_entries = calloc(MAX_ROOT_DIRECTORY_ENTRIES, 1);
+    }
+    if (root_directory == NULL || root_directory_names == NULL || root_directory_dirty_clusters == NULL || free_directory_entries == NULL
+        || (is_index_requested && index_changed_entries == NULL)) {
+        printf("Could not allocate memory for the root directory!\n");
+        return FAILURE;
+    }
+
+    // Read the runs of contiguous clusters
+    for (int i = 0; i < root_directory_n_clusters;) {
+        int run_length = 1;
+        while (i + run_length < root_directory_n_clusters
+            && root_directory_clusters[i + run_length] == root_directory_clusters[i] + run_length) {
+            run_length++;
+        }
+        off_t offset = get_cluster_offset(root_directory_clusters[i]);
+        if (storage->read_at(fd, root_directory + i * cluster_size, run_length * cluster_size, offset) != run_length * cluster_size) {
+            printf("Could not read the root directory!\n");
+            return FAILURE;
+        }
+        i += run_length;
+    }
+
+    // The directory ends after the last entry that was ever used
+    root_directory_end_entry = 0;
+    for (int i = root_directory_max_content_size - 1; i >= 0; i--) {
+        if (root_directory[i * FILE_DIRECTORY_ENTRY_SIZE] != 0x00) {
+            root_directory_end_entry = i + 1;
+            break;
+        }
+    }
+
+    // Collect the free entries before the end, the lowest entry is used first
+    n_free_directory_entries = 0;
+    for (int i = root_directory_end_entry - 1; i >= 0; i--) {
+        unsigned char first_byte = root_directory[i * FILE_DIRECTORY_ENTRY_SIZE];
+        if (first_byte == 0x00 || first_byte == 0xE5) {
+            free_directory_entries[n_free_directory_entries++] = i;
+        }
+    }
+
+    // Index the names of the files, the index is kept at most half full
+    int capacity = MIN_ROOT_DIRECTORY_INDEX_SIZE;
+    while (capacity < root_directory_end_entry * 2) {
+        capacity *= 2;
+    }
+    if (resize_name_index(capacity) == FAILURE) {
+        return FAILURE;
+    }
+    for (int i = 0; i < root_directory_end_entry; i++) {
+        if (is_indexed_file_entry((struct msdos_dir_entry*) (root_directory + i * FILE_DIRECTORY_ENTRY_SIZE))
+            && insert_into_name_index(i) == FAILURE) {
+            return FAILURE;
+        }
+    }
+
+    is_root_directory_loaded = 1;
+    return SUCCESS;
+}
+
+// Extend the root directory with a free cluster at the end of its cluster chain
+// The cleared cluster is written before the FAT table links it, so the directory never contains garbage entries
+int extend_root_directory(int fd) {
+    int entries_per_cluster = cluster_size / FILE_DIRECTORY_ENTRY_SIZE;
+    if (root_directory_max_content_size + entries_per_cluster > MAX_ROOT_DIRECTORY_ENTRIES) {
+        return FAILURE;
+    }
+
+    unsigned int new_cluster;
+    if (allocate_clusters(fd, 1, &new_cluster) == FAILURE) {
+        return FAILURE;
+    }
+
+    unsigned char* new_entries = root_directory + root_directory_max_content_size * FILE_DIRECTORY_ENTRY_SIZE;
+    memset(new_entries, 0, cluster_size);
+    if (write_cluster(fd, new_entries, new_cluster) == FAILURE) {
+        return FAILURE;
+    }
+    is_data_pending = 1;
+
+    write_fat_table_entry(fd, root_directory_clusters[root_directory_n_clusters - 1], new_cluster);
+    invalidate_extent_map(root_directory_cluster_number);
+    root_directory_clusters[root_directory_n_clusters++] = new_cluster;
+    root_directory_max_content_size += entries_per_cluster;
+
+    return SUCCESS;
+}
 
-            // Remember the index of the dot    
-            int dot_index = file_name_index;
-            // Increment the file name index by 1 for the dot
-            file_name_index++;
+// Return the index of a free entry of the root directory without using it
+// A deleted entry is returned if there is one, else the first never used entry, extending the directory if it is full
+int get_free_root_directory_entry(int fd) {
+    if (n_free_directory_entries > 0) {
+        return free_directory_entries[n_free_directory_entries - 1];
+    }
+    if (root_directory_end_entry == root_directory_max_content_size && extend_root_directory(fd) == FAILURE) {
+        return FAILURE;
+    }
+    return root_directory_end_entry;
+}
+
+// Update the name index and the free entries when the entry is changed from the old entry to the new entry
+void update_root_directory_index(int directory_entry_index, unsigned char* old_entry_raw, unsigned char* new_entry_raw) {
+    int was_free = old_entry_raw[0] == 0x00 || old_entry_raw[0] == 0xE5;
+    int is_free = new_entry_raw[0] == 0x00 || new_entry_raw[0] == 0xE5;
+    int was_indexed = is_indexed_file_entry((struct msdos_dir_entry*) old_entry_raw);
+    int is_indexed = is_indexed_file_entry((struct msdos_dir_entry*) new_entry_raw);
+
+    // Keep the names of the unchanged files in the index
+    if (was_indexed && is_indexed && memcmp(old_entry_raw, new_entry_raw, TOTAL_FILENAME_SIZE) == 0) {
+        return;
+    }
+    if (was_indexed) {
+        remove_from_name_index(directory_entry_index);
+    }
 
-            // Loop through the file extension same as the file name
-            for (int j = FILENAME_SIZE; j < TOTAL_FILENAME_SIZE; j++) {
-                if (isalnum(file_directory_entry->name[j]) || file_directory_entry->name[j] == '-'
-                    || file_directory_entry->name[j] == '_') {
-                    total_file_name[file_name_index++] = file_directory_entry->name[j];
-                } else {
+    if (was_free && !is_free) {
+        if (directory_entry_index >= root_directory_end_entry) {
+            // The entries between the old and the new end are free
+            for (int i = root_directory_end_entry; i < directory_entry_index; i++) {
+                free_directory_entries[n_free_directory_entries++] = i;
+            }
+            root_directory_end_entry = directory_entry_index + 1;
+        } else {
+            // The entry is usually the last returned free entry
+            for (int i = n_free_directory_entries - 1; i >= 0; i--) {
+                if (free_directory_entries[i] == directory_entry_index) {
+                    memmove(free_directory_entries + i, free_directory_entries + i + 1, (n_free_directory_entries - i - 1) * sizeof(int));
+                    n_free_directory_entries--;
                     break;
                 }
             }
+        }
+    } else if (!was_free && is_free && directory_entry_index < root_directory_end_entry) {
+        free_directory_entries[n_free_directory_entries++] = directory_entry_index;
+    }
 
-            // Add a dot between the file name and extension if the extension is not empty 
-            if (dot_index + 1 != file_name_index) {
-                total_file_name[dot_index] = '.';
-            }
+    if (is_indexed) {
+        // The new entry is written to the directory after the update, so the index reads its name from here
+        memcpy(root_directory + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE, new_entry_raw, FILE_DIRECTORY_ENTRY_SIZE);
+        insert_into_name_index(directory_entry_index);
+    }
+}
 
-            // Print the file name and extension if the LIST_DIRECTORIES option is set
-            if (option == LIST_DIRECTORIES) {
-                // Print the file name and extension and size of the file
-                printf("%s %d\n", total_file_name, file_directory_entry->size);
-            } else {
-                // Find the entry with the given file name and extension
-                // and set the file_directory_entry pointer to that entry
-                // If the entry is not found, set the file_directory_entry pointer to NULL
-                // If the entry is found, break the loop
-
-                // Check if the file name and extension match the given file name and extension
-                // If they match, return the index of the entry
-                if (strcmp(total_file_name, input_file_name) == 0) {
-                    return i;
-                }
-            }
+// Check if the entry is a file that can be found by its name
+int is_indexed_file_entry(struct msdos_dir_entry* entry) {
+    return entry->name[0] != 0x00 && entry->name[0] != 0xE5 && entry->attr == 0x20;
+}
+
+// Get the file name and extension of the entry by inserting a dot between them
+// File name is 11 bytes long consisting of 8 bytes for the name and 3 bytes for the extension
+// Only the following characters are taken: letters, digits, -, _
+void get_file_name_of_entry(struct msdos_dir_entry* entry, char* file_name) {
+    memset(file_name, '\0', TOTAL_FILENAME_SIZE + DOT_SIZE);
+
+    // Loop through the file name
+    int file_name_index = 0;
+    for (int j = 0; j < FILENAME_SIZE; j++) {
+        if (isalnum(entry->name[j]) || entry->name[j] == '-' || entry->name[j] == '_') {
+            file_name[file_name_index++] = entry->name[j];
         } else {
-            // This entry is invalid
-            printf("WARNING: Detected invalid entry!\n");
+            break;
         }
     }
 
-    // If the option is LIST_DIRECTORIES, return SUCCESS as the operation is successful
-    if (option == LIST_DIRECTORIES) {
+    // Remember the index of the dot
+    int dot_index = file_name_index;
+    // Increment the file name index by 1 for the dot
+    file_name_index++;
+
+    // Loop through the file extension same as the file name
+    for (int j = FILENAME_SIZE; j < TOTAL_FILENAME_SIZE; j++) {
+        if (isalnum(entry->name[j]) || entry->name[j] == '-' || entry->name[j] == '_') {
+            file_name[file_name_index++] = entry->name[j];
+        } else {
+            break;
+        }
+    }
+
+    // Add a dot between the file name and extension if the extension is not empty
+    if (dot_index + 1 != file_name_index) {
+        file_name[dot_index] = '.';
+    }
+}
+
+// Pack the file name and extension into the 11 byte form of the directory entries, padded with spaces
+void pack_file_name(const char* file_name, unsigned char* packed_name) {
+    memset(packed_name, ' ', TOTAL_FILENAME_SIZE);
+    const char* dot = strchr(file_name, '.');
+    int name_length = dot != NULL ? dot - file_name : strlen(file_name);
+    memcpy(packed_name, file_name, name_length < FILENAME_SIZE ? name_length : FILENAME_SIZE);
+    if (dot != NULL) {
+        int extension_length = strlen(dot + 1);
+        memcpy(packed_name + FILENAME_SIZE, dot + 1, extension_length < FILE_EXTENSION_SIZE ? extension_length : FILE_EXTENSION_SIZE);
+    }
+}
+
+// FNV-1a hash of the packed file name
+unsigned int hash_packed_file_name(const unsigned char* packed_name) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < TOTAL_FILENAME_SIZE; i++) {
+        hash = (hash ^ packed_name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Return the slot of the name index that holds the packed file name, or FAILURE if it is not indexed
+int find_name_index_slot(const unsigned char* packed_name) {
+    unsigned int mask = name_index_capacity - 1;
+    for (unsigned int slot = hash_packed_file_name(packed_name) & mask;; slot = (slot + 1) & mask) {
+        int directory_entry_index = name_index[slot];
+        if (directory_entry_index == NAME_INDEX_EMPTY_SLOT) {
+            return FAILURE;
+        }
+        if (directory_entry_index >= 0
+            && memcmp(root_directory_names + directory_entry_index * (TOTAL_FILENAME_SIZE), packed_name, TOTAL_FILENAME_SIZE) == 0) {
+            return slot;
+        }
+    }
+}
+
+// Add the name of the file entry to the name index, the index is doubled when it is half full
+int insert_into_name_index(int directory_entry_index) {
+    if ((name_index_used_slots + 1) * 2 > name_index_capacity && resize_name_index(name_index_capacity * 2) == FAILURE) {
+        return FAILURE;
+    }
+
+    // The name is packed the way it is found, from the valid characters of the entry
+    char file_name[TOTAL_FILENAME_SIZE + DOT_SIZE];
+    unsigned char* packed_name = root_directory_names + directory_entry_index * (TOTAL_FILENAME_SIZE);
+    get_file_name_of_entry((struct msdos_dir_entry*) (root_directory + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE), file_name);
+    pack_file_name(file_name, packed_name);
+
+    // The first entry with a name is found, like the first match of a directory scan
+    if (find_name_index_slot(packed_name) >= 0) {
         return SUCCESS;
-    } else {
+    }
+
+    unsigned int mask = name_index_capacity - 1;
+    unsigned int slot = hash_packed_file_name(packed_name) & mask;
+    while (name_index[slot] >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    if (name_index[slot] == NAME_INDEX_EMPTY_SLOT) {
+        name_index_used_slots++;
+    }
+    name_index[slot] = directory_entry_index;
+    return SUCCESS;
+}
+
+// Remove the name of the file entry from the name index, its slot is marked deleted to keep the probe sequences
+void remove_from_name_index(int directory_entry_index) {
+    int slot = find_name_index_slot(root_directory_names + directory_entry_index * (TOTAL_FILENAME_SIZE));
+    if (slot >= 0 && name_index[slot] == directory_entry_index) {
+        name_index[slot] = NAME_INDEX_DELETED_SLOT;
+    }
+}
+
+// Rebuild the name index with the given number of slots, the deleted slots are dropped
+int resize_name_index(int capacity) {
+    int* old_name_index = name_index;
+    int old_capacity = name_index_capacity;
+
+    name_index = malloc(capacity * sizeof(int));
+    if (name_index == NULL) {
+        printf("Could not allocate memory for the name index!\n");
+        name_index = old_name_index;
         return FAILURE;
     }
+    for (int i = 0; i < capacity; i++) {
+        name_index[i] = NAME_INDEX_EMPTY_SLOT;
+    }
+    name_index_capacity = capacity;
+    name_index_used_slots = 0;
+
+    unsigned int mask = capacity - 1;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_name_index[i] >= 0) {
+            unsigned int slot = hash_packed_file_name(root_directory_names + old_name_index[i] * (TOTAL_FILENAME_SIZE)) & mask;
+            while (name_index[slot] != NAME_INDEX_EMPTY_SLOT) {
+                slot = (slot + 1) & mask;
+            }
+            name_index[slot] = old_name_index[i];
+            name_index_used_slots++;
+        }
+    }
+    free(old_name_index);
+
+    return SUCCESS;
+}
+
+// Return the offset of the cluster in the disk image
+off_t get_cluster_offset(unsigned int cluster_number) {
+    return root_directory_cluster_offset + ((off_t) (cluster_number - 2) << cluster_size_shift);
 }
 
 // Read a cluster from the disk image
 int read_cluster(int fd, unsigned char* buffer, unsigned int cluster_number) {
     // Calculate the offset
-    off_t offset = root_directory_cluster_offset
-        + ((cluster_number - 2) * sectors_per_cluster) * SECTORSIZE;
-    lseek(fd, offset, SEEK_SET);
+    off_t offset = get_cluster_offset(cluster_number);
 
     // Read the cluster
-    int result = read(fd, buffer, SECTORSIZE * sectors_per_cluster);
+    STATS_TIMER_START(start);
+    int result = storage->read_at(fd, buffer, cluster_size, offset);
+    STATS_TIMER_END(STATS_READ_CLUSTER, start, result);
 
-    if (result == SECTORSIZE * sectors_per_cluster) {
+    if (result == cluster_size) {
         return SUCCESS;
     } else {
         return FAILURE;
@@ -851,13 +7002,14 @@ int read_cluster(int fd, unsigned char* buffer, unsigned int cluster_number) {
 // Read a sector from the disk image    
 int read_sector(int fd, unsigned char* buffer, unsigned int sector_number) {
     // Calculate the offset
-    off_t offset = sector_number * SECTORSIZE;
-    lseek(fd, offset, SEEK_SET);
+    off_t offset = (off_t) sector_number * sector_size;
 
     // Read the sector
-    int result = read(fd, buffer, SECTORSIZE);
+    STATS_TIMER_START(start);
+    int result = storage->read_at(fd, buffer, sector_size, offset);
+    STATS_TIMER_END(STATS_READ_SECTOR, start, result);
 
-    if (result == SECTORSIZE) {
+    if (result == sector_size) {
         return SUCCESS;
     } else {
         return FAILURE;
@@ -867,15 +7019,15 @@ int read_sector(int fd, unsigned char* buffer, unsigned int sector_number) {
 // Write a cluster to the disk image
 int write_cluster(int fd, unsigned char* buffer, unsigned int cluster_number) {
     // Calculate the offset
-    off_t offset = root_directory_cluster_offset
-        + ((cluster_number - 2) * sectors_per_cluster) * SECTORSIZE;
-    lseek(fd, offset, SEEK_SET);
+    off_t offset = get_cluster_offset(cluster_number);
 
     // Write the cluster
-    int result = write(fd, buffer, SECTORSIZE * sectors_per_cluster);
-    fsync(fd);
+    STATS_TIMER_START(start);
+    int result = storage->write_at(fd, buffer, cluster_size, offset);
+    sync_disk_image(fd);
+    STATS_TIMER_END(STATS_WRITE_CLUSTER, start, result);
 
-    if (result == SECTORSIZE * sectors_per_cluster) {
+    if (result == sector_size * sectors_per_cluster) {
         return SUCCESS;
     } else {
         return FAILURE;
@@ -885,58 +7037,127 @@ int write_cluster(int fd, unsigned char* buffer, unsigned int cluster_number) {
 // Write a sector to the disk image
 int write_sector(int fd, unsigned char* buffer, unsigned int sector_number) {
     // Calculate the offset
-    off_t offset = sector_number * SECTORSIZE;
-    lseek(fd, offset, SEEK_SET);
+    off_t offset = (off_t) sector_number * sector_size;
 
     // Write the sector
-    int result = write(fd, buffer, SECTORSIZE);
-    fsync(fd);
+    int result = storage->write_at(fd, buffer, sector_size, offset);
+    sync_disk_image(fd);
 
-    if (result == SECTORSIZE) {
+    if (result == sector_size) {
         return SUCCESS;
     } else {
         return FAILURE;
     }
 }
 
-// Write a fat table entry to the disk image
+// Write a fat table entry to the FAT table cache and mark its sector dirty
+// The entry is written to the disk image when the FAT table cache is flushed
 int write_fat_table_entry(int fd, unsigned int cluster_number, unsigned int value) {
-    // Calculate the offset
-    off_t offset = fat_table_offset + cluster_number * FAT_TABLE_ENTRY_SIZE;
-    lseek(fd, offset, SEEK_SET);
-
-    // Convert the value to 4 bytes in little-endian order
-    int_to_unsigned_bytes(value, fat_table_entry);
+    // Load the FAT table to the memory on the first access
+    if (fat_table_cache == NULL && load_fat_table_cache(fd) == FAILURE) {
+        return FAILURE;
+    }
 
-    // Write the FAT table
-    int result = write(fd, fat_table_entry, FAT_TABLE_ENTRY_SIZE);
-    fsync(fd);
+    // Check if the cluster number is in the FAT table
+    if (cluster_number >= fat_size * sector_size / FAT_TABLE_ENTRY_SIZE) {
+        return FAILURE;
+    }
 
-    if (result == FAT_TABLE_ENTRY_SIZE) {
-        return SUCCESS;
-    } else {
+    // The mapped FAT table is copied before the first change
+    if (is_fat_table_cache_mapped && make_fat_table_cache_private() == FAILURE) {
         return FAILURE;
     }
-}
 
-// Write the file directory entry to the root directory 
-int write_file_directory_entry(int fd, int directory_entry_index) {
-    // Calculate the offset
-    off_t offset = root_directory_cluster_offset
-        + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE;
-    lseek(fd, offset, SEEK_SET);
+    // Convert the value to 4 bytes in little-endian order
+    int_to_unsigned_bytes(value, fat_table_cache + cluster_number * FAT_TABLE_ENTRY_SIZE);
+    STATS_COUNT(STATS_WRITE_FAT_TABLE_ENTRY, FAT_TABLE_ENTRY_SIZE);
+
+    // Mark the sector of the entry dirty, the free cluster count of the FSInfo sector may be changed
+    fs_info_sector_dirty = 1;
+    is_index_dirty = 1;
+    is_index_fat_changed = 1;
+    int sector = cluster_number * FAT_TABLE_ENTRY_SIZE / sector_size;
+    fat_table_cache_dirty_sectors[sector] = 1;
+    if (fat_table_cache_first_dirty_sector < 0 || sector < fat_table_cache_first_dirty_sector) {
+        fat_table_cache_first_dirty_sector = sector;
+    }
+    if (sector > fat_table_cache_last_dirty_sector) {
+        fat_table_cache_last_dirty_sector = sector;
+    }
 
-    // Write the file directory entry to the root directory
-    int result = write(fd, file_directory_entry_raw, FILE_DIRECTORY_ENTRY_SIZE);
-    fsync(fd);
+    return SUCCESS;
+}
 
-    if (result < 0) {
+// Write the file directory entry to the cached root directory and mark it dirty
+// The changed entries are written to the disk image when the disk image is flushed
+int write_file_directory_entry(int fd, int directory_entry_index) {
+    if (directory_entry_index < 0 || directory_entry_index >= root_directory_max_content_size) {
         return FAILURE;
     }
 
+    // Keep the name index and the free entries in sync with the entry
+    unsigned char* entry = root_directory + directory_entry_index * FILE_DIRECTORY_ENTRY_SIZE;
+    unsigned char old_entry_raw[FILE_DIRECTORY_ENTRY_SIZE];
+    memcpy(old_entry_raw, entry, FILE_DIRECTORY_ENTRY_SIZE);
+    update_root_directory_index(directory_entry_index, old_entry_raw, file_directory_entry_raw);
+
+    memcpy(entry, file_directory_entry_raw, FILE_DIRECTORY_ENTRY_SIZE);
+    STATS_COUNT(STATS_WRITE_FILE_DIRECTORY_ENTRY, FILE_DIRECTORY_ENTRY_SIZE);
+    is_index_dirty = 1;
+    if (index_changed_entries != NULL) {
+        index_changed_entries[directory_entry_index] = 1;
+    }
+    root_directory_dirty_clusters[directory_entry_index / (cluster_size / FILE_DIRECTORY_ENTRY_SIZE)] = 1;
+    if (root_directory_first_dirty_entry < 0 || directory_entry_index < root_directory_first_dirty_entry) {
+        root_directory_first_dirty_entry = directory_entry_index;
+    }
+    if (directory_entry_index > root_directory_last_dirty_entry) {
+        root_directory_last_dirty_entry = directory_entry_index;
+    }
+
     return SUCCESS;
 }
 
+// Write the range of the changed entries of each changed cluster of the cached root directory to the disk image
+// The entries of a cluster are written with a single write
+int flush_root_directory(int fd) {
+    if (root_directory_first_dirty_entry < 0) {
+        return SUCCESS;
+    }
+
+    int result = SUCCESS;
+    int entries_per_cluster = cluster_size / FILE_DIRECTORY_ENTRY_SIZE;
+    int last_dirty_cluster = root_directory_last_dirty_entry / entries_per_cluster;
+    for (int i = root_directory_first_dirty_entry / entries_per_cluster; i <= last_dirty_cluster; i++) {
+        if (!root_directory_dirty_clusters[i]) {
+            continue;
+        }
+        root_directory_dirty_clusters[i] = 0;
+
+        // Calculate the offset and the length of the range in the cluster
+        int first_entry = i * entries_per_cluster;
+        int last_entry = first_entry + entries_per_cluster - 1;
+        first_entry = first_entry > root_directory_first_dirty_entry ? first_entry : root_directory_first_dirty_entry;
+        last_entry = last_entry < root_directory_last_dirty_entry ? last_entry : root_directory_last_dirty_entry;
+        off_t offset = get_cluster_offset(root_directory_clusters[i])
+            + (first_entry - i * entries_per_cluster) * FILE_DIRECTORY_ENTRY_SIZE;
+        ssize_t length = (last_entry - first_entry + 1) * FILE_DIRECTORY_ENTRY_SIZE;
+
+        unsigned char* entries = root_directory + first_entry * FILE_DIRECTORY_ENTRY_SIZE;
+        if (is_journal_transaction_open) {
+            if (add_journal_range(offset, entries, length, 0) == FAILURE) {
+                result = FAILURE;
+            }
+        } else if (storage->write_at(fd, entries, length, offset) != length) {
+            result = FAILURE;
+        }
+    }
+    root_directory_first_dirty_entry = -1;
+    root_directory_last_dirty_entry = -1;
+
+    return result;
+}
+
 // Function to print the help message about the usage of the program
 void print_help_message() {
     printf("Usage: fatmod <diskname> <options>\n");
@@ -947,7 +7168,27 @@ void print_help_message() {
     printf("-w <file> <offset> <length> <data>: Write data[0-255] to file\n");
     printf("-r -b <file>: Read and print the file in binary\n");
     printf("-r -a <file>: Read and print the file in ASCII\n");
-    printf("-d <file>: Delete the file\n");
+    printf("-x <file> [<host file>]: Export the raw contents of the file to stdout or to the host file\n");
+    printf("-i <file> [<host file>]: Import the host file or stdin into the file, creating it if needed\n");
+    printf("-t <file> <size> [-z]: Shrink or grow the file to the size, -z zeroes the new bytes\n");
+    printf("-d <file>...: Delete the files, the names can be patterns(*, ? and [...])\n");
+    printf("-defrag [<file>]: Move the file, or every file, to contiguous clusters\n");
+    printf("-check: Check the FAT table and the file chains for errors without changing the disk image\n");
+    printf("-mkfs <size>[K|M|G] [<cluster size> [<FAT tables>]]: Format the disk image as an empty FAT32 volume of at least 33M(default 1024 byte clusters and 2 FAT tables, smaller clusters if FAT32 would have fewer than 65525)\n");
+    printf("-snapshot <new image>: Clone the disk image, sharing its blocks with a reflink if the file system supports it\n");
+    printf("-diff <other image>: Compare the FAT table, the clusters and the files with another image of the same geometry\n");
+    printf("-B <file>: Run the commands in the file, one per line without the disk name(- for stdin)\n");
+    printf("--sync=always|op|none: Sync after every write, once per operation(default) or never\n");
+    printf("--mmap: Access the disk image through a memory mapping\n");
+    printf("--io-uring: Access the disk image through io_uring with reads queued ahead\n");
+    printf("--read-ahead=<KB>: Read ahead this much of the cluster chain(default 512, 0 disables it)\n");
+    printf("--read-ahead-stats: Print the read-ahead hits and misses to stderr\n");
+    printf("--read-threads=<n>: Read and format large files with n threads(default 0, one for each processor)\n");
+    printf("--stats: Print the I/O operation counters and latencies as JSON to stderr\n");
+    printf("--index: Keep a sidecar index <disk image>.fatidx and use it instead of the FAT table while it is valid\n");
+    printf("--shared-fat: Share the FAT table with the other processes of the disk image, so writers of different files run concurrently\n");
+    printf("--serve <socket>: Keep the disk image open and serve the requests of the clients of the Unix socket\n");
+    printf("--journal: Commit the FAT table and directory changes of each operation atomically to a journal in the reserved sectors\n");
 }
 
 // Check if the value is negative, if it is, convert it to a positive value
@@ -995,6 +7236,16 @@ void int_to_unsigned_bytes(int val, unsigned char* bytes) {
     bytes[3] = (char) ((val >> 24) & 0xFF);
 }
 
+// Copy the file name of a command to the global file name and check if it is valid
+// The length is checked before the copy, the names of the batch files may be of any length
+int set_input_file_name(char* name) {
+    if (strlen(name) > TOTAL_FILENAME_SIZE) {
+        return FAILURE;
+    }
+    strcpy(input_file_name, name);
+    return check_set_file_name(input_file_name);
+}
+
 // Check if the file name is valid
 int check_set_file_name(char* str) {
     // Check if the file name is empty
@@ -1023,6 +7274,22 @@ int check_set_file_name(char* str) {
     return SUCCESS;
 }
 
+// Check the characters of the file name pattern and convert it to uppercase like the file names
+int check_file_name_pattern(char* str) {
+    if (strlen(str) == 0 || strlen(str) > PATH_MAX) {
+        return FAILURE;
+    }
+
+    for (int i = 0; i < strlen(str); i++) {
+        str[i] = toupper(str[i]);
+        if (!isalnum(str[i]) && strchr("-_.*?[]!", str[i]) == NULL) {
+            return FAILURE;
+        }
+    }
+
+    return SUCCESS;
+}
+
 // Get the length of the ascii string by traversing the string
 // if the character is not an uppercase letter, lowercase letter, digit, -, _, or ., 
 // increase the length of the string by 1